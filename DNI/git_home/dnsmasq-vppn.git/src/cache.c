@@ -12,15 +12,68 @@
 
 #include "dnsmasq.h"
 
-static struct crec *cache_head, *cache_tail, **hash_table;
+/* The name index is open addressed, in buckets which fill a cache line
+   (with 64 bit pointers). Each slot has a tag, a byte of the hash of
+   the name of the entry in it, or zero when empty. The tags of a bucket
+   make up one word, so they can all be matched at once, and names are
+   only compared when a tag matches. An entry goes in the first free slot
+   from the bucket its hash selects; each full bucket passed over on the
+   way counts it in overflow, so that a search can stop at the first
+   bucket with no overflow. */
+#define BUCKET_SLOTS 7
+
+struct hash_bucket {
+  unsigned char tag[BUCKET_SLOTS];
+  unsigned char overflow; /* sticks at 255 */
+  struct crec *entry[BUCKET_SLOTS];
+};
+
+/* position in a search of the name index */
+struct hash_iter {
+  unsigned int bucket, left;
+  int slot;
+  unsigned char tag;
+  unsigned long long match;
+};
+
+#define EXPIRY_SLOTS 1024 /* seconds, a power of two */
+#define EXPIRY_LOOK 256
+
+/* The snapshot which --cache-file keeps: a header, the records oldest
+   first, and then their names. Times are wall-clock, so that they mean
+   the same after a restart. */
+#define SNAP_MAGIC "dnsmasqC"
+#define SNAP_VERSION 1
+
+struct snap_header {
+  char magic[8];
+  u32 check; /* version and layout */
+  u32 recs, names;
+  u32 pad;
+  time_t saved;
+};
+
+struct snap_rec {
+  time_t expires;
+  u32 name; /* offset in the names */
+  unsigned short flags;
+  unsigned short pad;
+  unsigned char addr[IN6ADDRSZ];
+};
+
+static struct crec *cache_head, *cache_tail, **rev_table;
+static struct hash_bucket *hash_table;
+static struct crec *expiry_wheel[EXPIRY_SLOTS];
+static time_t expiry_done;
+static void *hash_mem;
 static struct crec *dhcp_spare, *new_chain;
 static int cache_inserted, cache_live_freed, insert_error;
 static union bigname *big_free;
-static int bignames_left, log_queries, cache_size, hash_size;
+static int bignames_left, log_queries, cache_size, hash_size, hash_count, rev_size;
 static int uid;
 static char *addrbuff;
 
-/* type->string mapping: this is also used by the name-hash function as a mixing table. */
+/* type->string mapping */
 static const struct {
   unsigned int type;
   const char * const name;
@@ -56,12 +109,27 @@ static const struct {
   { 255, "ANY" }
 };
 
+/* Negative reverse entries have no name: they are only found by address,
+   so they stay out of the name index, where they would all hash alike. */
+#define NAMELESS(flags) (((flags) & (F_NEG | F_REVERSE)) == (F_NEG | F_REVERSE))
+
 static void cache_free(struct crec *crecp);
 static void cache_unlink(struct crec *crecp);
 static void cache_link(struct crec *crecp);
 static char *record_source(struct hostsfile *add_hosts, int index);
 static void rehash(int size);
 static void cache_hash(struct crec *crecp);
+static void dump_entry(struct daemon *daemon, struct crec *cache, time_t now);
+static void rev_hash(struct crec *crecp);
+static void cache_unhash(struct hash_iter *it);
+static void name_unhash(struct crec *crecp);
+static void rev_unhash(struct crec *crecp);
+static void expiry_add(struct crec *crecp);
+static void expiry_del(struct crec *crecp);
+static struct crec **rev_bucket(struct all_addr *addr, unsigned short flags);
+static struct crec *hash_first(struct hash_iter *it, unsigned int hash);
+static void hash_add(struct crec *crecp);
+static struct crec *hash_next(struct hash_iter *it);
 
 void cache_init(int size, int logq)
 {
@@ -77,6 +145,8 @@ void cache_init(int size, int logq)
   dhcp_spare = NULL;
   new_chain = NULL;
   hash_table = NULL;
+  rev_table = NULL;
+  expiry_done = 0;
   cache_size = size;
   big_free = NULL;
   bignames_left = size/10;
@@ -92,7 +162,9 @@ void cache_init(int size, int logq)
 	{
 	  cache_link(crecp);
 	  crecp->flags = 0;
+	  crecp->prefetch = 0;
 	  crecp->uid = uid++;
+	  crecp->expiry_pprev = NULL;
 	}
     }
   
@@ -100,88 +172,278 @@ void cache_init(int size, int logq)
   rehash(cache_size);
 }
 
-/* In most cases, we create the hash table once here by calling this with (hash_table == NULL)
-   but if the hosts file(s) are big (some people have 50000 ad-block entries), the table
-   will be much too small, so the hosts reading code calls rehash every 1000 addresses, to
-   expand the table. */
+/* We create the hash table once here by calling this with (hash_table == NULL),
+   and cache_hash() expands it if DHCP entries fill it up; the hosts files are
+   indexed separately, in hosts.c. The address index for reverse lookups is
+   rebuilt along with it. */
 static void rehash(int size)
 {
-  struct crec **new, **old, *p, *tmp;
-  int i, new_size, old_size;
-
-  /* hash_size is a power of two. */
-  for (new_size = 64; new_size < size/10; new_size = new_size << 1);
+  struct hash_bucket *new, *old = hash_table;
+  struct crec **new_rev, *p;
+  void *new_mem, *old_mem = hash_mem;
+  int i, j, new_size, new_rev_size, old_size = hash_size;
+
+  /* both sizes are powers of two: at most 5 entries in 7 slots, 10 per address chain */
+  for (new_size = 16; new_size < size/5; new_size = new_size << 1);
+  for (new_rev_size = 64; new_rev_size < size/10; new_rev_size = new_rev_size << 1);
   
   /* must succeed in getting first instance, failure later is non-fatal */
   if (!hash_table)
-    new = safe_malloc(new_size * sizeof(struct crec *));
-  else if (new_size <= hash_size || !(new = malloc(new_size * sizeof(struct crec *))))
+    {
+      new_mem = safe_malloc(new_size * sizeof(struct hash_bucket) + 63);
+      new_rev = safe_malloc(new_rev_size * sizeof(struct crec *));
+    }
+  else if (new_size <= hash_size || !(new_mem = malloc(new_size * sizeof(struct hash_bucket) + 63)))
     return;
+  else if (!(new_rev = malloc(new_rev_size * sizeof(struct crec *))))
+    {
+      free(new_mem);
+      return;
+    }
 
-  for(i = 0; i < new_size; i++)
-    new[i] = NULL;
+  new = (struct hash_bucket *)(((unsigned long)new_mem + 63) & ~63UL);
+  memset(new, 0, new_size * sizeof(struct hash_bucket));
+  for (i = 0; i < new_rev_size; i++)
+    new_rev[i] = NULL;
 
-  old = hash_table;
-  old_size = hash_size;
+  free(rev_table);
+  hash_mem = new_mem;
   hash_table = new;
   hash_size = new_size;
+  hash_count = 0;
+  rev_table = new_rev;
+  rev_size = new_rev_size;
   
   if (old)
     {
       for (i = 0; i < old_size; i++)
-	for (p = old[i]; p ; p = tmp)
-	  {
-	    tmp = p->hash_next;
-	    cache_hash(p);
-	  }
-      free(old);
+	for (j = 0; j < BUCKET_SLOTS; j++)
+	  if ((p = old[i].entry[j]))
+	    {
+	      hash_add(p);
+	      if (p->flags & F_REVERSE)
+		rev_hash(p);
+	    }
+      free(old_mem);
+
+      for (p = cache_head; p; p = p->next)
+	if (NAMELESS(p->flags))
+	  rev_hash(p);
     }
 }
-  
-static struct crec **hash_bucket(char *name)
+
+#define HASH_TAG(hash) ((hash) >> 24 ? (hash) >> 24 : 1)
+
+/* A bit for each slot of bucket b whose tag may be tag: there can be
+   false positives, but only where another slot matches. The word is
+   put together in the same order whatever the byte order. */
+#define TAG_SLOTS 0x0080808080808080ULL
+#define tag_slot(m) (__builtin_ctzll(m) >> 3)
+
+static unsigned long long tag_match(struct hash_bucket *b, unsigned char tag)
+{
+  unsigned long long w = 0;
+  int i;
+
+  for (i = BUCKET_SLOTS - 1; i >= 0; i--)
+    w = (w << 8) | b->tag[i];
+
+  w ^= 0x0101010101010101ULL * tag;
+  return (w - 0x0101010101010101ULL) & ~w & TAG_SLOTS;
+}
+
+/* Entries whose tag matches hash: the caller compares names. */
+static struct crec *hash_first(struct hash_iter *it, unsigned int hash)
 {
-  unsigned int c, val = 017465; /* Barker code - minimum self-correlation in cyclic shift */
-  const unsigned char *mix_tab = (const unsigned char*)typestr; 
+  it->bucket = hash & (hash_size - 1);
+  it->left = hash_size;
+  it->tag = HASH_TAG(hash);
+  it->match = tag_match(&hash_table[it->bucket], it->tag);
+  return hash_next(it);
+}
 
-  while((c = (unsigned char) *name++))
+static struct crec *hash_next(struct hash_iter *it)
+{
+  while (1)
     {
-      /* don't use tolower and friends here - they may be messed up by LOCALE */
-      if (c >= 'A' && c <= 'Z')
-	c += 'a' - 'A';
-      val = ((val << 7) | (val >> (32 - 7))) + (mix_tab[(val + c) & 0x3F] ^ c);
-    } 
-  
-  /* hash_size is a power of two */
-  return hash_table + ((val ^ (val >> 16)) & (hash_size - 1));
+      struct hash_bucket *b = &hash_table[it->bucket];
+
+      while (it->match)
+	{
+	  int slot = tag_slot(it->match);
+	  
+	  it->match &= it->match - 1;
+	  if (b->tag[slot] == it->tag)
+	    {
+	      it->slot = slot;
+	      return b->entry[slot];
+	    }
+	}
+      
+      if (b->overflow == 0 || --it->left == 0)
+	return NULL;
+
+      it->bucket = (it->bucket + 1) & (hash_size - 1);
+      it->match = tag_match(&hash_table[it->bucket], it->tag);
+    }
 }
 
-static void cache_hash(struct crec *crecp)
+/* empty a slot, and take the entry out of the overflow counts on the
+   way to it */
+static void hash_clear(unsigned int bucket, int slot)
+{
+  struct hash_bucket *b = &hash_table[bucket];
+  unsigned int i = b->entry[slot]->hash & (hash_size - 1);
+
+  for (; i != bucket; i = (i + 1) & (hash_size - 1))
+    if (hash_table[i].overflow != 255)
+      hash_table[i].overflow--;
+
+  b->tag[slot] = 0;
+  b->entry[slot] = NULL;
+  hash_count--;
+}
+
+static struct crec **rev_bucket(struct all_addr *addr, unsigned short flags)
+{
+  const unsigned char *p = (const unsigned char *)addr;
+  unsigned int val = 0;
+#ifdef HAVE_IPV6
+  int len = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
+#else
+  int len = INADDRSZ;
+  (void)flags;
+#endif
+
+  while (len--)
+    val = (val * 31) + *p++;
+
+  return rev_table + ((val ^ (val >> 16)) & (rev_size - 1));
+}
+
+/* put an entry whose hash is set into the first free slot */
+static void hash_add(struct crec *crecp)
 {
-  /* maintain an invariant that all entries with F_REVERSE set
-     are at the start of the hash-chain  and all non-reverse
-     immortal entries are at the end of the hash-chain.
-     This allows reverse searches and garbage collection to be optimised */
+  unsigned int i = crecp->hash & (hash_size - 1);
+  int slot;
 
-  struct crec **up = hash_bucket(cache_get_name(crecp));
+  if (hash_count == hash_size * BUCKET_SLOTS)
+    return; /* out of memory: the entry just can't be found */
 
-  if (!(crecp->flags & F_REVERSE))
+  for (;; i = (i + 1) & (hash_size - 1))
     {
-      while (*up && ((*up)->flags & F_REVERSE))
-	up = &((*up)->hash_next); 
+      struct hash_bucket *b = &hash_table[i];
       
-      if (crecp->flags & F_IMMORTAL)
-	while (*up && !((*up)->flags & F_IMMORTAL))
-	  up = &((*up)->hash_next);
+      for (slot = 0; slot < BUCKET_SLOTS; slot++)
+	if (b->tag[slot] == 0)
+	  {
+	    b->tag[slot] = HASH_TAG(crecp->hash);
+	    b->entry[slot] = crecp;
+	    hash_count++;
+	    return;
+	  }
+
+      if (b->overflow != 255)
+	b->overflow++;
+    }
+}
+
+static void cache_hash(struct crec *crecp)
+{
+  /* keep it no more than 7/8 full, if we can */
+  if (hash_count >= hash_size * BUCKET_SLOTS * 7 / 8)
+    rehash(hash_count * 2);
+
+  if (!NAMELESS(crecp->flags))
+    {
+      crecp->hash = hostname_hash(cache_get_name(crecp));
+      hash_add(crecp);
     }
-  crecp->hash_next = *up;
+
+  if (crecp->flags & F_REVERSE)
+    rev_hash(crecp);
+}
+
+/* reverse entries are also indexed by address, for cache_find_by_addr() */
+static void rev_hash(struct crec *crecp)
+{
+  struct crec **up = rev_bucket(&crecp->addr.addr, crecp->flags);
+
+  crecp->rev_next = *up;
   *up = crecp;
 }
+
+/* remove the entry a search is at from the name index, and from the address index */
+static void cache_unhash(struct hash_iter *it)
+{
+  struct crec *crecp = hash_table[it->bucket].entry[it->slot];
+  
+  hash_clear(it->bucket, it->slot);
+
+  if (crecp->flags & F_REVERSE)
+    rev_unhash(crecp);
+}
+
+static void rev_unhash(struct crec *crecp)
+{
+  struct crec **up;
+
+  for (up = rev_bucket(&crecp->addr.addr, crecp->flags); *up; up = &(*up)->rev_next)
+    if (*up == crecp)
+      {
+	*up = crecp->rev_next;
+	break;
+      }
+}
+
+/* remove an entry found by address from the name index */
+static void name_unhash(struct crec *crecp)
+{
+  struct hash_iter it;
+  struct crec *p;
+
+  if (NAMELESS(crecp->flags))
+    return;
+
+  for (p = hash_first(&it, crecp->hash); p; p = hash_next(&it))
+    if (p == crecp)
+      {
+	hash_clear(it.bucket, it.slot);
+	break;
+      }
+}
  
+/* Cache entries which can expire are also kept in a wheel of one second
+   slots on their time to die, so that cache_insert() can find the expired
+   ones without looking at the rest. An entry due more than EXPIRY_SLOTS
+   seconds out is passed over when its slot comes round, until the lap it
+   expires on. Only entries from the cache itself go in it: /etc/hosts and
+   DHCP entries are freed elsewhere. */
+static void expiry_add(struct crec *crecp)
+{
+  struct crec **slot = &expiry_wheel[(unsigned long)crecp->ttd & (EXPIRY_SLOTS - 1)];
+
+  if ((crecp->expiry_next = *slot))
+    crecp->expiry_next->expiry_pprev = &crecp->expiry_next;
+  crecp->expiry_pprev = slot;
+  *slot = crecp;
+}
+
+static void expiry_del(struct crec *crecp)
+{
+  if ((*crecp->expiry_pprev = crecp->expiry_next))
+    crecp->expiry_next->expiry_pprev = crecp->expiry_pprev;
+  crecp->expiry_pprev = NULL;
+}
+
 static void cache_free(struct crec *crecp)
 {
+  if (crecp->expiry_pprev)
+    expiry_del(crecp);
   crecp->flags &= ~F_FORWARD;
   crecp->flags &= ~F_REVERSE;
   crecp->uid = uid++; /* invalidate CNAMES pointing to this. */
+  prefetch_freed(crecp);
   
   if (cache_tail)
     cache_tail->next = crecp;
@@ -263,29 +525,66 @@ static int is_expired(time_t now, struct crec *crecp)
   return 1;
 }
 
+/* Free the expired entries in the slots since the last one done, and
+   return how many. A slot is done once its second is over. This stops at
+   the first slot with any to free, or once it has looked at EXPIRY_LOOK
+   entries which are due on a later lap, so that the work is spread over
+   the inserts which need it. */
+static int cache_expire(time_t now)
+{
+  struct crec *crecp, *tmp;
+  double behind = difftime(now, expiry_done);
+  int freed = 0, looked = 0;
+
+  /* the clock jumped: go back no more than a lap, and never forwards */
+  if (behind < 0)
+    expiry_done = now;
+  else if (behind > EXPIRY_SLOTS)
+    expiry_done = now - EXPIRY_SLOTS;
+  
+  for (; freed == 0 && looked < EXPIRY_LOOK && difftime(now, expiry_done) > 0; expiry_done++)
+    for (crecp = expiry_wheel[(unsigned long)expiry_done & (EXPIRY_SLOTS - 1)]; crecp; crecp = tmp)
+      {
+	tmp = crecp->expiry_next;
+	if (!is_expired(now, crecp))
+	  looked++;
+	else
+	  {
+	    name_unhash(crecp);
+	    if (crecp->flags & F_REVERSE)
+	      rev_unhash(crecp);
+	    cache_unlink(crecp);
+	    cache_free(crecp);
+	    freed++;
+	  }
+      }
+
+  return freed;
+}
+
 static int cache_scan_free(char *name, struct all_addr *addr, time_t now, unsigned short flags)
 {
   /* Scan and remove old entries.
      If (flags & F_FORWARD) then remove any forward entries for name and any expired
      entries but only in the same hash bucket as name.
      If (flags & F_REVERSE) then remove any reverse entries for addr and any expired
-     entries in the whole cache.
-     If (flags == 0) remove any expired entries in the whole cache. 
+     entries but only in the same bucket of the address index as addr.
 
      In the flags & F_FORWARD case, the return code is valid, and returns zero if the
-     name exists in the cache as a HOSTS or DHCP entry (these are never deleted)
-
-     We take advantage of the fact that hash chains have stuff in the order <reverse>,<other>,<immortal>
-     so that when we hit an entry which isn't reverse and is immortal, we're done. */
+     name exists in the cache as a HOSTS or DHCP entry (these are never deleted) */
  
   struct crec *crecp, **up;
+  struct hash_iter it;
   
   if (flags & F_FORWARD)
     {
-      for (up = hash_bucket(name), crecp = *up; crecp; crecp = crecp->hash_next)
+      if (hosts_find_by_name(&crecp, name, (flags & F_CNAME) ? F_IPV4 | F_IPV6 : flags & (F_IPV4 | F_IPV6)) != &crecp)
+	return 0;
+
+      for (crecp = hash_first(&it, hostname_hash(name)); crecp; crecp = hash_next(&it))
 	if (is_expired(now, crecp) || is_outdated_cname_pointer(crecp))
 	  { 
-	    *up = crecp->hash_next;
+	    cache_unhash(&it);
 	    if (!(crecp->flags & (F_HOSTS | F_DHCP)))
 	      {
 		cache_unlink(crecp);
@@ -298,45 +597,38 @@ static int cache_scan_free(char *name, struct all_addr *addr, time_t now, unsign
 	  {
 	    if (crecp->flags & (F_HOSTS | F_DHCP))
 	      return 0;
-	    *up = crecp->hash_next;
+	    cache_unhash(&it);
 	    cache_unlink(crecp);
 	    cache_free(crecp);
 	  }
-	else
-	  up = &crecp->hash_next;
     }
-  else
+  else if (flags & F_REVERSE)
     {
-      int i;
+      struct crec *tmp;
 #ifdef HAVE_IPV6
       int addrlen = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
 #else
       int addrlen = INADDRSZ;
 #endif 
-      for (i = 0; i < hash_size; i++)
-	for (crecp = hash_table[i], up = &hash_table[i]; 
-	     crecp && ((crecp->flags & F_REVERSE) || !(crecp->flags & F_IMMORTAL));
-	     crecp = crecp->hash_next)
-	  if (is_expired(now, crecp))
+      for (up = rev_bucket(addr, flags), crecp = *up; crecp; crecp = tmp)
+	{
+	  tmp = crecp->rev_next;
+	  if (is_expired(now, crecp) ||
+	      (!(crecp->flags & (F_HOSTS | F_DHCP)) &&
+	       (flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
+	       memcmp(&crecp->addr.addr, addr, addrlen) == 0))
 	    {
-	      *up = crecp->hash_next;
+	      *up = tmp;
+	      name_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP)))
 		{ 
 		  cache_unlink(crecp);
 		  cache_free(crecp);
 		}
 	    }
-	  else if (!(crecp->flags & (F_HOSTS | F_DHCP)) &&
-		   (flags & crecp->flags & F_REVERSE) && 
-		   (flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
-		   memcmp(&crecp->addr.addr, addr, addrlen) == 0)
-	    {
-	      *up = crecp->hash_next;
-	      cache_unlink(crecp);
-	      cache_free(crecp);
-	    }
 	  else
-	    up = &crecp->hash_next;
+	    up = &crecp->rev_next;
+	}
     }
   
   return 1;
@@ -350,6 +642,21 @@ static int cache_scan_free(char *name, struct all_addr *addr, time_t now, unsign
    but an abort can cause the cache_end_insert to be missed 
    in which can the next cache_start_insert cleans things up. */
 
+static union bigname *big_alloc(void)
+{
+  union bigname *big_name;
+
+  if ((big_name = big_free))
+    big_free = big_free->next;
+  else if (!bignames_left ||
+	   !(big_name = (union bigname *)malloc(sizeof(union bigname))))
+    return NULL;
+  else
+    bignames_left--;
+
+  return big_name;
+}
+
 void cache_start_insert(void)
 {
   /* Free any entries which didn't get committed during the last
@@ -375,7 +682,6 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
 #endif
   struct crec *new;
   union bigname *big_name = NULL;
-  int freed_all = flags & F_REVERSE;
 
   log_query(flags | F_UPSTREAM, name, addr, 0, NULL, 0);
 
@@ -407,43 +713,26 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
 	return NULL;
       }
     
-    /* End of LRU list is still in use: if we didn't scan all the hash
-       chains for expired entries do that now. If we already tried that
-       then it's time to start spilling things. */
+    /* End of LRU list is still in use: free whatever has expired, which
+       goes to the end of the list. If nothing has, then it's time to
+       start spilling things. */
     
     if (new->flags & (F_FORWARD | F_REVERSE))
       { 
-	if (freed_all)
+	if (!cache_expire(now))
 	  {
 	    cache_scan_free(cache_get_name(new), &new->addr.addr, now, new->flags);
 	    cache_live_freed++;
 	  }
-	else
-	  {
-	    cache_scan_free(NULL, NULL, now, 0);
-	    freed_all = 1;
-	  }
 	continue;
       }
  
     /* Check if we need to and can allocate extra memory for a long name.
        If that fails, give up now. */
-    if (name && (strlen(name) > SMALLDNAME-1))
+    if (name && (strlen(name) > SMALLDNAME-1) && !(big_name = big_alloc()))
       {
-	if (big_free)
-	  { 
-	    big_name = big_free;
-	    big_free = big_free->next;
-	  }
-	else if (!bignames_left ||
-		 !(big_name = (union bigname *)malloc(sizeof(union bigname))))
-	  {
-	    insert_error = 1;
-	    return NULL;
-	  }
-	else
-	  bignames_left--;
-	
+	insert_error = 1;
+	return NULL;
       }
 
     /* Got the rest: finally grab entry. */
@@ -467,6 +756,8 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
     new->addr.cname.cache = NULL;
   
   new->ttd = now + (time_t)ttl;
+  new->ttl = ttl;
+  prefetch_inserted(new);
   new->next = new_chain;
   new_chain = new;
 
@@ -489,6 +780,8 @@ void cache_end_insert(void)
 	{
 	  cache_hash(new_chain);
 	  cache_link(new_chain);
+	  if (!(new_chain->flags & F_IMMORTAL))
+	    expiry_add(new_chain);
 	  cache_inserted++;
 	}
       new_chain = tmp;
@@ -506,12 +799,13 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
     {
       /* first search, look for relevant entries and push to top of list
 	 also free anything which has expired */
-      struct crec *next, **up, **insert = NULL, **chainp = &ans;
+      struct crec **first = NULL, **chainp = &ans;
+      struct hash_iter it;
+
+      chainp = hosts_find_by_name(chainp, name, prot);
          
-      for (up = hash_bucket(name), crecp = *up; crecp; crecp = next)
+      for (crecp = hash_first(&it, hostname_hash(name)); crecp; crecp = hash_next(&it))
 	{
-	  next = crecp->hash_next;
-	  
 	  if (!is_expired(now, crecp) && !is_outdated_cname_pointer(crecp))
 	    {
 	      if ((crecp->flags & F_FORWARD) && 
@@ -529,29 +823,25 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 		      cache_link(crecp);
 		    }
 	      	      
-		  /* move all but the first entry up the hash chain
-		     this implements round-robin */
-		  if (!insert)
+		  /* move the first entry to the slot of the last, and the
+		     others back one: this implements round-robin. They
+		     all have the same hash, so any of the slots will do. */
+		  if (first)
 		    {
-		      insert = up; 
-		      up = &crecp->hash_next; 
+		      struct crec **slot = &hash_table[it.bucket].entry[it.slot];
+
+		      *slot = *first;
+		      *first = crecp;
+		      first = slot;
 		    }
 		  else
-		    {
-		      *up = crecp->hash_next;
-		      crecp->hash_next = *insert;
-		      *insert = crecp;
-		      insert = &crecp->hash_next;
-		    }
+		    first = &hash_table[it.bucket].entry[it.slot];
 		}
-	      else
-		/* case : not expired, incorrect entry. */
-		up = &crecp->hash_next; 
 	    }
 	  else
 	    {
 	      /* expired entry, free it */
-	      *up = crecp->hash_next;
+	      cache_unhash(&it);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP)))
 		{ 
 		  cache_unlink(crecp);
@@ -586,44 +876,29 @@ struct crec *cache_find_by_addr(struct crec *crecp, struct all_addr *addr,
     ans = crecp->next;
   else
     {  
-      /* first search, look for relevant entries and push to top of list
-	 also free anything which has expired. All the reverse entries are at the
-	 start of the hash chain, so we can give up when we find the first 
-	 non-REVERSE one.  */
-       int i;
-       struct crec **up, **chainp = &ans;
+      /* first search, look for relevant entries and push to top of list.
+	 The address index holds all the reverse entries but those from the
+	 hosts files, so we only look at one bucket. Expired entries are left
+	 for cache_expire() and cache_scan_free(), which can unlink them from
+	 the name index. */
+       struct crec **chainp = hosts_find_by_addr(&ans, addr, prot);
        
-       for (i=0; i<hash_size; i++)
-	 for (crecp = hash_table[i], up = &hash_table[i]; 
-	      crecp && (crecp->flags & F_REVERSE);
-	      crecp = crecp->hash_next)
-	   if (!is_expired(now, crecp))
-	     {      
-	       if ((crecp->flags & prot) &&
-		   memcmp(&crecp->addr.addr, addr, addrlen) == 0)
-		 {	    
-		   if (crecp->flags & (F_HOSTS | F_DHCP))
-		     {
-		       *chainp = crecp;
-		       chainp = &crecp->next;
-		     }
-		   else
-		     {
-		       cache_unlink(crecp);
-		       cache_link(crecp);
-		     }
-		 }
-	       up = &crecp->hash_next;
-	     }
-	   else
-	     {
-	       *up = crecp->hash_next;
-	       if (!(crecp->flags & (F_HOSTS | F_DHCP)))
-		 {
-		   cache_unlink(crecp);
-		   cache_free(crecp);
-		 }
-	     }
+       for (crecp = *rev_bucket(addr, prot); crecp; crecp = crecp->rev_next)
+	 if (!is_expired(now, crecp) &&
+	     (crecp->flags & prot) &&
+	     memcmp(&crecp->addr.addr, addr, addrlen) == 0)
+	   {	    
+	     if (crecp->flags & (F_HOSTS | F_DHCP))
+	       {
+		 *chainp = crecp;
+		 chainp = &crecp->next;
+	       }
+	     else
+	       {
+		 cache_unlink(crecp);
+		 cache_link(crecp);
+	       }
+	   }
        
        *chainp = cache_head;
     }
@@ -637,214 +912,283 @@ struct crec *cache_find_by_addr(struct crec *crecp, struct all_addr *addr,
   return NULL;
 }
 
-static void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrlen, 
-			    unsigned short flags, int index, int addr_dup)
+void cache_reload(int opts, char *buff, char *domain_suffix, struct hostsfile *addn_hosts)
 {
-  struct crec *lookup = cache_find_by_name(NULL, cache->name.sname, 0, flags & (F_IPV4 | F_IPV6));
-  int i;
-  
-  /* Remove duplicates in hosts files. */
-  if (lookup && (lookup->flags & F_HOSTS) &&
-      memcmp(&lookup->addr.addr, addr, addrlen) == 0)
-    free(cache);
-  else
-    {
-      /* Ensure there is only one address -> name mapping (first one trumps) 
-	 We do this by steam here, first we see if the address is the same as
-	 the last one we saw, which eliminates most in the case of an ad-block 
-	 file with thousands of entries for the same address.
-	 Then we search and bail at the first matching address that came from
-	 a HOSTS file. Since the first host entry gets reverse, we know 
-	 then that it must exist without searching exhaustively for it. */
-     
-      if (addr_dup)
-	flags &= ~F_REVERSE;
-      else
-	for (i=0; i<hash_size; i++)
-	  {
-	    for (lookup = hash_table[i]; lookup; lookup = lookup->hash_next)
-	      if ((lookup->flags & F_HOSTS) && 
-		  (lookup->flags & flags & (F_IPV4 | F_IPV6)) &&
-		  memcmp(&lookup->addr.addr, addr, addrlen) == 0)
-		{
-		  flags &= ~F_REVERSE;
-		  break;
-		}
-	    if (lookup)
-	      break;
-	  }
-      
-      cache->flags = flags;
-      cache->uid = index;
-      memcpy(&cache->addr.addr, addr, addrlen);
-      cache_hash(cache);
-    }
-}
+  struct crec *cache;
+  int i, j;
 
-static int read_hostsfile(char *filename, int opts, char *buff, char *domain_suffix, int index, int cache_size)
-{  
-  FILE *f = fopen(filename, "r");
-  char *line;
-  int addr_count = 0, name_count = cache_size, lineno = 0;
-  unsigned short flags, saved_flags = 0;
-  struct all_addr addr, saved_addr;
+  reply_flush();
 
-  if (!f)
+  /* with --incremental-reload, hosts_load() drops only what changes */
+  if (opts & OPT_INCR_RELOAD)
     {
-      my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(errno));
-      return 0;
+      hosts_load(opts, buff, domain_suffix, addn_hosts);
+      return;
     }
-    
-  while ((line = fgets(buff, MAXDNAME, f)))
-    {
-      char *token = strtok(line, " \t\n\r");
-      int addrlen, addr_dup = 0;
-              
-      lineno++;
 
-      if (!token || (*token == '#')) 
-	continue;
+  cache_inserted = cache_live_freed = 0;
+  
+  /* only DHCP entries survive, so rebuild the address index from them */
+  for (i=0; i<rev_size; i++)
+    rev_table[i] = NULL;
 
-#ifdef HAVE_IPV6      
-      if (inet_pton(AF_INET, token, &addr) > 0)
+  for (i=0; i<hash_size; i++)
+    for (j=0; j<BUCKET_SLOTS; j++)
+      if ((cache = hash_table[i].entry[j]))
 	{
-	  flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV4;
-	  addrlen = INADDRSZ;
+	  if (cache->flags & F_DHCP)
+	    {
+	      if (cache->flags & F_REVERSE)
+		rev_hash(cache);
+	      continue;
+	    }
+
+	  hash_clear(i, j);
+	  if (cache->flags & F_BIGNAME)
+	    {
+	      cache->name.bname->next = big_free;
+	      big_free = cache->name.bname;
+	    }
+	  cache->flags = 0;
 	}
-      else if (inet_pton(AF_INET6, token, &addr) > 0)
+
+  for (cache = cache_head; cache; cache = cache->next)
+    if (NAMELESS(cache->flags))
+      cache->flags = 0;
+
+  for (i = 0; i < EXPIRY_SLOTS; i++)
+    while (expiry_wheel[i])
+      expiry_del(expiry_wheel[i]);
+  
+  hosts_load(opts, buff, domain_suffix, addn_hosts);
+
+  if ((opts & OPT_NO_HOSTS) && !addn_hosts && cache_size > 0)
+    my_syslog(LOG_INFO, _("cleared cache"));
+}
+
+/* Free the entries learnt upstream for name, or for addr if flags has
+   F_REVERSE, when a hosts file starts to answer for them. */
+void cache_forget(char *name, struct all_addr *addr, unsigned short flags)
+{
+  struct crec *crecp, *tmp, **up;
+  struct hash_iter it;
+
+  if (flags & F_REVERSE)
+    {
+#ifdef HAVE_IPV6
+      int addrlen = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
+#else
+      int addrlen = INADDRSZ;
+#endif 
+      for (up = rev_bucket(addr, flags), crecp = *up; crecp; crecp = tmp)
 	{
-	  flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV6;
-	  addrlen = IN6ADDRSZ;
-	}
-#else 
-     if ((addr.addr.addr4.s_addr = inet_addr(token)) != (in_addr_t) -1)
-        {
-          flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV4;
-          addrlen = INADDRSZ;
+	  tmp = crecp->rev_next;
+	  if (!(crecp->flags & (F_HOSTS | F_DHCP)) &&
+	      (flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
+	      memcmp(&crecp->addr.addr, addr, addrlen) == 0)
+	    {
+	      *up = tmp;
+	      name_unhash(crecp);
+	      cache_unlink(crecp);
+	      cache_free(crecp);
+	    }
+	  else
+	    up = &crecp->rev_next;
 	}
-#endif
-      else
+    }
+  else
+    /* every type, so that a negative answer for the other one goes too */
+    for (crecp = hash_first(&it, hostname_hash(name)); crecp; crecp = hash_next(&it))
+      if ((crecp->flags & F_FORWARD) && !(crecp->flags & (F_HOSTS | F_DHCP)) &&
+	  hostname_isequal(cache_get_name(crecp), name))
 	{
-	  my_syslog(LOG_ERR, _("bad address at %s line %d"), filename, lineno); 
-	  continue;
+	  cache_unhash(&it);
+	  cache_unlink(crecp);
+	  cache_free(crecp);
 	}
+}
 
-     if (saved_flags == flags && memcmp(&addr, &saved_addr, addrlen) == 0)
-       addr_dup = 1;
-     else
-       {
-	 saved_flags = flags;
-	 saved_addr = addr;
-       }
-     
-     addr_count++;
-     
-     /* rehash every 1000 names. */
-     if ((name_count - cache_size) > 1000)
-       {
-	 rehash(name_count);
-	 cache_size = name_count;
-       }
-     
-     while ((token = strtok(NULL, " \t\n\r")) && (*token != '#'))
-       {
-	 struct crec *cache;
-	 int fqdn = !!strchr(token, '.');
-	 if (canonicalise(token))
-	   {
-	     /* If set, add a version of the name with a default domain appended */
-	     if ((opts & OPT_EXPAND) && domain_suffix && !fqdn && 
-		 (cache = malloc(sizeof(struct crec) + 
-				 strlen(token)+2+strlen(domain_suffix)-SMALLDNAME)))
-	       {
-		 strcpy(cache->name.sname, token);
-		 strcat(cache->name.sname, ".");
-		 strcat(cache->name.sname, domain_suffix);
-		 add_hosts_entry(cache, &addr, addrlen, flags, index, addr_dup);
-		 addr_dup = 1;
-		 name_count++;
-	       }
-	     if ((cache = malloc(sizeof(struct crec) + strlen(token)+1-SMALLDNAME)))
-	       {
-		 strcpy(cache->name.sname, token);
-		 add_hosts_entry(cache, &addr, addrlen, flags, index, addr_dup);
-		 name_count++;
-	       }
-	   }
-	 else
-	   my_syslog(LOG_ERR, _("bad name at %s line %d"), filename, lineno); 
-       }
+static u32 snap_check(void)
+{
+  return (SNAP_VERSION << 16) | (sizeof(time_t) << 8) | sizeof(struct snap_rec);
+}
+
+/* Write the live entries learnt upstream to file, oldest first, so that
+   they go back in the same order. CNAMEs point at other entries, so they
+   are left out. */
+void cache_save(char *file, time_t now)
+{
+  struct snap_header *h;
+  struct snap_rec *rec;
+  struct crec *crecp;
+  char *tmpname, *names;
+  size_t len, nlen = 0;
+  u32 recs = 0;
+  time_t wall = time(NULL);
+  int fd;
+
+  for (crecp = cache_tail; crecp; crecp = crecp->prev)
+    if ((crecp->flags & (F_FORWARD | F_REVERSE)) &&
+	!(crecp->flags & (F_HOSTS | F_DHCP | F_IMMORTAL | F_CNAME)) && !is_expired(now, crecp))
+      {
+	recs++;
+	nlen += strlen(cache_get_name(crecp)) + 1;
+      }
+
+  len = sizeof(struct snap_header) + recs * sizeof(struct snap_rec) + nlen;
+
+  if (!(h = calloc(1, len)) || !(tmpname = malloc(strlen(file) + 5)))
+    {
+      free(h);
+      my_syslog(LOG_ERR, _("failed to save cache to %s: %s"), file, strerror(ENOMEM));
+      return;
     }
-  
-  fclose(f);
-  rehash(name_count);
 
-  my_syslog(LOG_INFO, _("read %s - %d addresses"), filename, addr_count);
+  memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+  h->check = snap_check();
+  h->recs = recs;
+  h->names = nlen;
+  h->saved = wall;
+  rec = (struct snap_rec *)(h + 1);
+  names = (char *)(rec + recs);
+
+  for (nlen = 0, crecp = cache_tail; crecp; crecp = crecp->prev)
+    if ((crecp->flags & (F_FORWARD | F_REVERSE)) &&
+	!(crecp->flags & (F_HOSTS | F_DHCP | F_IMMORTAL | F_CNAME)) && !is_expired(now, crecp))
+      {
+	rec->expires = wall + (crecp->ttd - now);
+	rec->name = nlen;
+	rec->flags = crecp->flags & ~F_BIGNAME;
+	memcpy(rec->addr, &crecp->addr.addr, (crecp->flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ);
+	strcpy(names + nlen, cache_get_name(crecp));
+	nlen += strlen(names + nlen) + 1;
+	rec++;
+      }
+
+  strcpy(tmpname, file);
+  strcat(tmpname, ".new");
+
+  if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+      !read_write(fd, (unsigned char *)h, len, 0) || close(fd) == -1 ||
+      rename(tmpname, file) == -1)
+    {
+      my_syslog(LOG_ERR, _("failed to save cache to %s: %s"), file, strerror(errno));
+      if (fd != -1)
+	unlink(tmpname);
+    }
 
-  return name_count;
+  free(tmpname);
+  free(h);
 }
-	    
-void cache_reload(int opts, char *buff, char *domain_suffix, struct hostsfile *addn_hosts)
+
+/* Put the entries from a snapshot back in the cache, after it's been
+   loaded from the hosts files and DHCP, which take precedence. */
+void cache_restore(char *file, time_t now)
 {
-  struct crec *cache, **up, *tmp;
-  int i, total_size = cache_size;
+  int fd = open(file, O_RDONLY);
+  struct stat sb;
+  struct snap_header *h;
+  struct snap_rec *rec;
+  struct crec *new;
+  char *names;
+  size_t len;
+  u32 i, restored = 0, expired = 0;
+  time_t wall = time(NULL);
+  void *map;
 
-  cache_inserted = cache_live_freed = 0;
-  
-  for (i=0; i<hash_size; i++)
-    for (cache = hash_table[i], up = &hash_table[i]; cache; cache = tmp)
-      {
-	tmp = cache->hash_next;
-	if (cache->flags & F_HOSTS)
-	  {
-	    *up = cache->hash_next;
-	    free(cache);
-	  }
-	else if (!(cache->flags & F_DHCP))
-	  {
-	    *up = cache->hash_next;
-	    if (cache->flags & F_BIGNAME)
-	      {
-		cache->name.bname->next = big_free;
-		big_free = cache->name.bname;
-	      }
-	    cache->flags = 0;
-	  }
-	else
-	  up = &cache->hash_next;
-      }
-  
-  if ((opts & OPT_NO_HOSTS) && !addn_hosts)
+  if (fd == -1)
+    return;
+
+  if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(struct snap_header) ||
+      (map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
     {
-      if (cache_size > 0)
-	my_syslog(LOG_INFO, _("cleared cache"));
+      close(fd);
       return;
     }
 
-  if (!(opts & OPT_NO_HOSTS))
-    total_size = read_hostsfile(HOSTSFILE, opts, buff, domain_suffix, 0, total_size);
-  while (addn_hosts)
+  close(fd);
+  h = map;
+  len = sb.st_size;
+
+  if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0 || h->check != snap_check() ||
+      h->recs > len / sizeof(struct snap_rec) || h->names > len ||
+      len != sizeof(struct snap_header) + h->recs * sizeof(struct snap_rec) + h->names ||
+      (h->names != 0 && ((char *)map)[len - 1] != 0))
     {
-      total_size = read_hostsfile(addn_hosts->fname, opts, buff, domain_suffix, addn_hosts->index, total_size);
-      addn_hosts = addn_hosts->next;
-    }  
-} 
+      my_syslog(LOG_WARNING, _("ignoring cache snapshot %s"), file);
+      munmap(map, len);
+      return;
+    }
+
+  rec = (struct snap_rec *)(h + 1);
+  names = (char *)(rec + h->recs);
+
+  /* the newest are at the end, so if they don't all fit, those are kept */
+  for (i = (h->recs > (u32)cache_size) ? h->recs - cache_size : 0; i < h->recs; i++)
+    {
+      char *name = names + rec[i].name;
+      unsigned short flags = rec[i].flags;
+      union bigname *big_name = NULL;
+
+      if (rec[i].expires <= wall)
+	{
+	  expired++;
+	  continue;
+	}
+
+      if (rec[i].name >= h->names || strlen(name) >= MAXDNAME ||
+	  !(flags & (F_FORWARD | F_REVERSE)) || (flags & (F_HOSTS | F_DHCP | F_IMMORTAL | F_CNAME | F_BIGNAME)) ||
+	  ((flags & F_IPV4) != 0) == ((flags & F_IPV6) != 0))
+	continue;
+
+      if (!cache_scan_free(name, (struct all_addr *)rec[i].addr, now, flags))
+	continue;
+
+      /* full, of what was there already */
+      if (!(new = cache_tail) || (new->flags & (F_FORWARD | F_REVERSE)))
+	break;
+
+      if (strlen(name) > SMALLDNAME-1 && !(big_name = big_alloc()))
+	break;
+
+      cache_unlink(new);
+      new->flags = flags;
+      if (big_name)
+	{
+	  new->name.bname = big_name;
+	  new->flags |= F_BIGNAME;
+	}
+      strcpy(cache_get_name(new), name);
+      memcpy(&new->addr.addr, rec[i].addr, (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ);
+      new->ttd = now + (rec[i].expires - wall);
+      new->ttl = rec[i].expires - wall;
+      prefetch_inserted(new);
+      cache_hash(new);
+      cache_link(new);
+      expiry_add(new);
+      restored++;
+    }
+
+  munmap(map, len);
+  my_syslog(LOG_INFO, _("restored %u cache entries from %s, %u expired"),
+	    (unsigned int)restored, file, (unsigned int)expired);
+}
 
 void cache_unhash_dhcp(void)
 {
-  struct crec *cache, **up;
-  int i;
+  struct crec *cache;
+  struct hash_iter it;
 
-  for (i=0; i<hash_size; i++)
-    for (cache = hash_table[i], up = &hash_table[i]; cache; cache = cache->hash_next)
-      if (cache->flags & F_DHCP)
+  reply_flush();
+
+  for (it.bucket = 0; it.bucket < (unsigned int)hash_size; it.bucket++)
+    for (it.slot = 0; it.slot < BUCKET_SLOTS; it.slot++)
+      if ((cache = hash_table[it.bucket].entry[it.slot]) && (cache->flags & F_DHCP))
 	{
-	  *up = cache->hash_next;
+	  cache_unhash(&it);
 	  cache->next = dhcp_spare;
 	  dhcp_spare = cache;
 	}
-      else
-	up = &cache->hash_next;
 }
 
 void cache_add_dhcp_entry(struct daemon *daemon, char *host_name, 
@@ -856,6 +1200,8 @@ void cache_add_dhcp_entry(struct daemon *daemon, char *host_name,
   if (!host_name)
     return;
 
+  reply_flush();
+
   if ((crec = cache_find_by_name(NULL, host_name, 0, F_IPV4 | F_CNAME)))
     {
       if (crec->flags & F_HOSTS)
@@ -906,61 +1252,72 @@ void dump_cache(struct daemon *daemon, time_t now)
 {
   my_syslog(LOG_INFO, _("time %lu, cache size %d, %d/%d cache insertions re-used unexpired cache entries."), 
 	    (unsigned long)now, daemon->cachesize, cache_live_freed, cache_inserted); 
+  reply_stats();
   
   if ((daemon->options & (OPT_DEBUG | OPT_LOG)) &&
       (addrbuff || (addrbuff = malloc(ADDRSTRLEN))))
     {
       struct crec *cache ;
-      int i;
+      int i, j;
       my_syslog(LOG_DEBUG, "Host                                     Address                        Flags     Expires");
     
       for (i=0; i<hash_size; i++)
-	for (cache = hash_table[i]; cache; cache = cache->hash_next)
-	  {
-	    char *a, *p = daemon->namebuff;
-	    p += sprintf(p, "%-40.40s ", cache_get_name(cache));
-	    if ((cache->flags & F_NEG) && (cache->flags & F_FORWARD))
-	      a = ""; 
-	    else if (cache->flags & F_CNAME) 
-	      {
-		a = "";
-		if (!is_outdated_cname_pointer(cache))
-		  a = cache_get_name(cache->addr.cname.cache);
-	      }
+	for (j=0; j<BUCKET_SLOTS; j++)
+	  if ((cache = hash_table[i].entry[j]))
+	    dump_entry(daemon, cache, now);
+
+      for (cache = cache_head; cache; cache = cache->next)
+	if (NAMELESS(cache->flags))
+	  dump_entry(daemon, cache, now);
+    }
+}
+
+static void dump_entry(struct daemon *daemon, struct crec *cache, time_t now)
+{
+  char *a, *p = daemon->namebuff;
+
+  p += sprintf(p, "%-40.40s ", cache_get_name(cache));
+  if ((cache->flags & F_NEG) && (cache->flags & F_FORWARD))
+    a = ""; 
+  else if (cache->flags & F_CNAME) 
+    {
+      a = "";
+      if (!is_outdated_cname_pointer(cache))
+	a = cache_get_name(cache->addr.cname.cache);
+    }
 #ifdef HAVE_IPV6
-	    else 
-	      { 
-		a = addrbuff;
-		if (cache->flags & F_IPV4)
-		  inet_ntop(AF_INET, &cache->addr.addr, addrbuff, ADDRSTRLEN);
-		else if (cache->flags & F_IPV6)
-		  inet_ntop(AF_INET6, &cache->addr.addr, addrbuff, ADDRSTRLEN);
-	      }
+  else 
+    { 
+      a = addrbuff;
+      if (cache->flags & F_IPV4)
+	inet_ntop(AF_INET, &cache->addr.addr, addrbuff, ADDRSTRLEN);
+      else if (cache->flags & F_IPV6)
+	inet_ntop(AF_INET6, &cache->addr.addr, addrbuff, ADDRSTRLEN);
+    }
 #else
-            else 
-	      a = inet_ntoa(cache->addr.addr.addr.addr4);
+  else 
+    a = inet_ntoa(cache->addr.addr.addr.addr4);
 #endif
-	    p += sprintf(p, "%-30.30s %s%s%s%s%s%s%s%s%s%s  ", a, 
-			 cache->flags & F_IPV4 ? "4" : "",
-			 cache->flags & F_IPV6 ? "6" : "",
-			 cache->flags & F_CNAME ? "C" : "",
-			 cache->flags & F_FORWARD ? "F" : " ",
-			 cache->flags & F_REVERSE ? "R" : " ",
-			 cache->flags & F_IMMORTAL ? "I" : " ",
-			 cache->flags & F_DHCP ? "D" : " ",
-			 cache->flags & F_NEG ? "N" : " ",
-			 cache->flags & F_NXDOMAIN ? "X" : " ",
-			 cache->flags & F_HOSTS ? "H" : " ");
+  p += sprintf(p, "%-30.30s %s%s%s%s%s%s%s%s%s%s  ", a, 
+	       cache->flags & F_IPV4 ? "4" : "",
+	       cache->flags & F_IPV6 ? "6" : "",
+	       cache->flags & F_CNAME ? "C" : "",
+	       cache->flags & F_FORWARD ? "F" : " ",
+	       cache->flags & F_REVERSE ? "R" : " ",
+	       cache->flags & F_IMMORTAL ? "I" : " ",
+	       cache->flags & F_DHCP ? "D" : " ",
+	       cache->flags & F_NEG ? "N" : " ",
+	       cache->flags & F_NXDOMAIN ? "X" : " ",
+	       cache->flags & F_HOSTS ? "H" : " ");
 #ifdef HAVE_BROKEN_RTC
-	    p += sprintf(p, "%lu", cache->flags & F_IMMORTAL ? 0: (unsigned long)(cache->ttd - now));
+  p += sprintf(p, "%lu", cache->flags & F_IMMORTAL ? 0: (unsigned long)(cache->ttd - now));
 #else
-	    p += sprintf(p, "%s", cache->flags & F_IMMORTAL ? "\n" : ctime(&(cache->ttd)));
-	    /* ctime includes trailing \n - eat it */
-	    *(p-1) = 0;
+  (void)now;
+  p += sprintf(p, "%s", cache->flags & F_IMMORTAL ? "\n" : ctime(&(cache->ttd)));
+  /* ctime includes trailing \n - eat it */
+  *(p-1) = 0;
 #endif
-	    my_syslog(LOG_DEBUG, daemon->namebuff);
-	  }
-    }
+  my_syslog(LOG_DEBUG, daemon->namebuff);
 }
 
 static char *record_source(struct hostsfile *addn_hosts, int index)
@@ -21,12 +21,24 @@
 #define VERSION "2.39"
 
 #define FTABSIZ 150 /* max number of outstanding requests (default) */
+#define UDP_BATCH 16 /* max UDP datagrams read from a socket per wakeup */
 #define MAX_PROCS 20 /* max no children for TCP requests */
 #define CHILD_LIFETIME 150 /* secs 'till terminated (RFC1035 suggests > 120s) */
 #define EDNS_PKTSZ 1280 /* default max EDNS.0 UDP packet from RFC2671 */
 #define TIMEOUT 10 /* drop UDP queries after TIMEOUT seconds */
 #define LEASE_RETRY 60 /* on error, retry writing leasefile after LEASE_RETRY seconds */
 #define CACHESIZ 150 /* default cache size */
+#define SERVER_EXPLORE 32 /* one forwarded query in this many goes to other than the fastest server */
+#define SERVER_MISSES 3 /* a server which has lost this many in a row is passed over */
+#define HEDGE_MAX 32 /* max queries sent to a second server at once, --hedge-queries (default) */
+#define HEDGE_MIN 20 /* ms: don't send to a second server sooner than this */
+#define HEDGE_UNTIMED 1000 /* ms: or this, if the first hasn't been timed */
+#define PREFETCH_QPS 10 /* max refreshes of cache entries a second, --prefetch (default) */
+#define PREFETCH_HITS 3 /* answers from an entry before it's worth refreshing */
+#define PREFETCH_PERCENT 10 /* refresh in the last this much of its TTL */
+#define PREFETCH_QUEUE 16 /* refreshes waiting to be sent */
+#define CACHE_SAVE 300 /* secs between saves of --cache-file (default) */
+#define CACHE_SAVE_MAX 86400 /* longest --cache-file interval, so the ms fit the timer */
 #define MAXLEASES 150 /* maximum number of DHCP leases */
 #define PING_WAIT 3 /* wait for ping address-in-use test */
 #define PING_CACHE_TIME 30 /* Ping test assumed to be valid this long. */
@@ -153,6 +165,21 @@ HAVE_DBUS
    define some methods to allow (re)configuration of the upstream DNS
    servers via DBus.
 
+HAVE_TRACE
+   define this to compile in the debug trace points on the query path.
+   They are enabled by category at run time with --trace, and cost a test
+   of a flag when not. Output goes to the log.
+
+HAVE_EPOLL
+   define this to drive the main loop with epoll(7) rather than select(),
+   so that the cost of waiting depends on the number of ready descriptors
+   and not on the number of listeners, server sockets and TFTP transfers.
+
+HAVE_TIMERFD
+   define this to have a timerfd (Linux 2.6.25, glibc 2.8) wake the main
+   loop when a timer is due. Without it, the wait for events is cut short
+   instead. With glibc older than 2.17, add -lrt to LIBS for clock_gettime().
+
 NOTES:
    For Linux you should define
       HAVE_LINUX_NETWORK
@@ -160,6 +187,8 @@ NOTES:
       HAVE_RANDOM
       HAVE_DEV_RANDOM
       HAVE_DEV_URANDOM
+      HAVE_EPOLL
+      HAVE_TIMERFD
   you should NOT define
       HAVE_ARC4RANDOM
       HAVE_SOCKADDR_SA_LEN
@@ -184,6 +213,7 @@ NOTES:
 /* #define HAVE_BROKEN_RTC */
 /* #define HAVE_ISC_READER */
 /* #define HAVE_DBUS */
+/* #define HAVE_TRACE */
 
 #if defined(HAVE_BROKEN_RTC) && defined(HAVE_ISC_READER)
 #  error HAVE_ISC_READER is not compatible with HAVE_BROKEN_RTC
@@ -212,6 +242,7 @@ NOTES:
 
 #elif defined(__UCLIBC__)
 #define HAVE_LINUX_NETWORK
+#define HAVE_EPOLL
 #if defined(__UCLIBC_HAS_GNU_GETOPT__) || \
    ((__UCLIBC_MAJOR__==0) && (__UCLIBC_MINOR__==9) && (__UCLIBC_SUBLEVEL__<21))
 #    define HAVE_GETOPT_LONG
@@ -235,6 +266,8 @@ NOTES:
 /* This is for glibc 2.x */
 #elif defined(__linux__)
 #define HAVE_LINUX_NETWORK
+#define HAVE_EPOLL
+#define HAVE_TIMERFD
 #define HAVE_GETOPT_LONG
 /* #undef HAVE_ARC4RANDOM */
 #define HAVE_RANDOM
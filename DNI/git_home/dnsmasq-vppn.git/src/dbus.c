@@ -23,6 +23,42 @@ struct watch {
 };
 
 
+static void dbus_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
+
+/* libdbus may have separate read and write watches on the same fd, so the
+   event registration for an fd is the union of its enabled watches. */
+static void update_watch_fd(struct daemon *daemon, int fd)
+{
+  struct watch *w;
+  int events = 0, found = 0;
+
+  for (w = daemon->watches; w; w = w->next)
+    if (dbus_watch_get_fd(w->watch) == fd)
+      {
+	found = 1;
+	if (dbus_watch_get_enabled(w->watch))
+	  {
+	    unsigned int flags = dbus_watch_get_flags(w->watch);
+	    if (flags & DBUS_WATCH_READABLE)
+	      events |= EVENT_IN;
+	    if (flags & DBUS_WATCH_WRITABLE)
+	      events |= EVENT_OUT;
+	  }
+      }
+
+  if (!found)
+    event_del(fd);
+  else if (event_owns_fd(fd))
+    event_mod(fd, events);
+  else
+    event_add(fd, events, dbus_event, NULL);
+}
+
+static void toggle_watch(DBusWatch *watch, void *data)
+{
+  update_watch_fd((struct daemon *)data, dbus_watch_get_fd(watch));
+}
+
 static dbus_bool_t add_watch(DBusWatch *watch, void *data)
 {
   struct daemon *daemon = data;
@@ -40,6 +76,7 @@ static dbus_bool_t add_watch(DBusWatch *watch, void *data)
   daemon->watches = w;
 
   dbus_watch_set_data (watch, (void *)daemon, NULL);
+  update_watch_fd(daemon, dbus_watch_get_fd(watch));
 
   return TRUE;
 }
@@ -47,16 +84,21 @@ static dbus_bool_t add_watch(DBusWatch *watch, void *data)
 static void remove_watch(DBusWatch *watch, void *data)
 {
   struct daemon *daemon = data;
-  struct watch **up, *w;  
-  
-  for (up = &(daemon->watches), w = daemon->watches; w; w = w->next)
-    if (w->watch == watch)
-      {
-        *up = w->next;
-        free(w);
-      }
-    else
-      up = &(w->next);
+  struct watch **up, *w, *tmp;
+
+  for (up = &(daemon->watches), w = daemon->watches; w; w = tmp)
+    {
+      tmp = w->next;
+      if (w->watch == watch)
+	{
+	  *up = w->next;
+	  free(w);
+	}
+      else
+	up = &(w->next);
+    }
+
+  update_watch_fd(daemon, dbus_watch_get_fd(watch));
 }
 
 static void dbus_read_servers(struct daemon *daemon, DBusMessage *message)
@@ -177,6 +219,7 @@ static void dbus_read_servers(struct daemon *daemon, DBusMessage *message)
 		    daemon->servers = serv;
 		    serv->flags = SERV_FROM_DBUS;
 		    serv->sfd = NULL;
+		    memset(&serv->stats, 0, sizeof(serv->stats));
 		    if (domain)
 		      {
 			strcpy(serv->domain, domain);
@@ -241,7 +284,7 @@ DBusHandlerResult message_handler(DBusConnection *connection,
       check_servers(daemon);
     }
   else if (strcmp(method, "ClearCache") == 0)
-    clear_cache_and_reload(daemon, dnsmasq_time());
+    clear_cache_and_reload(daemon, dnsmasq_time(), daemon->options & ~OPT_INCR_RELOAD);
   else
     return (DBUS_HANDLER_RESULT_NOT_YET_HANDLED);
   
@@ -264,7 +307,7 @@ char *dbus_init(struct daemon *daemon)
     
   dbus_connection_set_exit_on_disconnect(connection, FALSE);
   dbus_connection_set_watch_functions(connection, add_watch, remove_watch, 
-				      NULL, (void *)daemon, NULL);
+				      toggle_watch, (void *)daemon, NULL);
   dbus_error_init (&dbus_error);
   dbus_bus_request_name (connection, DNSMASQ_SERVICE, 0, &dbus_error);
   if (dbus_error_is_set (&dbus_error))
@@ -283,53 +326,34 @@ char *dbus_init(struct daemon *daemon)
 }
  
 
-void set_dbus_listeners(struct daemon *daemon, int *maxfdp,
-			fd_set *rset, fd_set *wset, fd_set *eset)
+static void dbus_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
 {
-  struct watch *w;
+  struct watch *w, *tmp;
+  unsigned int flags = 0;
+
+  (void)arg; (void)now;
+
+  if (events & EVENT_IN)
+    flags |= DBUS_WATCH_READABLE;
   
-  for (w = daemon->watches; w; w = w->next)
-    if (dbus_watch_get_enabled(w->watch))
-      {
-	unsigned int flags = dbus_watch_get_flags(w->watch);
-	int fd = dbus_watch_get_fd(w->watch);
-	
-	bump_maxfd(fd, maxfdp);
-	
-	if (flags & DBUS_WATCH_READABLE)
-	  FD_SET(fd, rset);
-	
-	if (flags & DBUS_WATCH_WRITABLE)
-	  FD_SET(fd, wset);
-	
-	FD_SET(fd, eset);
-      }
+  if (events & EVENT_OUT)
+    flags |= DBUS_WATCH_WRITABLE;
+  
+  if (events & EVENT_ERR)
+    flags |= DBUS_WATCH_ERROR;
+
+  /* handling a watch may remove it */
+  for (w = daemon->watches; w; w = tmp)
+    {
+      tmp = w->next;
+      if (dbus_watch_get_fd(w->watch) == fd && dbus_watch_get_enabled(w->watch))
+	dbus_watch_handle(w->watch, flags & (dbus_watch_get_flags(w->watch) | DBUS_WATCH_ERROR));
+    }
 }
 
-void check_dbus_listeners(struct daemon *daemon,
-			  fd_set *rset, fd_set *wset, fd_set *eset)
+void check_dbus_listeners(struct daemon *daemon)
 {
   DBusConnection *connection = (DBusConnection *)daemon->dbus;
-  struct watch *w;
-
-  for (w = daemon->watches; w; w = w->next)
-    if (dbus_watch_get_enabled(w->watch))
-      {
-	unsigned int flags = 0;
-	int fd = dbus_watch_get_fd(w->watch);
-	
-	if (FD_ISSET(fd, rset))
-	  flags |= DBUS_WATCH_READABLE;
-	
-	if (FD_ISSET(fd, wset))
-	  flags |= DBUS_WATCH_WRITABLE;
-	
-	if (FD_ISSET(fd, eset))
-	  flags |= DBUS_WATCH_ERROR;
-
-	if (flags != 0)
-	  dbus_watch_handle(w->watch, flags);
-      }
 
   if (connection)
     {
@@ -42,21 +42,35 @@ static char *compile_opts =
 #ifndef HAVE_TFTP
 "no-"
 #endif
-"TFTP";
+"TFTP "
+#ifndef HAVE_TRACE
+"no-"
+#endif
+"trace";
 
 static pid_t pid;
 static int pipewrite;
+static struct timer cache_save_timer; /* for --cache-file */
+static int cache_restored;
 
 /* libconfig.so */
 extern char *config_get(char *name);
 extern int config_match(char *name, char *match);
 
-#ifdef DNI_IPV6_FEATURE
-extern void check_timeout_forward(struct daemon *daemon, time_t now);
+static void config_snapshot(struct daemon *daemon);
+static void config_extenders(struct daemon *daemon);
+static void set_dial_on_demand(struct daemon *daemon, int state);
+static void register_listeners(struct daemon *daemon);
+static int set_dns_listeners(struct daemon *daemon, time_t now);
+static void listener_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
+static void tcp_listener_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
+#ifdef HAVE_TFTP
+static void tftp_listener_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
 #endif
-
-static int set_dns_listeners(struct daemon *daemon, time_t now, fd_set *set, int *maxfdp);
-static void check_dns_listeners(struct daemon *daemon, fd_set *set, time_t now);
+static void sig_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
+static void cache_save_timeout(struct daemon *daemon, void *arg, time_t now);
+static void dhcp_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
+static void helper_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
 static void sig_handler(int sig);
 
 int in_hijack;
@@ -111,6 +125,15 @@ int main (int argc, char **argv)
 
   daemon = read_opts(argc, argv, compile_opts);
   log_fd = log_start(daemon); 
+  event_init();
+  timer_init();
+
+  /* open the procfs flag while we're still root, whether or not demand
+     dial is on now, so that turning it on later only needs a SIGHUP */
+  if ((daemon->dial_fd = open("/proc/sys/net/dni/dial_on_demand_dns", O_WRONLY)) != -1)
+    fcntl(daemon->dial_fd, F_SETFD, FD_CLOEXEC);
+  daemon->dial_state = 0;
+  config_snapshot(daemon);
   
   if (daemon->edns_pktsz < PACKETSZ)
     daemon->edns_pktsz = PACKETSZ;
@@ -130,6 +153,12 @@ int main (int argc, char **argv)
   
 #ifdef HAVE_LINUX_NETWORK
   netlink_init(daemon);
+  /* not watched, as before: nl_routechange() would resend whatever is in
+     daemon->packet, which isn't the saved query any more */
+#ifdef DNI_PARENTAL_CTL
+  if (parentalcontrol_enable)
+    parental_init(daemon);
+#endif
 #elif !(defined(IP_RECVDSTADDR) && \
 	defined(IP_RECVIF) && \
 	defined(IP_SENDSRCADDR))
@@ -166,8 +195,19 @@ int main (int argc, char **argv)
     }
   else if (!(daemon->listeners = create_wildcard_listeners(daemon->port, daemon->options & OPT_TFTP)))
     die(_("failed to create listening socket: %s"), NULL);
+
+  register_listeners(daemon);
   
   cache_init(daemon->cachesize, daemon->options & OPT_LOG);
+  /* answers from it wouldn't be logged */
+  if (!(daemon->options & OPT_LOG))
+    reply_init(daemon->reply_cache);
+#ifdef DNI_PARENTAL_CTL
+  /* a refresh has no device to tag it with, so the filter wouldn't see it */
+  if (parentalcontrol_enable)
+    daemon->prefetch = 0;
+#endif
+  prefetch_init(daemon->prefetch);
 
   now = dnsmasq_time();
   
@@ -184,6 +224,7 @@ int main (int argc, char **argv)
 #endif
       dhcp_init(daemon);
       lease_init(daemon, now);
+      event_add(daemon->dhcpfd, EVENT_IN | EVENT_MAIN, dhcp_event, NULL);
     }
 
   if (daemon->options & OPT_DBUS)
@@ -231,6 +272,7 @@ int main (int argc, char **argv)
   
   piperead = pipefd[0];
   pipewrite = pipefd[1];
+  event_add(piperead, EVENT_IN | EVENT_MAIN, sig_event, NULL);
   /* prime the pipe to load stuff first time. */
   sig = SIGHUP; 
   write(pipewrite, &sig, 1);
@@ -238,8 +280,7 @@ int main (int argc, char **argv)
   if (!(daemon->options & OPT_DEBUG))   
     {
       FILE *pidfile;
-      fd_set test_set;
-      int maxfd = -1, i; 
+      int i; 
       int nullfd = open("/dev/null", O_RDWR);
 
       /* The following code "daemonizes" the process. 
@@ -270,14 +311,9 @@ int main (int argc, char **argv)
       
       umask(0);
       
-      FD_ZERO(&test_set);
-      set_dns_listeners(daemon, now, &test_set, &maxfd);
-#ifdef HAVE_DBUS
-      set_dbus_listeners(daemon, &maxfd, &test_set, &test_set, &test_set);
-#endif
       for (i=0; i<64; i++)
 	{
-	  if (i == piperead || i == pipewrite || i == log_fd)
+	  if (i == piperead || i == pipewrite || i == log_fd || i == daemon->dial_fd)
 	    continue;
 
 #ifdef HAVE_LINUX_NETWORK
@@ -294,7 +330,8 @@ int main (int argc, char **argv)
 	       i == daemon->dhcpfd))
 	    continue;
 
-	  if (i <= maxfd && FD_ISSET(i, &test_set))
+	  /* listeners, server sockets, DBus and the event core itself */
+	  if (event_owns_fd(i))
 	    continue;
 
 	  /* open  stdout etc to /dev/null */
@@ -307,6 +344,7 @@ int main (int argc, char **argv)
   
   /* if we are to run scripts, we need to fork a helper before dropping root. */
   daemon->helperfd = create_helper(daemon, log_fd);
+  event_add(daemon->helperfd, EVENT_MAIN, helper_event, NULL);
    
   if (!(daemon->options & OPT_DEBUG))   
     {
@@ -472,7 +510,6 @@ int main (int argc, char **argv)
 #ifdef SUP_STATIC_PPTP
   if (1 == daemon->static_pptp_enable) {
     load_static_pptp_server(daemon);
-    alarm(1);
   }
 #endif
 
@@ -480,91 +517,35 @@ int main (int argc, char **argv)
   
   while (1)
     {
-      int maxfd = -1;
-      struct timeval t, *tp = NULL;
-      fd_set rset, wset, eset;
-      
-      FD_ZERO(&rset);
-      FD_ZERO(&wset);
-      FD_ZERO(&eset);
+      int timeout, wait;
+
+      /* set the timeout to 2 seconds, so we can check 
+	 the resolv files as soon as it is modified once per second 
+	 max.. Well, it maybe influence the performance, and it may 
+	 be a NOT GOOD idea, but it works ... 
+	 Timers (forwarding, TFTP, leases) wake us by themselves. */
+      timeout = 2000;
       
       /* if we are out of resources, find how long we have to wait
 	 for some to come free, we'll loop around then and restart
 	 listening for queries */
-      if ((t.tv_sec = set_dns_listeners(daemon, now, &rset, &maxfd)) != 0)
-	{
-	  t.tv_usec = 0;
-	  tp = &t;
-	}
-
-      /* Whilst polling for the dbus, or doing a tftp transfer, wake every quarter second */
-      if (daemon->tftp_trans ||
-	  ((daemon->options & OPT_DBUS) && !daemon->dbus))
-	{
-	  t.tv_sec = 0;
-	  t.tv_usec = 250000;
-	  tp = &t;
-	}
+      if ((wait = set_dns_listeners(daemon, now)) != 0 && wait * 1000 < timeout)
+	timeout = wait * 1000;
 
-#ifdef HAVE_DBUS
-      set_dbus_listeners(daemon, &maxfd, &rset, &wset, &eset);
-#endif	
-  
-      if (daemon->dhcp)
-	{
-	  FD_SET(daemon->dhcpfd, &rset);
-	  bump_maxfd(daemon->dhcpfd, &maxfd);
-	}
-
-#if 0 //def HAVE_LINUX_NETWORK
-      FD_SET(daemon->netlinkfd, &rset);
-      bump_maxfd(daemon->netlinkfd, &maxfd);
-#endif
-      
-      FD_SET(piperead, &rset);
-      bump_maxfd(piperead, &maxfd);
+      /* Whilst polling for the dbus, wake every quarter second */
+      if ((daemon->options & OPT_DBUS) && !daemon->dbus)
+	timeout = 250;
 
 #if 0     
       while (helper_buf_empty() && do_script_run(daemon));
-
-      if (!helper_buf_empty())
-	{
-	  FD_SET(daemon->helperfd, &wset);
-	  bump_maxfd(daemon->helperfd, &maxfd);
-	}
 #endif
+      event_mod(daemon->helperfd, helper_buf_empty() ? 0 : EVENT_OUT);
       
-      /* must do this just before select(), when we know no
+      /* must do this just before waiting, when we know no
 	 more calls to my_syslog() can occur */
-      set_log_writer(&wset, &maxfd);
+      set_log_writer();
       
-      /* set `select` timeout value to 2 seconds, so we can check 
-	 the resolv files as soon as it is modified once per second 
-	 max.. Well, it maybe influence the performance, and it may 
-	 be a NOT GOOD idea, but it works ... */
-      tp = &t;
-
-#ifndef DNI_IPV6_FEATURE
-      tp->tv_sec = 2;
-#else
-     /* as requests of DNS in IPv6 spec, maybe one query have to re-sent
-        if previous query timeout, and if one query was sent and no
-        receive response in 3 seconds, we consider it is timeout.
-        if use 2 seconds in `select`, after 4 seconds passed since one
-        query was sent and no receive response, it could re-sent query
-        again. so change this value to 1 second. */
-      tp->tv_sec = 1;
-#endif
-      tp->tv_usec = 0; 
-      if (select(maxfd+1, &rset, &wset, &eset, tp) < 0)
-	{
-	  /* otherwise undefined after error */
-	  FD_ZERO(&rset); FD_ZERO(&wset); FD_ZERO(&eset);
-	}
-
-      now = dnsmasq_time();
-
-      check_log_writer(&wset);
+      now = event_wait(daemon, timeout);
 
       /* Check for changes to resolv files once per second max. */
       /* Don't go silent for long periods if the clock goes backwards. */
@@ -577,6 +558,19 @@ int main (int argc, char **argv)
 	    load_dhcp(daemon, now);
 #endif
 
+//ifdef SUP_MUL_PPPOE
+	  check_mul_pppoe_files();
+//endif
+
+#ifdef DNI_PARENTAL_CTL
+	  if (parentalcontrol_enable)
+	    parental_check_table();
+#endif
+
+	  config_extenders(daemon);
+	  if (daemon->connect_ext_num > 0)
+	    check_extender_records();
+
 	  if (!(daemon->options & OPT_NO_POLL))
 	    {
 	      struct resolvc *res, *latest;
@@ -623,7 +617,7 @@ int main (int argc, char **argv)
 		      warned = 0;
 		      check_servers(daemon);
 		      if (daemon->options & OPT_RELOAD)
-			cache_reload(daemon->options, daemon->namebuff, daemon->domain_suffix, daemon->addn_hosts);
+			cache_reload(daemon->options & ~OPT_INCR_RELOAD, daemon->namebuff, daemon->domain_suffix, daemon->addn_hosts);
 		    }
 		  else 
 		    {
@@ -649,107 +643,6 @@ int main (int argc, char **argv)
 	    }
 	}
 
-      if (FD_ISSET(piperead, &rset))
-	{
-	  pid_t p;
-
-	  if (read(piperead, &sig, 1) == 1)
-	    switch (sig)
-	      {
-	      case SIGHUP:
-		clear_cache_and_reload(daemon, now);
-		if (daemon->resolv_files && (daemon->options & OPT_NO_POLL))
-		  {
-		    reload_servers(daemon->resolv_files->name, daemon);
-		    check_servers(daemon);
-		  }
-#ifdef SUP_STATIC_PPTP
-		if (1 == daemon->static_pptp_enable) {
-		  load_static_pptp_server(daemon);
-		}
-#endif
-		break;
-		
-	      case SIGUSR1:
-		#if 1
-		in_hijack = 1;
-		my_syslog(LOG_INFO, _("In DNS Hijack mode!!!"));
-		#else
-		dump_cache(daemon, now);
-		#endif
-		break;
-	
-	      case SIGUSR2:
-		in_hijack = 0;
-		my_syslog(LOG_INFO, _("NOT DNS Hijack mode!!!"));
-		break;
-
-	      case SIGALRM:
-		if (daemon->dhcp)
-		  {
-		    lease_prune(NULL, now);
-		    lease_update_file(daemon, now);
-		  }
-#ifdef SUP_STATIC_PPTP
-		if (1 == daemon->static_pptp_enable) {
-		  timer_check_static_pptp_query(daemon);
-		  alarm(1);
-		}
-#endif
-		break;
-		
-	      case SIGTERM:
-		{
-		  int i;
-		  /* Knock all our children on the head. */
-		  for (i = 0; i < MAX_PROCS; i++)
-		    if (daemon->tcp_pids[i] != 0)
-		      kill(daemon->tcp_pids[i], SIGALRM);
-		  
-		  /* handle pending lease transitions */
-		  if (daemon->helperfd != -1)
-		    {
-		      /* block in writes until all done */
-		      if ((i = fcntl(daemon->helperfd, F_GETFL)) != -1)
-			fcntl(daemon->helperfd, F_SETFL, i & ~O_NONBLOCK); 
-		      do {
-			helper_write(daemon);
-		      } while (!helper_buf_empty() || do_script_run(daemon));
-		      close(daemon->helperfd);
-		    }
-		     
-		  if (daemon->lease_stream)
-		    fclose(daemon->lease_stream);
-
-		  my_syslog(LOG_INFO, _("exiting on receipt of SIGTERM"));
-		  exit(0);
-		}
-
-	      case SIGCHLD:
-		/* See Stevens 5.10 */
-		/* Note that if a script process forks and then exits
-		   without waiting for its child, we will reap that child.
-		   It is not therefore safe to assume that any dieing children
-		   whose pid != script_pid are TCP server threads. */ 
-		while ((p = waitpid(-1, NULL, WNOHANG)) > 0)
-		  {
-		    int i;
-		    for (i = 0 ; i < MAX_PROCS; i++)
-		      if (daemon->tcp_pids[i] == p)
-			{
-			  daemon->tcp_pids[i] = 0;
-			  break;
-			}
-		  }
-		break;
-	      }
-	}
-      
-#if 0 //def HAVE_LINUX_NETWORK
-      if (FD_ISSET(daemon->netlinkfd, &rset))
-	netlink_multicast(daemon);
-#endif
-      
 #ifdef HAVE_DBUS
       /* if we didn't create a DBus connection, retry now. */ 
      if ((daemon->options & OPT_DBUS) && !daemon->dbus)
@@ -760,21 +653,7 @@ int main (int argc, char **argv)
 	  if (daemon->dbus)
 	    my_syslog(LOG_INFO, _("connected to system DBus"));
 	}
-      check_dbus_listeners(daemon, &rset, &wset, &eset);
-#endif
-
-      check_dns_listeners(daemon, &rset, now);
-
-#ifdef HAVE_TFTP
-      check_tftp_listeners(daemon, &rset, now);
-#endif      
-
-      if (daemon->dhcp && FD_ISSET(daemon->dhcpfd, &rset))
-	dhcp_packet(daemon, now);
-
-#if 0     
-      if (daemon->helperfd != -1 && FD_ISSET(daemon->helperfd, &wset))
-	helper_write(daemon);
+      check_dbus_listeners(daemon);
 #endif
     }
 }
@@ -805,9 +684,18 @@ static void sig_handler(int sig)
 }
 
 
-void clear_cache_and_reload(struct daemon *daemon, time_t now)
+static void cache_save_timeout(struct daemon *daemon, void *arg, time_t now)
+{
+  (void)arg;
+
+  cache_save(daemon->cache_file, now);
+  timer_add(&cache_save_timer, daemon->cache_save * 1000, cache_save_timeout, NULL);
+}
+
+/* opts is daemon->options, without OPT_INCR_RELOAD to clear the cache regardless */
+void clear_cache_and_reload(struct daemon *daemon, time_t now, int opts)
 {
-  cache_reload(daemon->options, daemon->namebuff, daemon->domain_suffix, daemon->addn_hosts);
+  cache_reload(opts, daemon->namebuff, daemon->domain_suffix, daemon->addn_hosts);
   if (daemon->dhcp)
     {
       if (daemon->options & OPT_ETHERS)
@@ -819,206 +707,365 @@ void clear_cache_and_reload(struct daemon *daemon, time_t now)
     }
 }
 
-static int set_dns_listeners(struct daemon *daemon, time_t now, fd_set *set, int *maxfdp)
+static void sig_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
+{
+  unsigned char sig;
+  pid_t p;
+
+  (void)arg; (void)events;
+
+  if (read(fd, &sig, 1) == 1)
+    switch (sig)
+      {
+      case SIGHUP:
+	config_snapshot(daemon);
+	clear_cache_and_reload(daemon, now, daemon->options);
+	/* the first one is at start-up, after which the snapshot can go in */
+	if (daemon->cache_file && !cache_restored)
+	  {
+	    cache_restore(daemon->cache_file, now);
+	    cache_restored = 1;
+	    if (daemon->cache_save > 0)
+	      timer_add(&cache_save_timer, daemon->cache_save * 1000, cache_save_timeout, NULL);
+	  }
+	if (daemon->resolv_files && (daemon->options & OPT_NO_POLL))
+	  {
+	    reload_servers(daemon->resolv_files->name, daemon);
+	    check_servers(daemon);
+	  }
+#ifdef SUP_STATIC_PPTP
+	if (1 == daemon->static_pptp_enable) {
+	  load_static_pptp_server(daemon);
+	}
+#endif
+	break;
+
+      case SIGUSR1:
+	#if 1
+	in_hijack = 1;
+	my_syslog(LOG_INFO, _("In DNS Hijack mode!!!"));
+	#else
+	dump_cache(daemon, now);
+	#endif
+	break;
+
+      case SIGUSR2:
+	in_hijack = 0;
+	my_syslog(LOG_INFO, _("NOT DNS Hijack mode!!!"));
+	break;
+
+      case SIGTERM:
+	{
+	  int i;
+	  /* Knock all our children on the head. */
+	  for (i = 0; i < MAX_PROCS; i++)
+	    if (daemon->tcp_pids[i] != 0)
+	      kill(daemon->tcp_pids[i], SIGALRM);
+
+	  /* handle pending lease transitions */
+	  if (daemon->helperfd != -1)
+	    {
+	      /* block in writes until all done */
+	      if ((i = fcntl(daemon->helperfd, F_GETFL)) != -1)
+		fcntl(daemon->helperfd, F_SETFL, i & ~O_NONBLOCK); 
+	      do {
+		helper_write(daemon);
+	      } while (!helper_buf_empty() || do_script_run(daemon));
+	      close(daemon->helperfd);
+	    }
+
+	  if (daemon->lease_stream)
+	    fclose(daemon->lease_stream);
+
+	  if (daemon->cache_file)
+	    cache_save(daemon->cache_file, now);
+
+	  dump_forward_stats(daemon);
+	  dump_question_stats();
+	  my_syslog(LOG_INFO, _("exiting on receipt of SIGTERM"));
+	  exit(0);
+	}
+
+      case SIGCHLD:
+	/* See Stevens 5.10 */
+	/* Note that if a script process forks and then exits
+	   without waiting for its child, we will reap that child.
+	   It is not therefore safe to assume that any dieing children
+	   whose pid != script_pid are TCP server threads. */ 
+	while ((p = waitpid(-1, NULL, WNOHANG)) > 0)
+	  {
+	    int i;
+	    for (i = 0 ; i < MAX_PROCS; i++)
+	      if (daemon->tcp_pids[i] == p)
+		{
+		  daemon->tcp_pids[i] = 0;
+		  break;
+		}
+	  }
+	break;
+      }
+}
+
+static void register_listeners(struct daemon *daemon)
 {
-  struct serverfd *serverfdp;
   struct listener *listener;
-  int wait, i;
+
+  for (listener = daemon->listeners; listener; listener = listener->next)
+    {
+      event_add(listener->fd, EVENT_IN, listener_event, listener);
+      event_add(listener->tcpfd, EVENT_IN, tcp_listener_event, listener);
+#ifdef HAVE_TFTP
+      event_add(listener->tftpfd, EVENT_IN, tftp_listener_event, listener);
+#endif
+    }
+}
+
+/* The listeners stay registered with the event core, here we just
+   stop and start listening on them as resources run out and come free. */
+static int set_dns_listeners(struct daemon *daemon, time_t now)
+{
+  static int listening = -1, tcp_listening = -1;
+  struct listener *listener;
+  int wait, i, tcp = 0;
   
 #ifdef HAVE_TFTP
+  static int tftp_listening = -1;
   int  tftp = 0;
   struct tftp_transfer *transfer;
   for (transfer = daemon->tftp_trans; transfer; transfer = transfer->next)
-    {
-      tftp++;
-      FD_SET(transfer->sockfd, set);
-      bump_maxfd(transfer->sockfd, maxfdp);
-    }
+    tftp++;
+  tftp = tftp <= daemon->tftp_max;
 #endif
   
   /* will we be able to get memory? */
   get_new_frec(daemon, now, &wait);
-  
-  for (serverfdp = daemon->sfds; serverfdp; serverfdp = serverfdp->next)
-    {
-      FD_SET(serverfdp->fd, set);
-      bump_maxfd(serverfdp->fd, maxfdp);
-    }
-	  
-  for (listener = daemon->listeners; listener; listener = listener->next)
-    {
-      /* only listen for queries if we have resources */
-      if (wait == 0)
-	{
-	  FD_SET(listener->fd, set);
-	  bump_maxfd(listener->fd, maxfdp);
-	}
 
-      /* death of a child goes through the select loop, so
-	 we don't need to explicitly arrange to wake up here */
-      for (i = 0; i < MAX_PROCS; i++)
-	if ( daemon->tcp_pids[i] == 0 && listener->tcpfd != -1 )
-	  {
-	    FD_SET(listener->tcpfd, set);
-	    bump_maxfd(listener->tcpfd, maxfdp);
-	    break;
-	  }
+  /* death of a child goes through the event loop, so
+     we don't need to explicitly arrange to wake up here */
+  for (i = 0; i < MAX_PROCS; i++)
+    if (daemon->tcp_pids[i] == 0)
+      {
+	tcp = 1;
+	break;
+      }
 
+  if (listening == (wait == 0) && tcp_listening == tcp
 #ifdef HAVE_TFTP
-      if (tftp <= daemon->tftp_max && listener->tftpfd != -1)
-	{
-	  FD_SET(listener->tftpfd, set);
-	  bump_maxfd(listener->tftpfd, maxfdp);
-	}
+      && tftp_listening == tftp
 #endif
+      )
+    return wait;
 
+  /* only listen for queries if we have resources */
+  listening = (wait == 0);
+  tcp_listening = tcp;
+#ifdef HAVE_TFTP
+  tftp_listening = tftp;
+#endif
+	  
+  for (listener = daemon->listeners; listener; listener = listener->next)
+    {
+      event_mod(listener->fd, listening ? EVENT_IN : 0);
+      event_mod(listener->tcpfd, tcp ? EVENT_IN : 0);
+#ifdef HAVE_TFTP
+      event_mod(listener->tftpfd, tftp ? EVENT_IN : 0);
+#endif
     }
   
   return wait;
 }
 
-static void check_dns_listeners(struct daemon *daemon, fd_set *set, time_t now)
+void server_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
 {
-  struct serverfd *serverfdp;
-  struct listener *listener;	  
-  char *buf = NULL;
-  short dial_flag = 0;
-  
-  for (serverfdp = daemon->sfds; serverfdp; serverfdp = serverfdp->next)
-    if (FD_ISSET(serverfdp->fd, set))
-      reply_query(serverfdp, daemon, now);
-  
-  for (listener = daemon->listeners; listener; listener = listener->next)
-    {
-      if (FD_ISSET(listener->fd, set))
+  (void)fd; (void)events;
+  reply_query((struct serverfd *)arg, daemon, now);
+}
+
+/* Take a copy of the libconfig settings which are needed per query, so
+   that we don't look them up for every packet. */
+static void config_snapshot(struct daemon *daemon)
+{
+  char *buf;
+
+  daemon->ap_mode = !config_match("ap_mode", "0");
+  config_extenders(daemon);
+
+  daemon->dial_on_demand = 0;
+  if ((buf = config_get("wan_proto")) &&
+      (!strncmp(buf, "pppoe", 5) || !strncmp(buf, "pptp", 4) || !strncmp(buf, "l2tp", 4)) &&
+      (config_match("wan_pppoe_demand","1") 
+       || config_match("wan_pptp_demand","1")
+       || config_match("wan_l2tp_demand","1")))
+    daemon->dial_on_demand = 1;
+
+  if (!daemon->dial_on_demand)
+    set_dial_on_demand(daemon, 0);
+}
+
+/* Extenders come and go, so this is read again once a second, as well. */
+static void config_extenders(struct daemon *daemon)
+{
+  char *buf = config_get("connect_ext_num");
+
+  daemon->connect_ext_num = buf ? atoi(buf) : 0;
+}
+
+/* Tell the kernel whether packets we send now may bring up a demand-dial
+   link. Only writes when the state changes. */
+static void set_dial_on_demand(struct daemon *daemon, int state)
+{
+  if (daemon->dial_fd == -1 || daemon->dial_state == state)
+    return;
+
+  while (pwrite(daemon->dial_fd, state ? "1\n" : "0\n", 2, 0) == -1)
+    if (errno != EINTR)
       {
-	buf = config_get("wan_proto");
-	if(!strncmp(buf, "pppoe", 5) || !strncmp(buf, "pptp", 4) || !strncmp(buf, "l2tp", 4))
-	{
-		if(config_match("wan_pppoe_demand","1") 
-			|| config_match("wan_pptp_demand","1")
-			|| config_match("wan_l2tp_demand","1"))
-		{
-			dial_flag = 1;
-			system("echo \"1\">/proc/sys/net/dni/dial_on_demand_dns"); 
-		}
-	}
-		if(listener->family == AF_PACKET)
-			receive_raw_query(listener, daemon, now);  
-		else
-			receive_query(listener, daemon, now); 
-	if(dial_flag)
-		system("echo \"0\">/proc/sys/net/dni/dial_on_demand_dns"); 
+	my_syslog(LOG_WARNING, _("cannot set dial on demand: %s"), strerror(errno));
+	close(daemon->dial_fd);
+	daemon->dial_fd = -1;
+	return;
       }
- 
-#ifdef HAVE_TFTP     
-      if (listener->tftpfd != -1 && FD_ISSET(listener->tftpfd, set))
-	tftp_request(listener, daemon, now);
+  daemon->dial_state = state;
+}
+
+static void listener_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
+{
+  struct listener *listener = arg;
+
+  (void)fd; (void)events;
+
+  if (daemon->dial_on_demand)
+    set_dial_on_demand(daemon, 1);
+
+  if (listener->family == AF_PACKET)
+    receive_raw_query(listener, daemon, now);  
+  else
+    receive_query(listener, daemon, now); 
+
+  set_dial_on_demand(daemon, 0);
+}
+
+#ifdef HAVE_TFTP
+static void tftp_listener_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
+{
+  (void)fd; (void)events;
+  tftp_request((struct listener *)arg, daemon, now);
+}
 #endif
 
-      if (listener->tcpfd != -1 && FD_ISSET(listener->tcpfd, set))
-	{
-	  int confd;
-	  struct irec *iface = NULL;
-	  pid_t p;
-	  
-	  while((confd = accept(listener->tcpfd, NULL, NULL)) == -1 && errno == EINTR);
-	  
-	  if (confd == -1)
-	    continue;
-	  
-	  if (daemon->options & OPT_NOWILD)
-	    iface = listener->iface;
-	  else
-	    {
-	      union mysockaddr tcp_addr;
-	      socklen_t tcp_len = sizeof(union mysockaddr);
-	      /* Check for allowed interfaces when binding the wildcard address:
-		 we do this by looking for an interface with the same address as 
-		 the local address of the TCP connection, then looking to see if that's
-		 an allowed interface. As a side effect, we get the netmask of the
-		 interface too, for localisation. */
-	      
-	      /* interface may be new since startup */
-	      if (enumerate_interfaces(daemon) &&
-		  getsockname(confd, (struct sockaddr *)&tcp_addr, &tcp_len) != -1)
-		for (iface = daemon->interfaces; iface; iface = iface->next)
-		  if (sockaddr_isequal(&iface->addr, &tcp_addr))
-		    break;
-	    }
+static void tcp_listener_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
+{
+  struct listener *listener = arg;
+  int confd;
+  struct irec *iface = NULL;
+  pid_t p;
+
+  (void)events;
 	  
-	  if (!iface)
-	    {
-	      shutdown(confd, SHUT_RDWR);
-	      close(confd);
-	    }
+  while((confd = accept(fd, NULL, NULL)) == -1 && errno == EINTR);
+
+  if (confd == -1)
+    return;
+
+  if (daemon->options & OPT_NOWILD)
+    iface = listener->iface;
+  else
+    {
+      union mysockaddr tcp_addr;
+      socklen_t tcp_len = sizeof(union mysockaddr);
+      /* Check for allowed interfaces when binding the wildcard address:
+	 we do this by looking for an interface with the same address as 
+	 the local address of the TCP connection, then looking to see if that's
+	 an allowed interface. As a side effect, we get the netmask of the
+	 interface too, for localisation. */
+
+      /* interface may be new since startup */
+      if (enumerate_interfaces(daemon) &&
+	  getsockname(confd, (struct sockaddr *)&tcp_addr, &tcp_len) != -1)
+	for (iface = daemon->interfaces; iface; iface = iface->next)
+	  if (sockaddr_isequal(&iface->addr, &tcp_addr))
+	    break;
+    }
+
+  if (!iface)
+    {
+      shutdown(confd, SHUT_RDWR);
+      close(confd);
+    }
 #ifndef NO_FORK
-	  else if (!(daemon->options & OPT_DEBUG) && (p = fork()) != 0)
-	    {
-	      if (p != -1)
-		{
-		  int i;
-		  for (i = 0; i < MAX_PROCS; i++)
-		    if (daemon->tcp_pids[i] == 0)
-		      {
-			daemon->tcp_pids[i] = p;
-			break;
-		      }
-		}
-	      close(confd);
-	    }
+  else if (!(daemon->options & OPT_DEBUG) && (p = fork()) != 0)
+    {
+      if (p != -1)
+	{
+	  int i;
+	  for (i = 0; i < MAX_PROCS; i++)
+	    if (daemon->tcp_pids[i] == 0)
+	      {
+		daemon->tcp_pids[i] = p;
+		break;
+	      }
+	}
+      close(confd);
+    }
 #endif
-	  else
-	    {
-	      unsigned char *buff;
-	      struct server *s; 
-	      int flags;
-	      struct in_addr dst_addr_4;
-	      
-	      dst_addr_4.s_addr = 0;
-	      
-	       /* Arrange for SIGALARM after CHILD_LIFETIME seconds to
-		  terminate the process. */
-	      if (!(daemon->options & OPT_DEBUG))
-		alarm(CHILD_LIFETIME);
-	      
-	      /* start with no upstream connections. */
-	      for (s = daemon->servers; s; s = s->next)
-		 s->tcpfd = -1; 
-	      
-	      /* The connected socket inherits non-blocking
-		 attribute from the listening socket. 
-		 Reset that here. */
-	      if ((flags = fcntl(confd, F_GETFL, 0)) != -1)
-		fcntl(confd, F_SETFL, flags & ~O_NONBLOCK);
-	      
-	      if (listener->family == AF_INET)
-		dst_addr_4 = iface->addr.in.sin_addr;
-	      
-	      buff = tcp_request(daemon, confd, now, dst_addr_4, iface->netmask);
-	       
-	      shutdown(confd, SHUT_RDWR);
-	      close(confd);
-	      
-	      if (buff)
-		free(buff);
-	      
-	      for (s = daemon->servers; s; s = s->next)
-		if (s->tcpfd != -1)
-		  {
-		    shutdown(s->tcpfd, SHUT_RDWR);
-		    close(s->tcpfd);
-		  }
+  else
+    {
+      unsigned char *buff;
+      struct server *s; 
+      int flags;
+      struct in_addr dst_addr_4;
+
+      dst_addr_4.s_addr = 0;
+
+       /* Arrange for SIGALARM after CHILD_LIFETIME seconds to
+	  terminate the process. */
+      if (!(daemon->options & OPT_DEBUG))
+	alarm(CHILD_LIFETIME);
+
+      /* start with no upstream connections. */
+      for (s = daemon->servers; s; s = s->next)
+	 s->tcpfd = -1; 
+
+      /* The connected socket inherits non-blocking
+	 attribute from the listening socket. 
+	 Reset that here. */
+      if ((flags = fcntl(confd, F_GETFL, 0)) != -1)
+	fcntl(confd, F_SETFL, flags & ~O_NONBLOCK);
+
+      if (listener->family == AF_INET)
+	dst_addr_4 = iface->addr.in.sin_addr;
+
+      buff = tcp_request(daemon, confd, now, dst_addr_4, iface->netmask);
+
+      shutdown(confd, SHUT_RDWR);
+      close(confd);
+
+      if (buff)
+	free(buff);
+
+      for (s = daemon->servers; s; s = s->next)
+	if (s->tcpfd != -1)
+	  {
+	    shutdown(s->tcpfd, SHUT_RDWR);
+	    close(s->tcpfd);
+	  }
 #ifndef NO_FORK		   
-	      if (!(daemon->options & OPT_DEBUG))
-		_exit(0);
+      if (!(daemon->options & OPT_DEBUG))
+	_exit(0);
 #endif
-	    }
-	}
     }
-#ifdef DNI_IPV6_FEATURE
-  check_timeout_forward(daemon, now);
-#endif
+}
+
+static void dhcp_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
+{
+  (void)arg; (void)fd; (void)events;
+  dhcp_packet(daemon, now);
+}
+
+static void helper_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
+{
+  (void)arg; (void)fd; (void)events; (void)now;
+  helper_write(daemon);
 }
 
 
@@ -1040,6 +1087,33 @@ int make_icmp_sock(void)
   return fd;
 }
 
+struct icmp_wait {
+  struct in_addr addr;
+  unsigned short id;
+  int gotreply;
+};
+
+static void icmp_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
+{
+  struct icmp_wait *w = arg;
+  struct { 
+    struct ip ip;
+    struct icmp icmp;
+  } packet;
+  struct sockaddr_in faddr;
+  socklen_t len = sizeof(faddr);
+
+  (void)daemon; (void)events; (void)now;
+
+  if (recvfrom(fd, &packet, sizeof(packet), 0,
+	       (struct sockaddr *)&faddr, &len) == sizeof(packet) &&
+      w->addr.s_addr == faddr.sin_addr.s_addr &&
+      packet.icmp.icmp_type == ICMP_ECHOREPLY &&
+      packet.icmp.icmp_seq == 0 &&
+      packet.icmp.icmp_id == w->id)
+    w->gotreply = 1;
+}
+
 int icmp_ping(struct daemon *daemon, struct in_addr addr)
 {
   /* Try and get an ICMP echo from a machine. */
@@ -1055,9 +1129,8 @@ int icmp_ping(struct daemon *daemon, struct in_addr addr)
     struct ip ip;
     struct icmp icmp;
   } packet;
-  unsigned short id = rand16();
+  struct icmp_wait w;
   unsigned int i, j;
-  int gotreply = 0;
   time_t start, now;
 
 #ifdef HAVE_LINUX_NETWORK
@@ -1069,6 +1142,10 @@ int icmp_ping(struct daemon *daemon, struct in_addr addr)
   setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
 #endif
 
+  w.addr = addr;
+  w.id = rand16();
+  w.gotreply = 0;
+
   saddr.sin_family = AF_INET;
   saddr.sin_port = 0;
   saddr.sin_addr = addr;
@@ -1078,7 +1155,7 @@ int icmp_ping(struct daemon *daemon, struct in_addr addr)
   
   memset(&packet.icmp, 0, sizeof(packet.icmp));
   packet.icmp.icmp_type = ICMP_ECHO;
-  packet.icmp.icmp_id = id;
+  packet.icmp.icmp_id = w.id;
   for (j = 0, i = 0; i < sizeof(struct icmp) / 2; i++)
     j += ((u16 *)&packet.icmp)[i];
   while (j>>16)
@@ -1088,52 +1165,21 @@ int icmp_ping(struct daemon *daemon, struct in_addr addr)
   while (sendto(fd, (char *)&packet.icmp, sizeof(struct icmp), 0, 
 		(struct sockaddr *)&saddr, sizeof(saddr)) == -1 &&
 	 retry_send());
+
+  event_hold(1);
+  event_add(fd, EVENT_IN, icmp_event, &w);
   
   for (now = start = dnsmasq_time(); 
-       difftime(now, start) < (float)PING_WAIT;)
+       !w.gotreply && difftime(now, start) < (float)PING_WAIT;)
     {
-      struct timeval tv;
-      fd_set rset, wset;
-      struct sockaddr_in faddr;
-      int maxfd = fd; 
-      socklen_t len = sizeof(faddr);
-      
-      tv.tv_usec = 250000;
-      tv.tv_sec = 0; 
-      
-      FD_ZERO(&rset);
-      FD_ZERO(&wset);
-      FD_SET(fd, &rset);
-      set_dns_listeners(daemon, now, &rset, &maxfd);
-      set_log_writer(&wset, &maxfd);
-
-      if (select(maxfd+1, &rset, &wset, NULL, &tv) < 0)
-	{
-	  FD_ZERO(&rset);
-	  FD_ZERO(&wset);
-	}
+      set_dns_listeners(daemon, now);
+      set_log_writer();
 
-      now = dnsmasq_time();
-
-      check_log_writer(&wset);
-      check_dns_listeners(daemon, &rset, now);
-
-#ifdef HAVE_TFTP
-      check_tftp_listeners(daemon, &rset, now);
-#endif
-
-      if (FD_ISSET(fd, &rset) &&
-	  recvfrom(fd, &packet, sizeof(packet), 0,
-		   (struct sockaddr *)&faddr, &len) == sizeof(packet) &&
-	  saddr.sin_addr.s_addr == faddr.sin_addr.s_addr &&
-	  packet.icmp.icmp_type == ICMP_ECHOREPLY &&
-	  packet.icmp.icmp_seq == 0 &&
-	  packet.icmp.icmp_id == id)
-	{
-	  gotreply = 1;
-	  break;
-	}
+      now = event_wait(daemon, 250);
     }
+
+  event_del(fd);
+  event_hold(0);
   
 #ifdef HAVE_LINUX_NETWORK
   close(fd);
@@ -1142,7 +1188,7 @@ int icmp_ping(struct daemon *daemon, struct in_addr addr)
   setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
 #endif
 
-  return gotreply;
+  return w.gotreply;
 }
 
  
@@ -86,6 +86,7 @@ struct in6_pktinfo {
 #include <sys/uio.h>
 #include <syslog.h>
 #include <dirent.h>
+#include <sys/mman.h>
 #ifndef HAVE_LINUX_NETWORK
 #  include <net/if_dl.h>
 #endif
@@ -102,6 +103,14 @@ extern int capset(cap_user_header_t header, cap_user_data_t data);
 #include <sys/prctl.h>
 #endif
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_TIMERFD
+#include <sys/timerfd.h>
+#endif
+
 #ifdef HAVE_IPV6
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
@@ -147,6 +156,7 @@ extern int capset(cap_user_header_t header, cap_user_data_t data);
 #define OPT_TFTP_NOBLOCK   (1<<27)
 #define OPT_LOG_OPTS       (1<<28)
 #define OPT_TRY_ALL_NS     (1<<29)
+#define OPT_INCR_RELOAD    (1<<30)
 
 #define T_A6 ns_t_a6
 
@@ -203,8 +213,14 @@ union bigname {
   union bigname *next; /* freelist */
 };
 
+/* Not packed: these are read on every lookup. */
+#pragma pack()
 struct crec { 
-  struct crec *next, *prev, *hash_next;
+  struct crec *next, *prev;
+  struct crec *rev_next; /* F_REVERSE entries: chain in the address index */
+  struct crec *expiry_next, **expiry_pprev; /* slot in the expiry wheel */
+  unsigned int hash; /* of the name, for the name index */
+  unsigned int ttl; /* it came with, see prefetch.c */
   time_t ttd; /* time to die */
   int uid; 
   union {
@@ -215,12 +231,15 @@ struct crec {
     } cname;
   } addr;
   unsigned short flags;
+  unsigned short hits; /* answers given from it */
+  unsigned char prefetch; /* PREFETCH_* */
   union {
     char sname[SMALLDNAME];
     union bigname *bname;
     char *namep;
   } name;
 };
+#pragma pack(1)
 
 #define F_IMMORTAL  1
 #define F_CONFIG    2
@@ -239,6 +258,9 @@ struct crec {
 #define F_CNAME     16384
 #define F_NOERR     32768
 
+#define PREFETCH_ASKED   1 /* a refresh went out for it */
+#define PREFETCH_FETCHED 2 /* it came from a refresh, and hasn't been used */
+
 /* struct sockaddr is not large enough to hold any address,
    and specifically not big enough to hold an IPv6 address.
    Blech. Roll our own. */
@@ -285,6 +307,11 @@ struct server {
   struct serverfd *sfd; 
   char *domain; /* set if this server only handles a domain. */ 
   int flags, tcpfd;
+  struct {
+    int srtt, rttvar;        /* ms, smoothed as for TCP, or 0 before a reply */
+    unsigned int queries, replies, lost;
+    unsigned int misses;     /* lost since the last reply */
+  } stats;
   struct server *next; 
 };
 
@@ -325,6 +352,56 @@ struct hostsfile {
   int index; /* matches to cache entries for logging */
 };
 
+/* a file's stat, to tell when it has changed: see file_stamp() */
+struct file_stamp {
+  time_t mtime, ctime;
+  long mtime_ns, ctime_ns;
+  ino_t ino;
+  dev_t dev;
+  off_t size;
+};
+
+struct daemon;
+typedef void (*timer_cb)(struct daemon *daemon, void *arg, time_t now);
+
+/* zero before first use, see timer.c */
+struct timer {
+  struct timer *next, **pprev;
+  unsigned long expires;
+  timer_cb cb;
+  void *arg;
+};
+
+/* The question section of a packet, decoded once by decode_question() when
+   it arrives and then handed down the answer and forward paths. flags is
+   as extract_request() returns it, so zero unless there is exactly one
+   question. label[] holds the offset in name of each of the first
+   MAXLABELS labels. */
+#define MAXLABELS 128
+
+struct question {
+  unsigned short flags, qtype, qclass;
+  unsigned int crc;
+  unsigned char *qend;          /* end of the question section */
+  unsigned char *pheader;       /* RFC2671 pseudoheader, or NULL */
+  unsigned char *udpsz;         /* its UDP payload size */
+  size_t pheader_len;
+  int is_sign;
+  int namelen, labels;
+  unsigned short label[MAXLABELS];
+  char name[MAXDNAME];
+};
+
+/* a client waiting on a forwarded query which another asked first */
+struct frec_src {
+  union mysockaddr source;
+  struct all_addr dest;
+  unsigned int iface;
+  unsigned short orig_id, udpsz;  /* udpsz: the largest reply it takes */
+  int fd;
+  struct frec_src *next;
+};
+
 struct frec {
   union mysockaddr source;
   struct all_addr dest;
@@ -361,13 +438,34 @@ struct frec {
      servers, and the value of this variable will be reset to 2 straight. */
   int fwd_sign;
   unsigned short flags;
+#endif
   unsigned short type;
   unsigned short class;
-#endif
-  char name[MAXDNAME];
-  struct frec *next;
+  char *name;                     /* query name, see frec_set_name() */
+  unsigned short name_sz;
+  struct frec *next, *prev;       /* age-ordered in-use list, or free list */
+  struct frec *id_next;           /* hash chain by new_id */
+  struct frec *sender_next;       /* hash chain by source, orig_id, crc */
+  struct frec *question_next;     /* hash chain by crc, for those which can be joined */
+  unsigned short join;            /* FREC_JOIN and the query bits the reply depends on, or 0 */
+  struct frec_src *waiters;       /* others asking the same */
+  int hashed;
+  struct timer timer;             /* expiry, or fallback requery */
+  unsigned long sent;             /* ms, from timer_now() */
+  int timing;                     /* FREC_* below */
+  unsigned char *query;           /* the query as sent, to send again */
+  unsigned short query_len, query_sz;
+  struct server *hedgeto;         /* where it went again, or NULL */
+  unsigned long hedge_sent;
+  struct timer hedge;             /* when to send it again */
 };
 
+#define FREC_IDLE   0             /* no reply due */
+#define FREC_ONCE   1             /* sent once: a reply gives the RTT */
+#define FREC_AGAIN  2             /* sent again: a reply can't be timed */
+
+#define FREC_JOIN   0x10          /* others asking the same can wait on it */
+
 /* actions in the daemon->helper RPC */
 #define ACTION_DEL           1
 #define ACTION_OLD_HOSTNAME  2
@@ -552,7 +650,7 @@ struct tftp_file {
 
 struct tftp_transfer {
   int sockfd;
-  time_t timeout;
+  struct timer timer;
   int backoff;
   unsigned int block, blocksize;
   struct sockaddr_in peer;
@@ -569,6 +667,7 @@ struct static_pptp_record
   time_t t;
   char pkt[PACKETSZ]; //512
   int len;
+  struct timer timer;
   struct static_pptp_record *next;
 };
 #endif
@@ -612,6 +711,11 @@ struct daemon {
   char *log_file; /* optional log file */
   int max_logs;  /* queue limit */
   int cachesize, ftabsize;
+  char *cache_file; /* optional snapshot of the cache */
+  int cache_save; /* secs between snapshots */
+  int reply_cache; /* size of the table of whole replies, or zero */
+  int hedge_max; /* queries sent on to a second server at once, or zero */
+  int prefetch; /* refreshes of cache entries a second, or zero */
   int port, query_port;
   unsigned long local_ttl;
   struct hostsfile *addn_hosts;
@@ -665,6 +769,10 @@ struct daemon {
   struct tftp_transfer *tftp_trans;
   char *tftp_prefix; 
 
+  /* libconfig settings used on every query, read at startup and on SIGHUP */
+  int ap_mode, dial_on_demand, connect_ext_num;
+  int dial_fd, dial_state; /* /proc/sys/net/dni/dial_on_demand_dns */
+
 #ifdef SUP_STATIC_PPTP
   /* Static pptp for Russian */
   int static_pptp_enable;
@@ -704,11 +812,43 @@ void cache_start_insert(void);
 struct crec *cache_insert(char *name, struct all_addr *addr,
 			  time_t now, unsigned long ttl, unsigned short flags);
 void cache_reload(int opts, char *buff, char *domain_suffix, struct hostsfile  *addn_hosts);
+void cache_forget(char *name, struct all_addr *addr, unsigned short flags);
+void cache_save(char *file, time_t now);
+void cache_restore(char *file, time_t now);
 void cache_add_dhcp_entry(struct daemon *daemon, char *host_name, struct in_addr *host_address, time_t ttd);
 void cache_unhash_dhcp(void);
 void dump_cache(struct daemon *daemon, time_t now);
 char *cache_get_name(struct crec *crecp);
 
+/* domains.c */
+void domain_trie_build(struct server *servers);
+struct server **domain_servers(struct question *question, int nodots);
+
+/* hosts.c */
+void hosts_load(int opts, char *buff, char *domain_suffix, struct hostsfile *addn_hosts);
+struct crec **hosts_find_by_name(struct crec **chainp, char *name, unsigned short prot);
+struct crec **hosts_find_by_addr(struct crec **chainp, struct all_addr *addr, unsigned short prot);
+
+/* prefetch.c */
+void prefetch_init(int qps);
+void prefetch_start(void);
+void prefetch_note(struct crec *crecp, time_t now);
+void prefetch_end(struct question *question, time_t now);
+void prefetch_reply(int on);
+void prefetch_inserted(struct crec *crecp);
+void prefetch_freed(struct crec *crecp);
+void prefetch_stats(void);
+
+/* replies.c */
+void reply_init(int size);
+void reply_flush(void);
+void reply_start(void);
+void reply_skip(void);
+void reply_note(struct crec *crecp, unsigned char *p);
+void reply_store(HEADER *header, size_t len, struct question *question, int sec_reqd);
+size_t reply_find(HEADER *header, char *limit, struct question *question, time_t now);
+void reply_stats(void);
+
 /* rfc1035.c */
 unsigned short extract_request(HEADER *header, size_t qlen, 
 			       char *name, unsigned short *typep);
@@ -717,14 +857,18 @@ size_t setup_reply(HEADER *header, size_t  qlen,
 		   unsigned long local_ttl);
 void extract_addresses(HEADER *header, size_t qlen, char *namebuff, 
 		       time_t now, struct daemon *daemon, struct server *server);
-size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *daemon, 
-		   struct in_addr local_addr, struct in_addr local_netmask, time_t now);
+size_t answer_request(HEADER *header, char *limit, size_t qlen, struct question *question,
+		      struct daemon *daemon, struct in_addr local_addr, 
+		      struct in_addr local_netmask, time_t now);
+void check_extender_records(void);
 int check_for_bogus_wildcard(HEADER *header, size_t qlen, char *name, 
 			     struct bogus_addr *addr, time_t now);
 unsigned char *find_pseudoheader(HEADER *header, size_t plen,
 				 size_t *len, unsigned char **p, int *is_sign);
 int check_for_local_domain(char *name, time_t now, struct daemon *daemon);
 unsigned int questions_crc(HEADER *header, size_t plen, char *buff);
+unsigned short decode_question(HEADER *header, size_t plen, struct question *q);
+void dump_question_stats(void);
 size_t resize_packet(HEADER *header, size_t plen, 
 		  unsigned char *pheader, size_t hlen);
 extern int get_lan_linklocal_ipaddr6(struct in6_addr *inp6, int global_flag);
@@ -742,6 +886,7 @@ void *safe_malloc(size_t size);
 int sa_len(union mysockaddr *addr);
 int sockaddr_isequal(union mysockaddr *s1, union mysockaddr *s2);
 int hostname_isequal(char *a, char *b);
+unsigned int hostname_hash(char *name);
 time_t dnsmasq_time(void);
 int is_same_net(struct in_addr a, struct in_addr b, struct in_addr mask);
 int retry_send(void);
@@ -755,13 +900,53 @@ int expand_buf(struct iovec *iov, size_t size);
 char *print_mac(struct daemon *daemon, unsigned char *mac, int len);
 void bump_maxfd(int fd, int *max);
 int read_write(int fd, unsigned char *packet, int size, int rw);
+void file_stamp(struct file_stamp *fs, struct stat *sb);
+int file_unchanged(struct file_stamp *fs, struct stat *sb);
 
 /* log.c */
 void die(char *message, char *arg1);
 int log_start(struct daemon *daemon);
 void my_syslog(int priority, const char *format, ...);
-void set_log_writer(fd_set *set, int *maxfdp);
-void check_log_writer(fd_set *set);
+void set_log_writer(void);
+
+/* Trace points: TRACE(category, format, ...) logs when the category was
+   enabled with --trace, and compiles to nothing without HAVE_TRACE. */
+#define TRACE_ANSWER 1  /* answer_request() */
+#define TRACE_HIJACK 2  /* DNS and extender hijack */
+#ifdef HAVE_TRACE
+extern unsigned int trace_flags;
+#  define TRACE(cat, ...) \
+  do { if (trace_flags & (cat)) my_syslog(LOG_DEBUG, __VA_ARGS__); } while (0)
+#else
+#  define TRACE(cat, ...) do { } while (0)
+#endif
+
+/* event.c */
+#define EVENT_IN    1
+#define EVENT_OUT   2
+#define EVENT_ERR   4  /* reported only */
+#define EVENT_EDGE  8  /* registration flag: edge triggered, handler must drain */
+#define EVENT_MAIN  16 /* registration flag: only serviced by the main loop */
+typedef void (*event_cb)(struct daemon *daemon, void *arg, int fd, int events, time_t now);
+void event_init(void);
+int event_owns_fd(int fd);
+void event_add(int fd, int events, event_cb cb, void *arg);
+void event_mod(int fd, int events);
+void event_del(int fd);
+void event_hold(int hold);
+time_t event_wait(struct daemon *daemon, int timeout);
+
+/* timer.c */
+void timer_init(void);
+void timer_add(struct timer *t, unsigned int ms, timer_cb cb, void *arg);
+void timer_del(struct timer *t);
+unsigned int timer_ms(double secs);
+unsigned long timer_now(void);
+int timer_pending(struct timer *t);
+void timer_run(struct daemon *daemon);
+#ifndef HAVE_TIMERFD
+int timer_wait(void);
+#endif
 
 /* option.c */
 struct daemon *read_opts (int argc, char **argv, char *compile_opts);
@@ -774,6 +959,8 @@ unsigned char *tcp_request(struct daemon *daemon, int confd, time_t now,
 			   struct in_addr local_addr, struct in_addr netmask);
 void server_gone(struct daemon *daemon, struct server *server);
 struct frec *get_new_frec(struct daemon *daemon, time_t now, int *wait);
+void forward_refresh(struct daemon *daemon, char *name, unsigned short qtype, time_t now);
+void dump_forward_stats(struct daemon *daemon);
 
 /* network.c */
 struct serverfd *allocate_sfd(union mysockaddr *addr, struct serverfd **sfds);
@@ -830,8 +1017,9 @@ size_t dhcp_reply(struct daemon *daemon, struct dhcp_context *context, char *ifa
 
 /* dnsmasq.c */
 int make_icmp_sock(void);
+void server_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
 int icmp_ping(struct daemon *daemon, struct in_addr addr);
-void clear_cache_and_reload(struct daemon *daemon, time_t now);
+void clear_cache_and_reload(struct daemon *daemon, time_t now, int opts);
 
 /* isc.c */
 #ifdef HAVE_ISC_READER
@@ -858,10 +1046,7 @@ int iface_enumerate(struct daemon *daemon, void *parm,
 /* dbus.c */
 #ifdef HAVE_DBUS
 char *dbus_init(struct daemon *daemon);
-void check_dbus_listeners(struct daemon *daemon,
-			  fd_set *rset, fd_set *wset, fd_set *eset);
-void set_dbus_listeners(struct daemon *daemon, int *maxfdp, 
-			fd_set *rset, fd_set *wset, fd_set *eset);
+void check_dbus_listeners(struct daemon *daemon);
 #endif
 
 /* helper.c */
@@ -874,14 +1059,19 @@ int helper_buf_empty(void);
 /* tftp.c */
 #ifdef HAVE_TFTP
 void tftp_request(struct listener *listen, struct daemon *daemon, time_t now);
-void check_tftp_listeners(struct daemon *daemon, fd_set *rset, time_t now);
+#endif
+
+#ifdef DNI_PARENTAL_CTL
+/* parental.c */
+void parental_init(struct daemon *daemon);
+void parental_check_table(void);
+void parental_tag_query(HEADER *header, char *limit, size_t *n, union mysockaddr *source);
 #endif
 
 #ifdef SUP_STATIC_PPTP
 /* staticpptp.c */
 extern void add_static_pptp_record(struct daemon *daemon, char *domain_name, void *packet, int plen);
 extern void del_static_pptp_record(struct daemon *daemon, char *domain_name);
-extern void timer_check_static_pptp_query(struct daemon *daemon);
 extern int load_static_pptp_server(struct daemon *daemon);
 extern int load_static_pptp_config(struct daemon *daemon);
 extern void check_static_pptp(void *packet, int plen, struct daemon *daemon);
@@ -889,7 +1079,9 @@ extern void check_static_pptp(void *packet, int plen, struct daemon *daemon);
 
 //ifdef SUP_MUL_PPPOE
 /*******support for mul pppoe function**********/
-extern void check_mul_pppoe_record(HEADER *header, int plen);
+extern void check_mul_pppoe_record(HEADER *header, int plen, struct question *q);
+extern void check_mul_pppoe_files(void);
+extern int mulpppoe_skip_dns(struct in_addr srv, char *name);
 extern unsigned char *get_resolve_address(int *addrcount, struct in_addr *ip_addr, HEADER *header, size_t plen);
 extern struct dname_record *dname_list;
 extern char *dname_check_file;
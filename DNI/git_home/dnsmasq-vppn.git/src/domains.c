@@ -0,0 +1,247 @@
+/* dnsmasq is Copyright (c) 2000-2007 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include "dnsmasq.h"
+
+/* The servers for domains (--server=/domain/ and --address=/domain/) are
+   kept in a trie of the labels of their domains, last label first, so
+   search_servers() only has to look at those on the path down for the
+   labels of a name, and the ones for names without dots, rather than at
+   all of them. Which of those wins is still decided over them in the
+   order of the servers list, since that order matters.
+
+   A domain which starts with a '.' only matches names below it: its
+   servers are kept apart from those which match the name too. The nodes
+   are found in a hash table by their parent and label; node 0 is the
+   root, which has the servers for all names, from --server=/#/. */
+
+struct dnode {
+  unsigned int parent, hash, len;
+  char *label;      /* in the domain of the server which made it */
+  int exact, below; /* first of the servers for the name, and for names under it */
+  int exact_end, below_end;
+};
+
+static struct dnode *dnodes = NULL;
+static unsigned int dnode_count, *dslots, dslot_mask;
+static struct server **dservers, **dmatch;
+static int *dnext, dnodots, dnodots_end;
+
+static char fold(char c)
+{
+  return (c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c;
+}
+
+static unsigned int label_hash(unsigned int parent, char *label, unsigned int len)
+{
+  unsigned int h = 2166136261u ^ parent;
+
+  while (len--)
+    h = (h ^ (unsigned char)fold(*label++)) * 16777619u;
+
+  return h;
+}
+
+/* the child of parent for label, or zero */
+static unsigned int dnode_find(unsigned int parent, char *label, unsigned int len, unsigned int hash)
+{
+  unsigned int i, n;
+
+  for (i = hash & dslot_mask; (n = dslots[i]) != 0; i = (i + 1) & dslot_mask)
+    {
+      struct dnode *d = &dnodes[n];
+
+      if (d->hash == hash && d->parent == parent && d->len == len)
+	{
+	  unsigned int j;
+
+	  for (j = 0; j < len && fold(d->label[j]) == fold(label[j]); j++);
+	  if (j == len)
+	    return n;
+	}
+    }
+
+  return 0;
+}
+
+static unsigned int dnode_add(unsigned int parent, char *label, unsigned int len)
+{
+  unsigned int hash = label_hash(parent, label, len), n, i;
+  struct dnode *d;
+
+  if ((n = dnode_find(parent, label, len, hash)) != 0)
+    return n;
+
+  n = dnode_count++;
+  d = &dnodes[n];
+  d->parent = parent;
+  d->hash = hash;
+  d->label = label;
+  d->len = len;
+  d->exact = d->below = -1;
+
+  for (i = hash & dslot_mask; dslots[i] != 0; i = (i + 1) & dslot_mask);
+  dslots[i] = n;
+
+  return n;
+}
+
+static void chain_add(int *first, int *end, int k)
+{
+  if (*first == -1)
+    *first = k;
+  else
+    dnext[*end] = k;
+  *end = k;
+  dnext[k] = -1;
+}
+
+static void domain_trie_free(void)
+{
+  free(dnodes);
+  free(dslots);
+  free(dservers);
+  free(dmatch);
+  free(dnext);
+  dnodes = NULL;
+}
+
+/* Called whenever daemon->servers changes. If memory is short, or a server
+   is for both a domain and names without dots, there's no trie and
+   search_servers() looks at every server. */
+void domain_trie_build(struct server *servers)
+{
+  struct server *serv;
+  unsigned int nodes = 1, slots, servs = 0;
+  int k;
+
+  domain_trie_free();
+
+  for (serv = servers; serv; serv = serv->next, servs++)
+    if (serv->flags & SERV_HAS_DOMAIN)
+      {
+	char *p;
+
+	if (serv->flags & SERV_FOR_NODOTS)
+	  return;
+	for (nodes++, p = serv->domain; *p; p++)
+	  if (*p == '.')
+	    nodes++;
+      }
+
+  for (slots = 1; slots < 2 * nodes; slots <<= 1);
+
+  dnodes = malloc(nodes * sizeof(struct dnode));
+  dslots = calloc(slots, sizeof(unsigned int));
+  dservers = malloc((servs + 1) * sizeof(struct server *));
+  dmatch = malloc((servs + 1) * sizeof(struct server *));
+  dnext = malloc((servs + 1) * sizeof(int));
+
+  if (!dnodes || !dslots || !dservers || !dmatch || !dnext)
+    {
+      domain_trie_free();
+      return;
+    }
+
+  dslot_mask = slots - 1;
+  dnode_count = 1;
+  dnodes[0].exact = dnodes[0].below = -1;
+  dnodots = -1;
+
+  for (serv = servers, k = 0; serv; serv = serv->next, k++)
+    {
+      dservers[k] = serv;
+
+      if (serv->flags & SERV_FOR_NODOTS)
+	chain_add(&dnodots, &dnodots_end, k);
+      else if (serv->flags & SERV_HAS_DOMAIN)
+	{
+	  char *domain = serv->domain, *end;
+	  unsigned int n = 0;
+	  int below = 0;
+
+	  if (*domain == '.')
+	    {
+	      domain++;
+	      below = 1;
+	      /* "." would need a name which ends in a dot */
+	      if (!*domain)
+		continue;
+	    }
+
+	  for (end = domain + strlen(domain); end != domain; )
+	    {
+	      char *label = end;
+
+	      while (label != domain && *(label-1) != '.')
+		label--;
+	      n = dnode_add(n, label, end - label);
+	      end = (label == domain) ? label : label - 1;
+	      /* an empty label first */
+	      if (end == domain && *end == '.')
+		n = dnode_add(n, end, 0);
+	    }
+
+	  if (below)
+	    chain_add(&dnodes[n].below, &dnodes[n].below_end, k);
+	  else
+	    chain_add(&dnodes[n].exact, &dnodes[n].exact_end, k);
+	}
+    }
+}
+
+/* The servers which may be for the name in question, in the order of the
+   servers list and ended by NULL, or NULL if they all have to be looked at. */
+struct server **domain_servers(struct question *question, int nodots)
+{
+  int heads[2 * MAXLABELS + 2], chains = 0, count = 0, i;
+  unsigned int n = 0;
+
+  if (!dnodes || question->labels > MAXLABELS)
+    return NULL;
+
+  if (nodots && question->namelen != 0)
+    heads[chains++] = dnodots;
+  heads[chains++] = dnodes[0].exact;
+
+  for (i = question->labels - 1; i >= 0; i--)
+    {
+      char *label = question->name + question->label[i];
+      unsigned int len = (i == question->labels - 1) ?
+	question->namelen - question->label[i] : question->label[i+1] - 1 - question->label[i];
+
+      if ((n = dnode_find(n, label, len, label_hash(n, label, len))) == 0)
+	break;
+      heads[chains++] = dnodes[n].exact;
+      if (i != 0)
+	heads[chains++] = dnodes[n].below;
+    }
+
+  /* merge the chains, which are each in order */
+  while (1)
+    {
+      int best = -1, j;
+
+      for (j = 0; j < chains; j++)
+	if (heads[j] != -1 && (best == -1 || heads[j] < heads[best]))
+	  best = j;
+
+      if (best == -1)
+	break;
+
+      dmatch[count++] = dservers[heads[best]];
+      heads[best] = dnext[heads[best]];
+    }
+
+  dmatch[count] = NULL;
+  return dmatch;
+}
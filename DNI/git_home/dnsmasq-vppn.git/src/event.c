@@ -0,0 +1,319 @@
+/* dnsmasq is Copyright (c) 2000-2007 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include "dnsmasq.h"
+
+/* The event core. Each file descriptor is registered once, together with
+   the events it is interested in and a handler to call when it is ready,
+   and stays registered until event_del(). Wanting no events is cheap: the
+   descriptor is just taken out of the kernel set until wanted again.
+
+   With HAVE_EPOLL the kernel keeps the set, so a wait costs in proportion
+   to the number of ready descriptors, not the number registered. Without it
+   we fall back to select() over the registration table. */
+
+#define EVENT_BATCH 32 /* max ready descriptors handled per wait */
+
+struct event_handler {
+  event_cb cb;
+  void *arg;
+  int events; /* EVENT_IN/EVENT_OUT wanted, plus EVENT_EDGE/EVENT_MAIN */
+  int live;   /* EVENT_IN/EVENT_OUT currently in the kernel set */
+  int forced; /* epoll refused it (regular file): always ready */
+};
+
+static struct event_handler *handlers = NULL;
+static int handlers_sz = 0, holding = 0;
+#ifdef HAVE_EPOLL
+static int epfd = -1, forced_count = 0;
+#endif
+
+static void event_apply(int fd);
+
+void event_init(void)
+{
+#ifdef HAVE_EPOLL
+  int flags;
+
+  if ((epfd = epoll_create(EVENT_BATCH)) == -1)
+    die(_("cannot create epoll descriptor: %s"), NULL);
+
+  if ((flags = fcntl(epfd, F_GETFD)) != -1)
+    fcntl(epfd, F_SETFD, flags | FD_CLOEXEC);
+#endif
+}
+
+int event_owns_fd(int fd)
+{
+#ifdef HAVE_EPOLL
+  if (fd == epfd)
+    return 1;
+#endif
+  return fd >= 0 && fd < handlers_sz && handlers[fd].cb;
+}
+
+void event_add(int fd, int events, event_cb cb, void *arg)
+{
+  struct event_handler *h;
+
+  if (fd < 0)
+    return;
+
+  if (fd >= handlers_sz)
+    {
+      int new_sz = handlers_sz == 0 ? 64 : handlers_sz;
+      struct event_handler *new;
+
+      while (new_sz <= fd)
+	new_sz *= 2;
+
+      new = safe_malloc(new_sz * sizeof(struct event_handler));
+      memset(new, 0, new_sz * sizeof(struct event_handler));
+      if (handlers)
+	{
+	  memcpy(new, handlers, handlers_sz * sizeof(struct event_handler));
+	  free(handlers);
+	}
+      handlers = new;
+      handlers_sz = new_sz;
+    }
+
+  h = &handlers[fd];
+
+  /* re-registration: the old fd may have been closed without event_del(),
+     so take it out and start again rather than trust our idea of the kernel set. */
+  if (h->cb && h->live)
+    {
+      h->events &= ~(EVENT_IN | EVENT_OUT);
+      event_apply(fd);
+    }
+
+  h->cb = cb;
+  h->arg = arg;
+  h->events = events;
+  event_apply(fd);
+}
+
+void event_mod(int fd, int events)
+{
+  if (fd < 0 || fd >= handlers_sz || !handlers[fd].cb)
+    return;
+
+  handlers[fd].events = (handlers[fd].events & ~(EVENT_IN | EVENT_OUT)) |
+    (events & (EVENT_IN | EVENT_OUT));
+  event_apply(fd);
+}
+
+/* Call before close(): the kernel drops closed descriptors from an epoll
+   set on its own, but our table would still think they're in use. */
+void event_del(int fd)
+{
+  if (fd < 0 || fd >= handlers_sz || !handlers[fd].cb)
+    return;
+
+  handlers[fd].events &= ~(EVENT_IN | EVENT_OUT);
+  event_apply(fd);
+  handlers[fd].cb = NULL;
+  handlers[fd].arg = NULL;
+  handlers[fd].events = 0;
+}
+
+/* Stop (or restart) servicing the descriptors registered with EVENT_MAIN.
+   Used when waiting for events from somewhere other than the main loop,
+   eg during the DHCP ping check, where we must stay deaf to signals and
+   further DHCP packets. */
+void event_hold(int hold)
+{
+  int fd;
+
+  holding = hold;
+  for (fd = 0; fd < handlers_sz; fd++)
+    if (handlers[fd].cb && (handlers[fd].events & EVENT_MAIN))
+      event_apply(fd);
+}
+
+static void event_apply(int fd)
+{
+  struct event_handler *h = &handlers[fd];
+  int want = h->events & (EVENT_IN | EVENT_OUT);
+
+  if (holding && (h->events & EVENT_MAIN))
+    want = 0;
+
+  if (want == h->live)
+    return;
+
+#ifdef HAVE_EPOLL
+  if (h->forced)
+    {
+      if (want == 0)
+	{
+	  h->forced = 0;
+	  forced_count--;
+	}
+    }
+  else
+    {
+      struct epoll_event ev;
+      int op = EPOLL_CTL_MOD;
+
+      memset(&ev, 0, sizeof(ev));
+      ev.data.fd = fd;
+      if (want & EVENT_IN)
+	ev.events |= EPOLLIN;
+      if (want & EVENT_OUT)
+	ev.events |= EPOLLOUT;
+      if (h->events & EVENT_EDGE)
+	ev.events |= EPOLLET;
+
+      if (want == 0)
+	op = EPOLL_CTL_DEL;
+      else if (h->live == 0)
+	op = EPOLL_CTL_ADD;
+
+      if (epoll_ctl(epfd, op, fd, &ev) == -1)
+	{
+	  /* fd closed and re-opened behind our back, or we got it wrong;
+	     either way, retry with the other operation. */
+	  if (op == EPOLL_CTL_MOD && errno == ENOENT)
+	    op = EPOLL_CTL_ADD;
+	  else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+	    op = EPOLL_CTL_MOD;
+
+	  if (op != EPOLL_CTL_DEL && epoll_ctl(epfd, op, fd, &ev) == -1)
+	    {
+	      /* regular files can't be polled, but never block either. */
+	      if (errno == EPERM)
+		{
+		  h->forced = 1;
+		  forced_count++;
+		}
+	      else
+		{
+		  my_syslog(LOG_ERR, _("cannot watch descriptor %d: %s"), fd, strerror(errno));
+		  want = 0;
+		}
+	    }
+	}
+    }
+#endif
+
+  h->live = want;
+}
+
+static void event_call(struct daemon *daemon, int fd, int events, time_t now)
+{
+  struct event_handler *h = &handlers[fd];
+
+  /* an earlier handler in this batch may have deleted or paused it */
+  if (h->cb && (events &= h->live | EVENT_ERR))
+    h->cb(daemon, h->arg, fd, events, now);
+}
+
+/* Wait up to timeout milliseconds (-1 for ever), and call the handlers for
+   all the descriptors which are ready. Returns the time after the wait. */
+time_t event_wait(struct daemon *daemon, int timeout)
+{
+  time_t now;
+  int fd, n;
+#ifdef HAVE_EPOLL
+  struct epoll_event ready[EVENT_BATCH];
+#else
+  fd_set rset, wset;
+  struct timeval tv, *tp = NULL;
+  int maxfd = -1;
+#endif
+#ifndef HAVE_TIMERFD
+  int delay;
+
+  /* no timerfd: wake up in time for the next timer instead */
+  if (!holding && (delay = timer_wait()) != -1 && (timeout == -1 || delay < timeout))
+    timeout = delay;
+#endif
+
+#ifdef HAVE_EPOLL
+  if (forced_count != 0)
+    timeout = 0;
+
+  if ((n = epoll_wait(epfd, ready, EVENT_BATCH, timeout)) < 0)
+    n = 0;
+
+  now = dnsmasq_time();
+
+  while (n-- > 0)
+    {
+      int events = 0;
+
+      if (ready[n].events & EPOLLIN)
+	events |= EVENT_IN;
+      if (ready[n].events & EPOLLOUT)
+	events |= EVENT_OUT;
+      if (ready[n].events & (EPOLLERR | EPOLLHUP))
+	events |= EVENT_ERR | handlers[ready[n].data.fd].live;
+
+      event_call(daemon, ready[n].data.fd, events, now);
+    }
+
+  if (forced_count != 0)
+    for (fd = 0; fd < handlers_sz; fd++)
+      if (handlers[fd].forced)
+	event_call(daemon, fd, handlers[fd].live, now);
+#else
+  FD_ZERO(&rset);
+  FD_ZERO(&wset);
+
+  for (fd = 0; fd < handlers_sz; fd++)
+    if (handlers[fd].cb && handlers[fd].live)
+      {
+	if (handlers[fd].live & EVENT_IN)
+	  FD_SET(fd, &rset);
+	if (handlers[fd].live & EVENT_OUT)
+	  FD_SET(fd, &wset);
+	bump_maxfd(fd, &maxfd);
+      }
+
+  if (timeout >= 0)
+    {
+      tv.tv_sec = timeout / 1000;
+      tv.tv_usec = (timeout % 1000) * 1000;
+      tp = &tv;
+    }
+
+  if ((n = select(maxfd+1, &rset, &wset, NULL, tp)) < 0)
+    n = 0;
+
+  now = dnsmasq_time();
+
+  for (fd = 0; n > 0 && fd <= maxfd; fd++)
+    {
+      int events = 0;
+
+      if (FD_ISSET(fd, &rset))
+	events |= EVENT_IN;
+      if (FD_ISSET(fd, &wset))
+	events |= EVENT_OUT;
+
+      if (events)
+	{
+	  n--;
+	  event_call(daemon, fd, events, now);
+	}
+    }
+#endif
+
+#ifndef HAVE_TIMERFD
+  if (!holding)
+    timer_run(daemon);
+#endif
+
+  return now;
+}
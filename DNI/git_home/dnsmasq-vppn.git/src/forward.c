@@ -12,26 +12,288 @@
 
 #include "dnsmasq.h"
 
-static struct frec *frec_list = NULL;
+#ifdef HAVE_LINUX_NETWORK
+#  include <sys/syscall.h>
+#  if defined(SYS_recvmmsg) && defined(SYS_sendmmsg)
+#    define HAVE_MMSG
+#  endif
+#endif
+
+/* Forwarding records. Those in use are on a list ordered by age, oldest
+   first, and hashed by new_id (for replies) and by source address,
+   orig_id and crc (for retries from the client). Free ones are on
+   the free list. */
+#ifdef DNI_IPV6_FEATURE
+#define DNI_DNS_QUERY_TIMEOUT 3 /* seconds before trying the other family's servers */
+#endif
+
+static struct frec *frec_oldest = NULL, *frec_newest = NULL, *frec_free = NULL;
+static struct frec **frec_id_hash = NULL, **frec_sender_hash = NULL, **frec_question_hash = NULL;
+static int frec_hash_sz = 0, frec_count = 0;
+static unsigned long frec_name_bytes = 0;
+static char frec_no_name[] = "";
+
+/* --hedge-queries: queries now out with a second server too */
+static int hedges = 0;
+static unsigned long hedges_sent = 0, hedges_won = 0;
+
+/* clients waiting on queries which others asked first */
+static struct frec_src *waiter_free = NULL;
+static int waiter_count = 0;
+static unsigned long waiters_joined = 0;
+
+/* Batched UDP I/O. Up to UDP_BATCH datagrams are read from a socket per
+   wakeup into a ring of packet buffers, and each in turn is swapped into
+   daemon->packet, so everything downstream works as before. Replies which
+   send_from() is asked to send during the batch are queued, and go out
+   together when the batch ends. Their data stays in the ring until the
+   next read. */
+
+/* same layout as the kernel's struct mmsghdr, which libc only
+   declares with _GNU_SOURCE */
+struct udp_mmsg {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+
+union udp_control {
+  struct cmsghdr align; /* this ensures alignment */
+#ifdef HAVE_IPV6
+  char control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+#endif
+#if defined(HAVE_LINUX_NETWORK)
+  char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#elif defined(IP_RECVDSTADDR)
+  char control[CMSG_SPACE(sizeof(struct in_addr)) +
+	       CMSG_SPACE(sizeof(struct sockaddr_dl))];
+#elif defined(IP_SENDSRCADDR)
+  char control[CMSG_SPACE(sizeof(struct in_addr))];
+#endif
+};
+
+struct udp_slot {
+  struct iovec iov;
+  union mysockaddr addr;
+  union udp_control control_u;
+};
+
+static struct udp_mmsg udp_in[UDP_BATCH], udp_out[UDP_BATCH];
+static struct udp_slot udp_in_slot[UDP_BATCH], udp_out_slot[UDP_BATCH];
+static char *udp_buffs[UDP_BATCH];
+static int udp_batching = 0, udp_out_count = 0, udp_out_fd = -1;
+static unsigned long udp_in_calls = 0, udp_in_pkts = 0, udp_out_calls = 0, udp_out_pkts = 0;
+#ifdef HAVE_MMSG
+static int udp_mmsg_ok = 1;
+#endif
 
 static struct frec *lookup_frec(unsigned short id, unsigned int crc);
 static struct frec *lookup_frec_by_sender(unsigned short id,
 					  union mysockaddr *addr,
 					  unsigned int crc);
+static struct frec *lookup_frec_by_question(HEADER *header, struct question *question);
+static struct frec *lookup_frec_by_waiter(HEADER *header, struct question *question,
+					  union mysockaddr *addr);
+static unsigned short query_join_bits(HEADER *header, struct question *question);
+static int frec_join(struct daemon *daemon, HEADER *header, struct question *question,
+		     union mysockaddr *addr, struct all_addr *dst_addr, unsigned int dst_iface, int fd);
+static void frec_send_waiters(struct daemon *daemon, struct frec *f, size_t n, unsigned char *qend);
 static unsigned short get_id(int force, unsigned short force_id, unsigned int crc);
+static void frec_hash(struct daemon *daemon, struct frec *f);
+#ifdef DNI_IPV6_FEATURE
+static void frec_touch(struct frec *f, time_t now);
+#endif
+static void free_frec(struct frec *f);
+static void frec_set_name(struct frec *f, char *name);
+static void frec_lost(struct frec *f);
+static void frec_reply(struct daemon *daemon, struct frec *f, union mysockaddr *addr, int rcode);
+static void frec_hedge_set(struct daemon *daemon, struct frec *f, HEADER *header, size_t plen);
+static void frec_timeout(struct daemon *daemon, void *arg, time_t now);
+int transmit_name(char *name, unsigned char **ret);
+static void reply_packet(struct serverfd *sfd, struct daemon *daemon,
+			 union mysockaddr *from, ssize_t n, time_t now);
+static void query_packet(struct listener *listen, struct daemon *daemon,
+			 struct msghdr *msg, ssize_t n, time_t now);
+
+/* Read up to UDP_BATCH datagrams from fd, returns the number read. */
+static int udp_recv_batch(struct daemon *daemon, int fd)
+{
+  int i, n = -1;
 
-#ifdef DNI_PARENTAL_CTL
-static int trans_macaddr(char * mac, char *mac_p);
-static int get_macaddr_by_ip(char *mac, char *ip);
-static void get_deviceid_by_macaddr(char *macaddr, char *deviceid);
-static void parse_parentalcontrol(HEADER *header, int *n, union mysockaddr ipaddr);
-static int trans_deviceid(char *deviceid, char *deviceid_b);
+  for (i = 0; i < UDP_BATCH; i++)
+    {
+      struct msghdr *msg = &udp_in[i].msg_hdr;
+      
+      if (!udp_buffs[i])
+	udp_buffs[i] = safe_malloc(daemon->packet_buff_sz);
+
+      udp_in_slot[i].iov.iov_base = udp_buffs[i];
+      udp_in_slot[i].iov.iov_len = daemon->edns_pktsz;
+      msg->msg_name = &udp_in_slot[i].addr;
+      msg->msg_namelen = sizeof(union mysockaddr);
+      msg->msg_iov = &udp_in_slot[i].iov;
+      msg->msg_iovlen = 1;
+      msg->msg_control = &udp_in_slot[i].control_u;
+      msg->msg_controllen = sizeof(union udp_control);
+      msg->msg_flags = 0;
+    }
+
+#ifdef HAVE_MMSG
+  if (udp_mmsg_ok)
+    {
+      while ((n = syscall(SYS_recvmmsg, fd, udp_in, UDP_BATCH, MSG_DONTWAIT, NULL)) == -1 && 
+	     errno == EINTR);
+      
+      /* kernel too old, do it the slow way from now on */
+      if (n == -1 && errno == ENOSYS)
+	udp_mmsg_ok = 0;
+    }
+
+  if (!udp_mmsg_ok)
+#endif
+    for (n = 0; n < UDP_BATCH; n++)
+      {
+	ssize_t len;
+	
+	while ((len = recvmsg(fd, &udp_in[n].msg_hdr, MSG_DONTWAIT)) == -1 && errno == EINTR);
+	
+	if (len == -1)
+	  break;
+	
+	udp_in[n].msg_len = len;
+      }
+  
+  if (n <= 0)
+    return 0;
+
+  udp_in_calls++;
+  udp_in_pkts += n;
+  udp_batching = 1;
 
-#define PC_HTONS_CHARS(n) (unsigned char)((n) >> 8), (unsigned char)(n)
+  return n;
+}
+
+/* Make datagram i of the batch the current packet. */
+static void udp_swap_packet(struct daemon *daemon, int i)
+{
+  char *tmp = daemon->packet;
+  daemon->packet = udp_buffs[i];
+  udp_buffs[i] = tmp;
+
+  /* packet buffer overwritten */
+  daemon->srv_save = NULL;
+}
+
+static void send_msg(int fd, struct msghdr *msg)
+{
+ retry:
+  if (sendmsg(fd, msg, 0) == -1)
+    {
+      /* certain Linux kernels seem to object to setting the source address in the IPv6 stack
+	 by returning EINVAL from sendmsg. In that case, try again without setting the
+	 source address, since it will nearly alway be correct anyway.  IPv6 stinks. */
+      if (errno == EINVAL && msg->msg_controllen)
+	{
+	  msg->msg_controllen = 0;
+	  goto retry;
+	}
+      if (retry_send())
+	goto retry;
+    }
+}
+
+static void udp_flush(void)
+{
+  int i, sent;
+
+  for (i = 0; i < udp_out_count; i += sent)
+    {
+      sent = -1;
+#ifdef HAVE_MMSG
+      if (udp_mmsg_ok)
+	{
+	  sent = syscall(SYS_sendmmsg, udp_out_fd, &udp_out[i], udp_out_count - i, 0);
+	  if (sent == -1 && errno == ENOSYS)
+	    udp_mmsg_ok = 0;
+	}
 #endif
+      /* send the one which failed the slow way, which knows about retries */
+      if (sent <= 0)
+	{
+	  send_msg(udp_out_fd, &udp_out[i].msg_hdr);
+	  sent = 1;
+	}
+    }
+
+  if (udp_out_count != 0)
+    {
+      udp_out_calls++;
+      udp_out_pkts += udp_out_count;
+    }
+
+  udp_out_count = 0;
+}
+
+static void udp_end_batch(void)
+{
+  udp_flush();
+  udp_batching = 0;
+}
+
+static void udp_queue(int fd, struct msghdr *msg)
+{
+  struct udp_slot *slot;
+  struct msghdr *out;
+
+  if (udp_out_count != 0 && (fd != udp_out_fd || udp_out_count == UDP_BATCH))
+    udp_flush();
+
+  slot = &udp_out_slot[udp_out_count];
+  out = &udp_out[udp_out_count++].msg_hdr;
+  udp_out_fd = fd;
+
+  *out = *msg;
+  slot->iov = msg->msg_iov[0];
+  out->msg_iov = &slot->iov;
+  memcpy(&slot->addr, msg->msg_name, msg->msg_namelen);
+  out->msg_name = &slot->addr;
+  if (msg->msg_controllen != 0)
+    {
+      memcpy(&slot->control_u, msg->msg_control, msg->msg_controllen);
+      out->msg_control = &slot->control_u;
+    }
+}
+
+void dump_forward_stats(struct daemon *daemon)
+{
+  struct server *serv;
+  unsigned long in = udp_in_calls ? (udp_in_pkts * 100) / udp_in_calls : 0;
+  unsigned long out = udp_out_calls ? (udp_out_pkts * 100) / udp_out_calls : 0;
+
+  my_syslog(LOG_INFO, _("UDP: %lu datagrams read in %lu batches (average %lu.%02lu), %lu sent in %lu batches (average %lu.%02lu)"),
+	    udp_in_pkts, udp_in_calls, in / 100, in % 100,
+	    udp_out_pkts, udp_out_calls, out / 100, out % 100);
+
+  /* names used to be held inline, in MAXDNAME bytes */
+  my_syslog(LOG_INFO, _("forwarding table: %d records, %u bytes each plus %lu bytes of names in all, (%u bytes each with names inline)"),
+	    frec_count, (unsigned int)sizeof(struct frec), frec_name_bytes, 
+	    (unsigned int)(sizeof(struct frec) - sizeof(char *) - sizeof(unsigned short) + MAXDNAME));
 
-extern int extract_name(HEADER *header, size_t plen, unsigned char **pp,
-                       char *name, int isExtract);
+  my_syslog(LOG_INFO, _("%lu queries waited for the answer to the same one asked before"), waiters_joined);
+  prefetch_stats();
+
+  if (daemon->hedge_max != 0)
+    my_syslog(LOG_INFO, _("hedging: %lu queries sent to a second server, which answered %lu first"),
+	      hedges_sent, hedges_won);
+
+  for (serv = daemon->servers; serv; serv = serv->next)
+    if (!(serv->flags & (SERV_LITERAL_ADDRESS | SERV_NO_ADDR)))
+      {
+	int port = prettyprint_addr(&serv->addr, daemon->namebuff);
+	my_syslog(LOG_INFO, _("server %s#%d: %u queries sent, %u answered, %u lost, RTT %dms (variation %dms)"),
+		  daemon->namebuff, port, serv->stats.queries, serv->stats.replies, serv->stats.lost,
+		  serv->stats.srtt, serv->stats.rttvar);
+      }
+}
 
 /* Send a UDP packet with it's source address set as "source" 
    unless nowild is true, when we just send it with the kernel default */
@@ -41,17 +303,7 @@ static void send_from(int fd, int nowild, char *packet, size_t len,
 {
   struct msghdr msg;
   struct iovec iov[1]; 
-  union {
-    struct cmsghdr align; /* this ensures alignment */
-#if defined(HAVE_LINUX_NETWORK)
-    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#elif defined(IP_SENDSRCADDR)
-    char control[CMSG_SPACE(sizeof(struct in_addr))];
-#endif
-#ifdef HAVE_IPV6
-    char control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-#endif
-  } control_u;
+  union udp_control control_u;
   
   iov[0].iov_base = packet;
   iov[0].iov_len = len;
@@ -103,91 +355,100 @@ static void send_from(int fd, int nowild, char *packet, size_t len,
 #endif
     }
   
- retry:
-  if (sendmsg(fd, &msg, 0) == -1)
+  if (udp_batching)
+    udp_queue(fd, &msg);
+  else
+    send_msg(fd, &msg);
+}
+          
+/* Does serv answer for the name, and how: the last of the longest matches wins. */
+static void server_match(struct server *serv, struct question *question, int nodots,
+			 unsigned int *matchlen, unsigned short *flags,
+			 struct all_addr **addrpp, int *type, char **domain)
+{
+  unsigned short qtype = question->flags;
+  unsigned int namelen = question->namelen;
+
+  /* domain matches take priority over NODOTS matches */
+  if ((serv->flags & SERV_FOR_NODOTS) && *type != SERV_HAS_DOMAIN && nodots && namelen != 0)
     {
-      /* certain Linux kernels seem to object to setting the source address in the IPv6 stack
-	 by returning EINVAL from sendmsg. In that case, try again without setting the
-	 source address, since it will nearly alway be correct anyway.  IPv6 stinks. */
-      if (errno == EINVAL && msg.msg_controllen)
+      unsigned short sflag = serv->addr.sa.sa_family == AF_INET ? F_IPV4 : F_IPV6; 
+      *type = SERV_FOR_NODOTS;
+      if (serv->flags & SERV_NO_ADDR)
+	*flags = F_NXDOMAIN;
+      else if (serv->flags & SERV_LITERAL_ADDRESS) 
+	{ 
+	  if (sflag & qtype)
+	    {
+	      *flags = sflag;
+	      if (serv->addr.sa.sa_family == AF_INET) 
+		*addrpp = (struct all_addr *)&serv->addr.in.sin_addr;
+#ifdef HAVE_IPV6
+	      else
+		*addrpp = (struct all_addr *)&serv->addr.in6.sin6_addr;
+#endif 
+	    }
+	  else if (!*flags)
+	    *flags = F_NOERR;
+	} 
+    }
+  else if (serv->flags & SERV_HAS_DOMAIN)
+    {
+      unsigned int domainlen = strlen(serv->domain);
+      char *matchstart = question->name + namelen - domainlen;
+      if (namelen >= domainlen &&
+	  hostname_isequal(matchstart, serv->domain) &&
+	  domainlen >= *matchlen &&
+	  (domainlen == 0 || namelen == domainlen || *(serv->domain) == '.' || *(matchstart-1) == '.' ))
 	{
-	  msg.msg_controllen = 0;
-	  goto retry;
-	}
-      if (retry_send())
-	goto retry;
+	  unsigned short sflag = serv->addr.sa.sa_family == AF_INET ? F_IPV4 : F_IPV6;
+	  *type = SERV_HAS_DOMAIN;
+	  *domain = serv->domain;
+	  *matchlen = domainlen;
+	  if (serv->flags & SERV_NO_ADDR)
+	    *flags = F_NXDOMAIN;
+	  else if (serv->flags & SERV_LITERAL_ADDRESS)
+	    {
+	      if ((sflag | F_QUERY ) & qtype)
+		{
+		  *flags = qtype & ~F_BIGNAME;
+		  if (serv->addr.sa.sa_family == AF_INET) 
+		    *addrpp = (struct all_addr *)&serv->addr.in.sin_addr;
+#ifdef HAVE_IPV6
+		  else
+		    *addrpp = (struct all_addr *)&serv->addr.in6.sin6_addr;
+#endif
+		}
+	      else if (!*flags)
+		*flags = F_NOERR;
+	    }
+	} 
     }
 }
-          
+
 static unsigned short search_servers(struct daemon *daemon, time_t now, struct all_addr **addrpp, 
-				     unsigned short qtype, char *qdomain, int *type, char **domain)
+				     struct question *question, int *type, char **domain)
 			      
 {
   /* If the query ends in the domain in one of our servers, set
      domain to point to that name. We find the largest match to allow both
      domain.org and sub.domain.org to exist. */
   
-  unsigned int namelen = strlen(qdomain);
+  unsigned short qtype = question->flags;
+  char *qdomain = question->name;
+  unsigned int namelen = question->namelen;
+  int nodots = question->labels < 2;
   unsigned int matchlen = 0;
-  struct server *serv;
+  struct server *serv, **match;
   unsigned short flags = 0;
   
-  for (serv = daemon->servers; serv; serv=serv->next)
-    /* domain matches take priority over NODOTS matches */
-    if ((serv->flags & SERV_FOR_NODOTS) && *type != SERV_HAS_DOMAIN && !strchr(qdomain, '.') && namelen != 0)
-      {
-	unsigned short sflag = serv->addr.sa.sa_family == AF_INET ? F_IPV4 : F_IPV6; 
-	*type = SERV_FOR_NODOTS;
-	if (serv->flags & SERV_NO_ADDR)
-	  flags = F_NXDOMAIN;
-	else if (serv->flags & SERV_LITERAL_ADDRESS) 
-	  { 
-	    if (sflag & qtype)
-	      {
-		flags = sflag;
-		if (serv->addr.sa.sa_family == AF_INET) 
-		  *addrpp = (struct all_addr *)&serv->addr.in.sin_addr;
-#ifdef HAVE_IPV6
-		else
-		  *addrpp = (struct all_addr *)&serv->addr.in6.sin6_addr;
-#endif 
-	      }
-	    else if (!flags)
-	      flags = F_NOERR;
-	  } 
-      }
-    else if (serv->flags & SERV_HAS_DOMAIN)
-      {
-	unsigned int domainlen = strlen(serv->domain);
-	char *matchstart = qdomain + namelen - domainlen;
-	if (namelen >= domainlen &&
-	    hostname_isequal(matchstart, serv->domain) &&
-	    domainlen >= matchlen &&
-	    (domainlen == 0 || namelen == domainlen || *(serv->domain) == '.' || *(matchstart-1) == '.' ))
-	  {
-	    unsigned short sflag = serv->addr.sa.sa_family == AF_INET ? F_IPV4 : F_IPV6;
-	    *type = SERV_HAS_DOMAIN;
-	    *domain = serv->domain;
-	    matchlen = domainlen;
-	    if (serv->flags & SERV_NO_ADDR)
-	      flags = F_NXDOMAIN;
-	    else if (serv->flags & SERV_LITERAL_ADDRESS)
-	      {
-		if ((sflag | F_QUERY ) & qtype)
-		  {
-		    flags = qtype & ~F_BIGNAME;
-		    if (serv->addr.sa.sa_family == AF_INET) 
-		      *addrpp = (struct all_addr *)&serv->addr.in.sin_addr;
-#ifdef HAVE_IPV6
-		    else
-		      *addrpp = (struct all_addr *)&serv->addr.in6.sin6_addr;
-#endif
-		  }
-		else if (!flags)
-		  flags = F_NOERR;
-	      }
-	  } 
-      }
+  /* only the servers which can match, from the trie, if there is one */
+  if ((match = domain_servers(question, nodots)))
+    for (; *match; match++)
+      server_match(*match, question, nodots, &matchlen, &flags, addrpp, type, domain);
+  else
+    for (serv = daemon->servers; serv; serv=serv->next)
+      server_match(serv, question, nodots, &matchlen, &flags, addrpp, type, domain);
 
   if (flags & ~(F_NOERR | F_NXDOMAIN)) /* flags set here means a literal found */
     {
@@ -197,7 +458,7 @@ static unsigned short search_servers(struct daemon *daemon, time_t now, struct a
 	log_query(F_CONFIG | F_FORWARD | flags, qdomain, *addrpp, 0, NULL, 0);
     }
   else if (qtype && !(qtype & F_BIGNAME) && 
-	   (daemon->options & OPT_NODOTS_LOCAL) && !strchr(qdomain, '.') && namelen != 0)
+	   (daemon->options & OPT_NODOTS_LOCAL) && nodots && namelen != 0)
     /* don't forward simple names, make exception from NS queries and empty name. */
     flags = F_NXDOMAIN;
     
@@ -240,100 +501,101 @@ static int if_exist(char* ifname)
 }
 #endif
 
-//ifdef SUP_MUL_PPPOE
-int mulpppoe_skip_dns(struct in_addr srv, char *name)
+/* Is serv one to forward to, for servers of type (and domain)? */
+static int server_for(struct server *serv, int type, char *domain)
 {
-	FILE *fdns, *fdomain, *fp; 
-	char buf[32] = {0}, buffer[512] = {0}, *p;
-	int ppp1_dns = 0, ppp1_domain = 0, skip = 0, ppp0_dns = 0;
-	if((fp = fopen("/etc/ppp/enable_ppp1", "r")) == NULL )
-	{
-		my_syslog(LOG_INFO, "ppp1 not enable, return");
-		return 0;
-	}
-	fclose(fp);
-	if((fdns = fopen("/etc/ppp/pppoe2-dns.conf", "r")) == NULL)
-	{
-		my_syslog(LOG_INFO, "Can't open dns config file of ppp1");
-		ppp1_dns = -1;
-	} else {
-		while(fgets(buf, 32, fdns)) {
-			my_syslog(LOG_INFO, "get ppp1 dns:%s", buf);
-			if(inet_addr(buf) == srv.s_addr) {
-				ppp1_dns = 1;
-				break;
-			}
-		}
-		fclose(fdns);
-	}
+  return type == (serv->flags & SERV_TYPE) &&
+    (type != SERV_HAS_DOMAIN || hostname_isequal(domain, serv->domain)) &&
+    !(serv->flags & SERV_LITERAL_ADDRESS);
+}
 
-	if((fdns = fopen("/etc/ppp/pppoe1-dns.conf", "r")) == NULL)
-        {
-                my_syslog(LOG_INFO, "Can't open dns config file of ppp0");
-                ppp0_dns = -1;
-        } else {
-		memset(buf, 0, sizeof(buf));
-                while(fgets(buf, 32, fdns)) {
-                        my_syslog(LOG_INFO, "get ppp0 dns:%s", buf);
-                        if(inet_addr(buf) == srv.s_addr) {
-                                ppp0_dns = 1;
-                                break;
-                        }
-                }
-                fclose(fdns);
-        }
+/* A reply from serv took rtt ms: smooth it in as TCP does (RFC 2988). 
+   srtt is never zero after the first. */
+static void server_rtt(struct server *serv, int rtt)
+{
+  if (serv->stats.srtt == 0)
+    {
+      serv->stats.srtt = rtt;
+      serv->stats.rttvar = rtt / 2;
+    }
+  else
+    {
+      int delta = rtt - serv->stats.srtt;
 
-	if((fdomain = fopen("/etc/ppp/pppoe2-domain.conf", "r")) == NULL)
-        {
-                my_syslog(LOG_INFO, "Can't open domain file of ppp1");
-		ppp1_domain = -1;
-        } else {
-		while(fgets(buffer, 512, fdomain)) {
-                	/* Remove \n */
-	                buffer[strlen(buffer) - 1] = '\0';
-			if(buffer[0] != '*') {
-	        	        if(strstr(name, buffer)) {
-        	        	    	 ppp1_domain = 1;
-				}
-	                } else {
-				if(strstr(name, buffer + 1)){
-					p = strstr(name, buffer + 1) + strlen(buffer + 1);
-					if(p[0] == '\0'){
-						ppp1_domain = 1;
-					}
-				}
-			}
-        	}
-	        fclose(fdomain);
-	}
+      serv->stats.rttvar += ((delta < 0 ? -delta : delta) - serv->stats.rttvar) / 4;
+      serv->stats.srtt += delta / 8;
+    }
 
-	/* Fix Bug 38166 - [SQA-3006][Multi-PPPoE]Users cannot access Internet website
-	 * after multi-PPPoE sessions connected and when session1 and session2 get the
-	 * same DNS server.
-	 */
-	if(ppp0_dns == 1 && ppp1_dns == 1)
-		return 0;
-	/* visit policy domain */
-	if(ppp1_domain == 1) {
-		/* ppp0 dns or has not ppp1 dns */
-		if(ppp1_dns != 1) {
-			my_syslog(LOG_INFO, "return 1");
-			return 1;
-		}
-	/* visit internet or has not ppp1 policy domain */
-	} else {
-		/* ppp1 dns */
-		if(ppp1_dns == 1)
-			return 1;
-	}
-	return 0;
+  if (serv->stats.srtt <= 0)
+    serv->stats.srtt = 1;
 }
-//endif
 
-static struct server* get_first_server(struct daemon *daemon, unsigned short gotname, int type)
+/* How long to expect serv to take, to choose between servers. Those which
+   have not answered yet come first, to be measured, and those which keep
+   losing queries last. */
+static int server_cost(struct server *serv)
 {
-  struct server *serv;
+  int cost = serv->stats.srtt + 4 * serv->stats.rttvar;
+
+  if (serv->stats.misses >= SERVER_MISSES)
+    cost += 1 << 24;
+  
+  return cost;
+}
+
+/* Unless servers are to be tried in order, start with the quickest of
+   those for the query, preferring those of its address family. Every
+   SERVER_EXPLORE queries one of the others goes first instead, so that
+   they are still timed. */
+static struct server* get_first_server(struct daemon *daemon, unsigned short gotname, int type, char *domain)
+{
+  static unsigned int turn = 0;
+  struct server *serv, *best = NULL, *best_family = NULL;
+  int family = 0, count = 0, count_family = 0;
   
+  if (gotname == F_IPV4)
+    family = AF_INET;
+#ifdef HAVE_IPV6
+  else if (gotname == F_IPV6)
+    family = AF_INET6;
+#endif
+
+  if (!(daemon->options & OPT_ORDER))
+    {
+      for (serv = daemon->servers; serv; serv = serv->next)
+	if (server_for(serv, type, domain))
+	  {
+	    count++;
+	    if (!best || server_cost(serv) < server_cost(best))
+	      best = serv;
+	    if (family != 0 && serv->addr.sa.sa_family == family)
+	      {
+		count_family++;
+		if (!best_family || server_cost(serv) < server_cost(best_family))
+		  best_family = serv;
+	      }
+	  }
+
+      if (best_family)
+	best = best_family, count = count_family;
+      else
+	family = 0;
+
+      if (best && count > 1 && ++turn % SERVER_EXPLORE == 0)
+	{
+	  int pick = (turn / SERVER_EXPLORE) % (count - 1);
+	  
+	  for (serv = daemon->servers; serv; serv = serv->next)
+	    if (serv != best && server_for(serv, type, domain) &&
+		(family == 0 || serv->addr.sa.sa_family == family) &&
+		pick-- == 0)
+	      return serv;
+	}
+
+      if (best)
+	return best;
+    }
+
   for (serv = daemon->servers; serv; serv = serv->next) {
     if (gotname == F_IPV4 && serv->addr.sa.sa_family == AF_INET)
       break;
@@ -349,34 +611,108 @@ static struct server* get_first_server(struct daemon *daemon, unsigned short got
     return daemon->last_server;
 }
 
+/* Send a query to serv, keeping the server sockets bound to the WAN
+   interface as it comes and goes. Returns -1 on failure, with errno
+   from sendto(). */
+static int server_send(struct server *serv, HEADER *header, size_t plen)
+{
+#ifdef BIND_SRVSOCK_TO_WAN
+  struct ifreq ifr;
+  int errsendto;
+
+  /* To fix bug 22747, bind server socket to WAN interface if hasn't been bind successfully */
+  if (bind_wan_success == 0 && if_exist(wan_ifname) == 1)
+    {
+      memset(&ifr, 0, sizeof(ifr));
+      strcpy(ifr.ifr_name, wan_ifname);
+      if(setsockopt(serv->sfd->fd, SOL_SOCKET, SO_BINDTODEVICE, (char *)&ifr, sizeof(ifr)) == 0)
+	{
+	  my_syslog(LOG_INFO, _("Bind server socket to interface %s successfully"), wan_ifname);
+	  bind_wan_success = 1;
+	}
+      else
+	my_syslog(LOG_INFO, _("Bind server socket to interface %s failed, reason: %m"), wan_ifname);
+    }
+#endif
+
+  if (sendto(serv->sfd->fd, (char *)header, plen, 0, &serv->addr.sa, sa_len(&serv->addr)) != -1)
+    return 0;
+
+#ifdef BIND_SRVSOCK_TO_WAN
+  errsendto = errno;
+  if (if_exist(wan_ifname) == 1)
+    my_syslog(LOG_INFO, "Fail to forward qurey to upstream server: %s", strerror(errsendto));
+  /* 
+   * To fix bug 22747, sendto() will fail with ENODEV if WAN interface disappear for some reason,
+   * and will still fail with ENODEV even though WAN interface appear (because index of virtual interface
+   * such as ppp0 in kernel will be changed after virtual interface disappear/appear)
+   * so, when this issue happen, we must re-bind again if WAN interface still exist,
+   * and cancel bind if WAN interface does not exist.
+   */
+  if (errsendto == ENODEV && bind_wan_success == 1)
+    {
+      if (if_exist(wan_ifname) == 1)
+	{
+	  /* re-bind again */
+	  memset(&ifr, 0, sizeof(ifr));
+	  strcpy(ifr.ifr_name, wan_ifname);
+	  if (setsockopt(serv->sfd->fd, SOL_SOCKET, SO_BINDTODEVICE, (char *)&ifr, sizeof(ifr)) == 0)
+	    {
+	      my_syslog(LOG_INFO, _("Re-bind server socket to interface %s successfully"), wan_ifname);
+	    }
+	  else
+	    {
+	      my_syslog(LOG_INFO, _("Re-bind server socket to interface %s failed, reason: %m"), wan_ifname);
+	    }
+	}
+      else
+	{
+	  /* cancel bind */
+	  memset(&ifr, 0, sizeof(ifr));
+	  strcpy(ifr.ifr_name, "");
+	  if (setsockopt(serv->sfd->fd, SOL_SOCKET, SO_BINDTODEVICE, (char *)&ifr, sizeof(ifr)) == 0)
+	    {
+	      my_syslog(LOG_INFO, _("Cancel bind server socket to interface %s successfully"), wan_ifname);
+	      bind_wan_success = 0;
+	    }
+	}
+    }
+  errno = errsendto;
+#endif
+
+  return -1;
+}
+
 /* returns new last_server */	
 static void forward_query(struct daemon *daemon, int udpfd, union mysockaddr *udpaddr,
 			  struct all_addr *dst_addr, unsigned int dst_iface,
-			  HEADER *header, size_t plen, time_t now, struct frec *forward)
+			  HEADER *header, size_t plen, struct question *question,
+			  time_t now, struct frec *forward)
 {
   char *domain = NULL;
-  int type = 0;
+  int type = 0, again = 0;
   struct all_addr *addrp = NULL;
-  unsigned int crc = questions_crc(header, plen, daemon->namebuff);
+  unsigned int crc = question->crc;
   unsigned short flags = 0;
-  unsigned short gotname = extract_request(header, plen, daemon->namebuff, NULL);
+  unsigned short gotname = question->flags;
   struct server *start = NULL;
-#ifdef BIND_SRVSOCK_TO_WAN
-  struct ifreq ifr;
-#endif
     
   /* may be no servers available. */
   if (!daemon->servers)
     forward = NULL;
-  else if (forward || (forward = lookup_frec_by_sender(ntohs(header->id), udpaddr, crc)))
+  else if (forward || (forward = lookup_frec_by_sender(ntohs(header->id), udpaddr, crc)) ||
+	   (gotname && (forward = lookup_frec_by_waiter(header, question, udpaddr))))
     {
       /* retry on existing query, send to all available servers  */
+      frec_lost(forward);
+      timer_del(&forward->hedge);
+      again = 1;
       domain = forward->sentto->domain;
       if (!(daemon->options & OPT_ORDER))
 	{
 	  forward->forwardall = 1;
 #ifdef DNI_IPV6_FEATURE
-	  forward->time = now;
+	  frec_touch(forward, now);
           if (2 == forward->fwd_sign)
 	    forward->fwd_sign = 0;
 #endif
@@ -390,49 +726,44 @@ static void forward_query(struct daemon *daemon, int udpfd, union mysockaddr *ud
   else 
     {
       if (gotname)
-	flags = search_servers(daemon, now, &addrp, gotname, daemon->namebuff, &type, &domain);
+	flags = search_servers(daemon, now, &addrp, question, &type, &domain);
       
+      /* the same question is out already: wait for its answer */
+      if (!flags && gotname && udpfd != -1 &&
+	  frec_join(daemon, header, question, udpaddr, dst_addr, dst_iface, udpfd))
+	return;
+
       if (!flags && !(forward = get_new_frec(daemon, now, NULL)))
 	/* table full - server failure. */
 	flags = F_NEG;
       
       if (forward)
 	{
-	  /* force unchanging id for signed packets */
-	  int is_sign;
-	  find_pseudoheader(header, plen, NULL, NULL, &is_sign);
-	  
 	  forward->source = *udpaddr;
 	  forward->dest = *dst_addr;
 	  forward->iface = dst_iface;
 	  forward->orig_id = ntohs(header->id);
-	  forward->new_id = get_id(is_sign, forward->orig_id, crc);
+	  /* force unchanging id for signed packets */
+	  forward->new_id = get_id(question->is_sign, forward->orig_id, crc);
 	  forward->fd = udpfd;
 	  forward->crc = crc;
 	  forward->forwardall = 0;
+	  forward->timing = FREC_IDLE;
+	  frec_set_name(forward, gotname ? question->name : "");
+	  forward->type = question->qtype;
+	  forward->class = question->qclass;
+	  forward->join = (gotname && !question->is_sign) ? query_join_bits(header, question) : 0;
+	  forward->waiters = NULL;
 #ifdef DNI_IPV6_FEATURE
-	  unsigned char *p = (unsigned char *)(header+1);
 	  if (F_IPV4 == gotname || F_IPV6 == gotname)
-	    {
-	      memcpy(&forward->flags, (unsigned char *)header + 2, sizeof(forward->flags));
-	      memset(forward->name, 0x00, sizeof(forward->name));
-	      extract_name(header, plen, &p, forward->name, 1);
-	      GETSHORT(forward->type, p);
-	      GETSHORT(forward->class, p);
-	    }
+	    memcpy(&forward->flags, (unsigned char *)header + 2, sizeof(forward->flags));
 	  forward->fwd_sign = 0;
-#else
-	  unsigned char *p = (unsigned char *)(header+1);
-	  if (F_IPV4 == gotname || F_IPV6 == gotname)
-	    {
-	      memset(forward->name, 0x00, sizeof(forward->name));
-	      extract_name(header, plen, &p, forward->name, 1);
-	    }
 #endif
+	  frec_hash(daemon, forward);
 	  header->id = htons(forward->new_id);
 
 #if 1
-	  start = get_first_server(daemon, gotname, type);
+	  start = get_first_server(daemon, gotname, type, domain);
 #else		  
 	  /* In strict_order mode, or when using domain specific servers
 	     always try servers in the order specified in resolv.conf,
@@ -460,7 +791,7 @@ static void forward_query(struct daemon *daemon, int udpfd, union mysockaddr *ud
 
 #ifdef SUP_STATIC_PPTP
       if (1 == daemon->static_pptp_enable) {
-        add_static_pptp_record(daemon, daemon->namebuff, header, plen);
+        add_static_pptp_record(daemon, question->name, header, plen);
       }
 #endif
 
@@ -470,9 +801,7 @@ static void forward_query(struct daemon *daemon, int udpfd, union mysockaddr *ud
 	     domain may be NULL, in which case server->domain 
 	     must be NULL also. */
 	  
-	  if (type == (start->flags & SERV_TYPE) &&
-	      (type != SERV_HAS_DOMAIN || hostname_isequal(domain, start->domain)) &&
-	      !(start->flags & SERV_LITERAL_ADDRESS))
+	  if (server_for(start, type, domain))
 	    {
 #ifdef DNI_IPV6_FEATURE
 	      if (!daemon->diff_svr || !(F_IPV6 == gotname || F_IPV4 == gotname))
@@ -492,23 +821,7 @@ static void forward_query(struct daemon *daemon, int udpfd, union mysockaddr *ud
 		    goto again;
 	        }
 #endif
-#ifdef BIND_SRVSOCK_TO_WAN
-	      /* To fix bug 22747, bind server socket to WAN interface if hasn't been bind successfully */
-	      if (bind_wan_success == 0 && if_exist(wan_ifname) == 1)
-		{
-		  memset(&ifr, 0, sizeof(ifr));
-		  strcpy(ifr.ifr_name, wan_ifname);
-		  if(setsockopt(start->sfd->fd, SOL_SOCKET, SO_BINDTODEVICE, (char *)&ifr, sizeof(ifr)) == 0)
-		    {
-		      my_syslog(LOG_INFO, _("Bind server socket to interface %s successfully"), wan_ifname);
-		      bind_wan_success = 1;
-		    }
-		  else
-		    my_syslog(LOG_INFO, _("Bind server socket to interface %s failed, reason: %m"), wan_ifname);
-		}
-#endif
 //ifdef SUP_MUL_PPPOE
-             my_syslog(LOG_INFO, "#####query domain is:%s\n", forward->name);
              /* Check if not match interface, if yes, skip, bellow for example
               * www.baidu.com dns but server is on ppp1, skip
               * www.flets.com dns but server is on ppp0, skip
@@ -521,50 +834,8 @@ static void forward_query(struct daemon *daemon, int udpfd, union mysockaddr *ud
                   continue;
                 }
 //endif
-	      if (sendto(start->sfd->fd, (char *)header, plen, 0,
-			 &start->addr.sa,
-			 sa_len(&start->addr)) == -1)
+	      if (server_send(start, header, plen) == -1)
 		{
-#ifdef BIND_SRVSOCK_TO_WAN
-		  int errsendto = errno;
-		  if (if_exist(wan_ifname) == 1)
-		      my_syslog(LOG_INFO, "Fail to forward qurey to upstream server: %s", strerror(errsendto));
-		  /* 
-		   * To fix bug 22747, sendto() will fail with ENODEV if WAN interface disappear for some reason,
-		   * and will still fail with ENODEV even though WAN interface appear (because index of virtual interface
-		   * such as ppp0 in kernel will be changed after virtual interface disappear/appear)
-		   * so, when this issue happen, we must re-bind again if WAN interface still exist,
-		   * and cancel bind if WAN interface does not exist.
-		   */
-		  if (errsendto == ENODEV && bind_wan_success == 1)
-		    {
-		      if (if_exist(wan_ifname) == 1)
-			{
-			  /* re-bind again */
-			  memset(&ifr, 0, sizeof(ifr));
-			  strcpy(ifr.ifr_name, wan_ifname);
-			  if (setsockopt(start->sfd->fd, SOL_SOCKET, SO_BINDTODEVICE, (char *)&ifr, sizeof(ifr)) == 0)
-			    {
-			      my_syslog(LOG_INFO, _("Re-bind server socket to interface %s successfully"), wan_ifname);
-			    }
-			  else
-			    {
-			      my_syslog(LOG_INFO, _("Re-bind server socket to interface %s failed, reason: %m"), wan_ifname);
-			    }
-			}
-		      else
-			{
-			  /* cancel bind */
-			  memset(&ifr, 0, sizeof(ifr));
-			  strcpy(ifr.ifr_name, "");
-			  if (setsockopt(start->sfd->fd, SOL_SOCKET, SO_BINDTODEVICE, (char *)&ifr, sizeof(ifr)) == 0)
-			    {
-			      my_syslog(LOG_INFO, _("Cancel bind server socket to interface %s successfully"), wan_ifname);
-			      bind_wan_success = 0;
-			    }
-			}
-		    }
-#endif
 		  if (retry_send())
 		    continue;
 		}
@@ -574,20 +845,21 @@ static void forward_query(struct daemon *daemon, int udpfd, union mysockaddr *ud
 		  daemon->srv_save = start;
 		  daemon->packet_len = plen;
 		  
-		  if (!gotname)
-		    strcpy(daemon->namebuff, "query");
 		  if (start->addr.sa.sa_family == AF_INET)
-		    log_query(F_SERVER | F_IPV4 | F_FORWARD, daemon->namebuff, 
+		    log_query(F_SERVER | F_IPV4 | F_FORWARD, gotname ? question->name : "query", 
 			      (struct all_addr *)&start->addr.in.sin_addr, 0,
 			      NULL, 0); 
 #ifdef HAVE_IPV6
 		  else
-		    log_query(F_SERVER | F_IPV6 | F_FORWARD, daemon->namebuff, 
+		    log_query(F_SERVER | F_IPV6 | F_FORWARD, gotname ? question->name : "query", 
 			      (struct all_addr *)&start->addr.in6.sin6_addr, 0,
 			      NULL, 0);
 #endif 
 		  forwarded = 1;
 		  forward->sentto = start;
+		  forward->sent = timer_now();
+		  forward->timing = again ? FREC_AGAIN : FREC_ONCE;
+		  start->stats.queries++;
 		  if (!forward->forwardall) 
 		    break;
 		  forward->forwardall++;
@@ -604,6 +876,9 @@ again:
 	    break;
 	}
       
+      if (forwarded && !again && !forward->forwardall && daemon->hedge_max != 0)
+	frec_hedge_set(daemon, forward, header, plen);
+
 #ifdef DNI_IPV6_FEATURE
       if (!daemon->diff_svr || !(F_IPV6 == gotname || F_IPV4 == gotname))
         forward->fwd_sign = 2;
@@ -611,10 +886,15 @@ again:
         forward->fwd_sign++;
       if (forwarded)
         {
+	  /* no answer from the first group in time: try the other */
+	  if (1 == forward->fwd_sign)
+	    timer_add(&forward->timer, DNI_DNS_QUERY_TIMEOUT * 1000, frec_timeout, forward);
           return;
         }
       else if (1 == forward->fwd_sign)
         {
+	  if (!forward->sentto)
+	    free_frec(forward);
 	  return;
         }
 #else
@@ -624,7 +904,7 @@ again:
       
       /* could not send on, prepare to return */ 
       header->id = htons(forward->orig_id);
-      forward->sentto = NULL; /* cancel */
+      free_frec(forward); /* cancel */
     }	  
   
   /* could not send on, return empty answer or address if known for whole domain */
@@ -637,18 +917,50 @@ again:
   return;
 }
 
+/* Ask the question again to refresh the cache, with nobody to send the
+   answer to, see prefetch.c. */
+void forward_refresh(struct daemon *daemon, char *name, unsigned short qtype, time_t now)
+{
+  HEADER *header = (HEADER *)daemon->packet;
+  unsigned char *p = (unsigned char *)(header + 1);
+  union mysockaddr nobody;
+  struct all_addr nowhere;
+  struct question question;
+
+  memset(header, 0, sizeof(HEADER));
+  header->id = htons(rand16());
+  header->rd = 1;
+  header->qdcount = htons(1);
+  p = do_rfc1035_name(p, name);
+  *p++ = 0;
+  PUTSHORT(qtype, p);
+  PUTSHORT(C_IN, p);
+  /* packet buffer overwritten */
+  daemon->srv_save = NULL;
+  decode_question(header, p - (unsigned char *)header, &question);
+
+  /* already on its way */
+  if (lookup_frec_by_question(header, &question))
+    return;
+
+  memset(&nobody, 0, sizeof(nobody));
+  memset(&nowhere, 0, sizeof(nowhere));
+  forward_query(daemon, -1, &nobody, &nowhere, 0, header, p - (unsigned char *)header,
+		&question, now, NULL);
+}
+
 static size_t process_reply(struct daemon *daemon, HEADER *header, time_t now, 
-			    struct server *server, size_t n)
+			    struct server *server, size_t n, struct question *question)
 {
-  unsigned char *pheader, *sizep;
-  int munged = 0, is_sign;
-  size_t plen; 
+  unsigned char *pheader = question->pheader, *sizep = question->udpsz;
+  int munged = 0;
+  size_t plen = question->pheader_len; 
 
   /* If upstream is advertising a larger UDP packet size
 	 than we allow, trim it so that we don't get overlarge
 	 requests for the client. We can't do this for signed packets. */
 
-  if ((pheader = find_pseudoheader(header, n, &plen, &sizep, &is_sign)) && !is_sign)
+  if (pheader && !question->is_sign)
     {
       unsigned short udpsz;
       unsigned char *psave = sizep;
@@ -681,8 +993,8 @@ static size_t process_reply(struct daemon *daemon, HEADER *header, time_t now,
   else 
     {
       if (header->rcode == NXDOMAIN && 
-	  extract_request(header, n, daemon->namebuff, NULL) &&
-	  check_for_local_domain(daemon->namebuff, now, daemon))
+	  question->flags &&
+	  check_for_local_domain(question->name, now, daemon))
 	{
 	  /* if we forwarded a query for a locally known name (because it was for 
 	     an unknown type) and the answer is NXDOMAIN, convert that to NODATA,
@@ -714,18 +1026,28 @@ static size_t process_reply(struct daemon *daemon, HEADER *header, time_t now,
 /* sets new last_server */
 void reply_query(struct serverfd *sfd, struct daemon *daemon, time_t now)
 {
-  /* packet from peer server, extract data for cache, and send to
-     original requester */
-  HEADER *header;
-  union mysockaddr serveraddr;
-  struct frec *forward;
-  socklen_t addrlen = sizeof(serveraddr);
-  ssize_t n = recvfrom(sfd->fd, daemon->packet, daemon->edns_pktsz, 0, &serveraddr.sa, &addrlen);
-  size_t nn;
+  int i, count = udp_recv_batch(daemon, sfd->fd);
+
+  for (i = 0; i < count; i++)
+    {
+      udp_swap_packet(daemon, i);
+      reply_packet(sfd, daemon, udp_in[i].msg_hdr.msg_name, udp_in[i].msg_len, now);
+    }
+
+  udp_end_batch();
+}
+
+static void reply_packet(struct serverfd *sfd, struct daemon *daemon,
+			 union mysockaddr *from, ssize_t n, time_t now)
+{
+  /* packet from peer server, extract data for cache, and send to
+     original requester */
+  HEADER *header;
+  union mysockaddr serveraddr = *from;
+  struct frec *forward;
+  struct question question;
+  size_t nn;
 
-  /* packet buffer overwritten */
-  daemon->srv_save = NULL;
-  
   /* Determine the address of the server replying  so that we can mark that as good */
   serveraddr.sa.sa_family = sfd->source_addr.sa.sa_family;
 #ifdef HAVE_IPV6
@@ -735,30 +1057,32 @@ void reply_query(struct serverfd *sfd, struct daemon *daemon, time_t now)
   
   header = (HEADER *)daemon->packet;
   
-  if (n >= (int)sizeof(HEADER) && header->qr && 
-      (forward = lookup_frec(ntohs(header->id), questions_crc(header, n, daemon->namebuff))))
+  if (n < (int)sizeof(HEADER) || !header->qr)
+    return;
+
+  decode_question(header, (size_t)n, &question);
+  
+  if ((forward = lookup_frec(ntohs(header->id), question.crc)))
     {
       struct server *server = forward->sentto;
       
+      frec_reply(daemon, forward, &serveraddr, header->rcode);
+
 #ifdef DNI_IPV6_FEATURE
       if ((header->rcode == SERVFAIL || header->rcode == REFUSED ||
 	   header->rcode == NXDOMAIN || header->rcode == NOTIMP ||
 	   header->rcode == FORMERR) && (1 == forward->fwd_sign))
         {
-	  unsigned char *pheader;
-	  size_t plen;
-	  int is_sign;
 	  /* recreate query from reply */
-	  pheader = find_pseudoheader(header, (size_t)n, &plen, NULL, &is_sign);
 	  header->ancount = htons(0);
 	  header->nscount = htons(0);
 	  header->arcount = htons(0);
-	  if ((nn = resize_packet(header, (size_t)n, pheader, plen)))
+	  if ((nn = resize_packet(header, (size_t)n, question.pheader, question.pheader_len)))
 	    {
 	       header->qr = 0;
 	       header->tc = 0;
 	       forward_query(daemon, forward->fd, &forward->source,
-                 &forward->dest, forward->iface, header, nn, now, forward);
+                 &forward->dest, forward->iface, header, nn, &question, now, forward);
 	       return;
 	    }
         }
@@ -777,22 +1101,17 @@ void reply_query(struct serverfd *sfd, struct daemon *daemon, time_t now)
 	  forward->forwardall == 0)
 	/* for broken servers, attempt to send to another one. */
 	{
-	  unsigned char *pheader;
-	  size_t plen;
-	  int is_sign;
-	  
 	  /* recreate query from reply */
-	  pheader = find_pseudoheader(header, (size_t)n, &plen, NULL, &is_sign);
-	  if (!is_sign)
+	  if (!question.is_sign)
 	    {
 	      header->ancount = htons(0);
 	      header->nscount = htons(0);
 	      header->arcount = htons(0);
-	      if ((nn = resize_packet(header, (size_t)n, pheader, plen)))
+	      if ((nn = resize_packet(header, (size_t)n, question.pheader, question.pheader_len)))
 		{
 		  header->qr = 0;
 		  header->tc = 0;
-		  forward_query(daemon, -1, NULL, NULL, 0, header, nn, now, forward);
+		  forward_query(daemon, -1, NULL, NULL, 0, header, nn, &question, now, forward);
 		  return;
 		}
 	    }
@@ -824,23 +1143,26 @@ void reply_query(struct serverfd *sfd, struct daemon *daemon, time_t now)
       if (forward->forwardall == 0 || --forward->forwardall == 1 || 
 	  (header->rcode != REFUSED && header->rcode != SERVFAIL))
 	{
-	  if ((nn = process_reply(daemon, header, now, server, (size_t)n)))
+	  /* a refresh from prefetch.c: nobody to send it to */
+	  prefetch_reply(forward->fd == -1);
+	  nn = process_reply(daemon, header, now, server, (size_t)n, &question);
+	  prefetch_reply(0);
+	  if (nn)
 	    {
 //ifdef SUP_MUL_PPPOE
 	      if (header->rcode == NOERROR) { /* No error occurred */
-	          check_mul_pppoe_record(header, nn);
+	          check_mul_pppoe_record(header, nn, &question);
 	      }
 //endif
 	      header->id = htons(forward->orig_id);
 	      header->ra = 1; /* recursion if available */
-	      send_from(forward->fd, daemon->options & OPT_NOWILD, daemon->packet, nn, 
-			&forward->source, &forward->dest, forward->iface);
+	      if (forward->fd != -1)
+		send_from(forward->fd, daemon->options & OPT_NOWILD, daemon->packet, nn, 
+			  &forward->source, &forward->dest, forward->iface);
 #ifdef SUP_STATIC_PPTP
 	      if (1 == daemon->static_pptp_enable) {
 	        if (header->rcode == NOERROR) { /* No error occurred */
-	          char namebuff[512] = {0};
-		  extract_request(header, nn, namebuff, NULL);
-		  del_static_pptp_record(daemon, namebuff);
+		  del_static_pptp_record(daemon, question.name);
 		  /* add static route */
 		  struct serverfd *tmp_sp;
 		  for (tmp_sp = daemon->sp_sfd; tmp_sp; tmp_sp = tmp_sp->next) {
@@ -852,8 +1174,10 @@ void reply_query(struct serverfd *sfd, struct daemon *daemon, time_t now)
 		}
 	      }
 #endif
+	      if (forward->waiters)
+		frec_send_waiters(daemon, forward, nn, question.qend);
 	    }
-	  forward->sentto = NULL; /* cancel */
+	  free_frec(forward); /* cancel */
 	}
     }
 }
@@ -879,8 +1203,8 @@ static unsigned short checksum(unsigned short *start, int len)
 
 void receive_raw_query(struct listener *listen, struct daemon *daemon, time_t now)
 {
-	if(config_match("ap_mode", "0"))
-		return 0;
+	if(!daemon->ap_mode)
+		return;
 
 	HEADER *reply_header ;
 	unsigned int fromlen = 0;
@@ -1065,33 +1389,29 @@ void receive_raw_query(struct listener *listen, struct daemon *daemon, time_t no
 }
 #pragma pack()
 void receive_query(struct listener *listen, struct daemon *daemon, time_t now)
+{
+  int i, count = udp_recv_batch(daemon, listen->fd);
+
+  for (i = 0; i < count; i++)
+    {
+      udp_swap_packet(daemon, i);
+      query_packet(listen, daemon, &udp_in[i].msg_hdr, udp_in[i].msg_len, now);
+    }
+
+  udp_end_batch();
+}
+
+static void query_packet(struct listener *listen, struct daemon *daemon,
+			 struct msghdr *msg, ssize_t n, time_t now)
 {
   HEADER *header = (HEADER *)daemon->packet;
-  union mysockaddr source_addr;
-  unsigned short type;
+  union mysockaddr source_addr = *(union mysockaddr *)msg->msg_name;
+  struct question question;
   struct all_addr dst_addr;
   struct in_addr netmask, dst_addr_4;
   size_t m;
-  ssize_t n;
   int if_index = 0;
-  struct iovec iov[1];
-  struct msghdr msg;
   struct cmsghdr *cmptr;
-  union {
-    struct cmsghdr align; /* this ensures alignment */
-#ifdef HAVE_IPV6
-    char control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-#endif
-#if defined(HAVE_LINUX_NETWORK)
-    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#elif defined(IP_RECVDSTADDR)
-    char control[CMSG_SPACE(sizeof(struct in_addr)) +
-		 CMSG_SPACE(sizeof(struct sockaddr_dl))];
-#endif
-  } control_u;
-  
-  /* packet buffer overwritten */
-  daemon->srv_save = NULL;
   
   if (listen->family == AF_INET && (daemon->options & OPT_NOWILD))
     {
@@ -1104,22 +1424,8 @@ void receive_query(struct listener *listen, struct daemon *daemon, time_t now)
       netmask.s_addr = 0;
     }
 
-  iov[0].iov_base = daemon->packet;
-  iov[0].iov_len = daemon->edns_pktsz;
-    
-  msg.msg_control = control_u.control;
-  msg.msg_controllen = sizeof(control_u);
-  msg.msg_flags = 0;
-  msg.msg_name = &source_addr;
-  msg.msg_namelen = sizeof(source_addr);
-  msg.msg_iov = iov;
-  msg.msg_iovlen = 1;
-  
-  if ((n = recvmsg(listen->fd, &msg, 0)) == -1)
-    return;
-  
   if (n < (int)sizeof(HEADER) || 
-      (msg.msg_flags & MSG_TRUNC) ||
+      (msg->msg_flags & MSG_TRUNC) ||
       header->qr)
     return;
   
@@ -1133,12 +1439,12 @@ void receive_query(struct listener *listen, struct daemon *daemon, time_t now)
     {
       struct ifreq ifr;
 
-      if (msg.msg_controllen < sizeof(struct cmsghdr))
+      if (msg->msg_controllen < sizeof(struct cmsghdr))
 	return;
 
 #if defined(HAVE_LINUX_NETWORK)
       if (listen->family == AF_INET)
-	for (cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr))
+	for (cmptr = CMSG_FIRSTHDR(msg); cmptr; cmptr = CMSG_NXTHDR(msg, cmptr))
 	  if (cmptr->cmsg_level == SOL_IP && cmptr->cmsg_type == IP_PKTINFO)
 	    {
 	      dst_addr_4 = dst_addr.addr.addr4 = ((struct in_pktinfo *)CMSG_DATA(cmptr))->ipi_spec_dst;
@@ -1147,7 +1453,7 @@ void receive_query(struct listener *listen, struct daemon *daemon, time_t now)
 #elif defined(IP_RECVDSTADDR) && defined(IP_RECVIF)
       if (listen->family == AF_INET)
 	{
-	  for (cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr))
+	  for (cmptr = CMSG_FIRSTHDR(msg); cmptr; cmptr = CMSG_NXTHDR(msg, cmptr))
 	    if (cmptr->cmsg_level == IPPROTO_IP && cmptr->cmsg_type == IP_RECVDSTADDR)
 	      dst_addr_4 = dst_addr.addr.addr4 = *((struct in_addr *)CMSG_DATA(cmptr));
 	    else if (cmptr->cmsg_level == IPPROTO_IP && cmptr->cmsg_type == IP_RECVIF)
@@ -1158,7 +1464,7 @@ void receive_query(struct listener *listen, struct daemon *daemon, time_t now)
 #ifdef HAVE_IPV6
       if (listen->family == AF_INET6)
 	{
-	  for (cmptr = CMSG_FIRSTHDR(&msg); cmptr; cmptr = CMSG_NXTHDR(&msg, cmptr))
+	  for (cmptr = CMSG_FIRSTHDR(msg); cmptr; cmptr = CMSG_NXTHDR(msg, cmptr))
 	    if (cmptr->cmsg_level == IPV6_LEVEL && cmptr->cmsg_type == IPV6_PKTINFO)
 	      {
 		dst_addr.addr.addr6 = ((struct in6_pktinfo *)CMSG_DATA(cmptr))->ipi6_addr;
@@ -1192,30 +1498,33 @@ void receive_query(struct listener *listen, struct daemon *daemon, time_t now)
       netmask = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr;
     }
   
-  if (extract_request(header, (size_t)n, daemon->namebuff, &type))
+  if (decode_question(header, (size_t)n, &question))
     {
       if (listen->family == AF_INET) 
-	log_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff, 
-		  (struct all_addr *)&source_addr.in.sin_addr, type, NULL, 0);
+	log_query(F_QUERY | F_IPV4 | F_FORWARD, question.name, 
+		  (struct all_addr *)&source_addr.in.sin_addr, question.qtype, NULL, 0);
 #ifdef HAVE_IPV6
       else
-	log_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff, 
-		  (struct all_addr *)&source_addr.in6.sin6_addr, type, NULL, 0);
+	log_query(F_QUERY | F_IPV6 | F_FORWARD, question.name, 
+		  (struct all_addr *)&source_addr.in6.sin6_addr, question.qtype, NULL, 0);
 #endif
     }
 
+  m = reply_find(header, ((char *) header) + PACKETSZ, &question, now);
 #ifdef HAVE_IPV6
-  if((m = answer_request (header, \
+  if(m == 0 && (m = answer_request (header, \
 			  ((char *) header) + PACKETSZ, \
 			  (size_t)n, \
+			  &question, \
 			  daemon, \
 			  dst_addr_4, \
 			  netmask, \
 			  now) ) == -1)
     return; //We would do nothing for this request.
 #else
-  m = answer_request (header, ((char *) header) + PACKETSZ, (size_t)n, daemon, 
-		      dst_addr_4, netmask, now);
+  if (m == 0)
+    m = answer_request (header, ((char *) header) + PACKETSZ, (size_t)n, &question, daemon, 
+			dst_addr_4, netmask, now);
 #endif
   if (m >= 1)
     send_from(listen->fd, daemon->options & OPT_NOWILD, (char *)header, m, &source_addr, &dst_addr, if_index);
@@ -1223,10 +1532,14 @@ void receive_query(struct listener *listen, struct daemon *daemon, time_t now)
 #ifdef DNI_PARENTAL_CTL
   {
     if (1 == parentalcontrol_enable)
-        parse_parentalcontrol(header, &n, source_addr);
+      {
+	size_t len = (size_t)n;
+	parental_tag_query(header, ((char *)header) + daemon->packet_buff_sz, &len, &source_addr);
+	n = len;
+      }
 #endif
     forward_query(daemon, listen->fd, &source_addr, &dst_addr, if_index,
-		  header, (size_t)n, now, NULL);
+		  header, (size_t)n, &question, now, NULL);
 #ifdef DNI_PARENTAL_CTL
   }
 #endif
@@ -1241,7 +1554,8 @@ unsigned char *tcp_request(struct daemon *daemon, int confd, time_t now,
 {
   int size = 0;
   size_t m;
-  unsigned short qtype, gotname;
+  unsigned short gotname;
+  struct question question;
   unsigned char c1, c2;
   /* Max TCP packet + slop */
   unsigned char *packet = malloc(65536 + MAXDNAME + RRFIXEDSZ);
@@ -1261,7 +1575,7 @@ unsigned char *tcp_request(struct daemon *daemon, int confd, time_t now,
       
       header = (HEADER *)packet;
       
-      if ((gotname = extract_request(header, (unsigned int)size, daemon->namebuff, &qtype)))
+      if ((gotname = decode_question(header, (unsigned int)size, &question)))
 	{
 	  union mysockaddr peer_addr;
 	  socklen_t peer_len = sizeof(union mysockaddr);
@@ -1269,19 +1583,19 @@ unsigned char *tcp_request(struct daemon *daemon, int confd, time_t now,
 	  if (getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) != -1)
 	    {
 	      if (peer_addr.sa.sa_family == AF_INET) 
-		log_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff, 
-			  (struct all_addr *)&peer_addr.in.sin_addr, qtype, NULL, 0);
+		log_query(F_QUERY | F_IPV4 | F_FORWARD, question.name, 
+			  (struct all_addr *)&peer_addr.in.sin_addr, question.qtype, NULL, 0);
 #ifdef HAVE_IPV6
 	      else
-		log_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff, 
-			  (struct all_addr *)&peer_addr.in6.sin6_addr, qtype, NULL, 0);
+		log_query(F_QUERY | F_IPV6 | F_FORWARD, question.name, 
+			  (struct all_addr *)&peer_addr.in6.sin6_addr, question.qtype, NULL, 0);
 #endif
 	    }
 	}
       
       /* m > 0 if answered from cache */
-      m = answer_request(header, ((char *) header) + 65536, (unsigned int)size, daemon, 
-			 local_addr, netmask, now);
+      m = answer_request(header, ((char *) header) + 65536, (unsigned int)size, &question,
+			 daemon, local_addr, netmask, now);
       
       if (m == 0)
 	{
@@ -1292,7 +1606,7 @@ unsigned char *tcp_request(struct daemon *daemon, int confd, time_t now,
 	  char *domain = NULL;
 	  
 	  if (gotname)
-	    flags = search_servers(daemon, now, &addrp, gotname, daemon->namebuff, &type, &domain);
+	    flags = search_servers(daemon, now, &addrp, &question, &type, &domain);
 	  
 	  if (type != 0  || (daemon->options & OPT_ORDER) || !daemon->last_server)
 	    last_server = daemon->servers;
@@ -1302,7 +1616,7 @@ unsigned char *tcp_request(struct daemon *daemon, int confd, time_t now,
 	  if (!flags && last_server)
 	    {
 	      struct server *firstsendto = NULL;
-	      unsigned int crc = questions_crc(header, (unsigned int)size, daemon->namebuff);
+	      unsigned int crc = question.crc;
 
 	      /* Loop round available servers until we succeed in connecting to one.
 	         Note that this code subtley ensures that consecutive queries on this connection
@@ -1356,14 +1670,12 @@ unsigned char *tcp_request(struct daemon *daemon, int confd, time_t now,
 		  if (!read_write(last_server->tcpfd, packet, m, 1))
 		    return packet;
 		  
-		  if (!gotname)
-		    strcpy(daemon->namebuff, "query");
 		  if (last_server->addr.sa.sa_family == AF_INET)
-		    log_query(F_SERVER | F_IPV4 | F_FORWARD, daemon->namebuff, 
+		    log_query(F_SERVER | F_IPV4 | F_FORWARD, gotname ? question.name : "query", 
 			      (struct all_addr *)&last_server->addr.in.sin_addr, 0, NULL, 0); 
 #ifdef HAVE_IPV6
 		  else
-		    log_query(F_SERVER | F_IPV6 | F_FORWARD, daemon->namebuff, 
+		    log_query(F_SERVER | F_IPV6 | F_FORWARD, gotname ? question.name : "query", 
 			      (struct all_addr *)&last_server->addr.in6.sin6_addr, 0, NULL, 0);
 #endif 
 		  
@@ -1373,8 +1685,9 @@ unsigned char *tcp_request(struct daemon *daemon, int confd, time_t now,
 		  /* If the crc of the question section doesn't match the crc we sent, then
 		     someone might be attempting to insert bogus values into the cache by 
 		     sending replies containing questions and bogus answers. */
-		  if (crc == questions_crc(header, (unsigned int)m, daemon->namebuff))
-		    m = process_reply(daemon, header, now, last_server, (unsigned int)m);
+		  decode_question(header, (unsigned int)m, &question);
+		  if (crc == question.crc)
+		    m = process_reply(daemon, header, now, last_server, (unsigned int)m, &question);
 		  
 		  break;
 		}
@@ -1394,40 +1707,423 @@ unsigned char *tcp_request(struct daemon *daemon, int confd, time_t now,
     }
 }
 
-static struct frec *allocate_frec(time_t now)
+static unsigned int frec_sender_bucket(union mysockaddr *addr, unsigned short id, unsigned int crc)
+{
+  unsigned int h = crc ^ id;
+
+  if (addr->sa.sa_family == AF_INET)
+    h ^= addr->in.sin_addr.s_addr ^ addr->in.sin_port;
+#ifdef HAVE_IPV6
+  else if (addr->sa.sa_family == AF_INET6)
+    {
+      u32 *a = (u32 *)&addr->in6.sin6_addr;
+      h ^= a[0] ^ a[1] ^ a[2] ^ a[3] ^ addr->in6.sin6_port;
+    }
+#endif
+  
+  h ^= h >> 16;
+  return h & (frec_hash_sz - 1);
+}
+
+static unsigned int frec_question_bucket(unsigned int crc)
+{
+  return (crc ^ (crc >> 16)) & (frec_hash_sz - 1);
+}
+
+/* Index a record under its keys, once they're filled in. */
+static void frec_hash(struct daemon *daemon, struct frec *f)
+{
+  unsigned int b;
+
+  if (!frec_id_hash)
+    {
+      for (frec_hash_sz = 64; frec_hash_sz < daemon->ftabsize; frec_hash_sz <<= 1);
+      frec_id_hash = safe_malloc(frec_hash_sz * sizeof(struct frec *));
+      frec_sender_hash = safe_malloc(frec_hash_sz * sizeof(struct frec *));
+      frec_question_hash = safe_malloc(frec_hash_sz * sizeof(struct frec *));
+      memset(frec_id_hash, 0, frec_hash_sz * sizeof(struct frec *));
+      memset(frec_sender_hash, 0, frec_hash_sz * sizeof(struct frec *));
+      memset(frec_question_hash, 0, frec_hash_sz * sizeof(struct frec *));
+    }
+
+  b = f->new_id & (frec_hash_sz - 1);
+  f->id_next = frec_id_hash[b];
+  frec_id_hash[b] = f;
+
+  b = frec_sender_bucket(&f->source, f->orig_id, f->crc);
+  f->sender_next = frec_sender_hash[b];
+  frec_sender_hash[b] = f;
+
+  if (f->join)
+    {
+      b = frec_question_bucket(f->crc);
+      f->question_next = frec_question_hash[b];
+      frec_question_hash[b] = f;
+    }
+
+  f->hashed = 1;
+}
+
+static void frec_unhash(struct frec *f)
+{
+  struct frec **up;
+
+  if (!f->hashed)
+    return;
+
+  for (up = &frec_id_hash[f->new_id & (frec_hash_sz - 1)]; *up; up = &(*up)->id_next)
+    if (*up == f)
+      {
+	*up = f->id_next;
+	break;
+      }
+
+  for (up = &frec_sender_hash[frec_sender_bucket(&f->source, f->orig_id, f->crc)];
+       *up; up = &(*up)->sender_next)
+    if (*up == f)
+      {
+	*up = f->sender_next;
+	break;
+      }
+
+  if (f->join)
+    for (up = &frec_question_hash[frec_question_bucket(f->crc)]; *up; up = &(*up)->question_next)
+      if (*up == f)
+	{
+	  *up = f->question_next;
+	  break;
+	}
+
+  f->hashed = 0;
+}
+
+static void frec_unlink(struct frec *f)
+{
+  if (f->prev)
+    f->prev->next = f->next;
+  else
+    frec_oldest = f->next;
+
+  if (f->next)
+    f->next->prev = f->prev;
+  else
+    frec_newest = f->prev;
+}
+
+/* Put a record on the end of the in-use list, to expire in due course. */
+static void frec_use(struct frec *f, time_t now)
+{
+  timer_add(&f->timer, 2 * TIMEOUT * 1000, frec_timeout, f);
+  f->time = now;
+  f->next = NULL;
+  if ((f->prev = frec_newest))
+    frec_newest->next = f;
+  else
+    frec_oldest = f;
+  frec_newest = f;
+}
+
+#ifdef DNI_IPV6_FEATURE
+static void frec_touch(struct frec *f, time_t now)
+{
+  frec_unlink(f);
+  frec_use(f, now);
+}
+#endif
+
+/* Forget f's hedge, sent or not, so it no longer counts against hedge_max. */
+static void frec_unhedge(struct frec *f)
+{
+  timer_del(&f->hedge);
+  if (f->hedgeto)
+    {
+      hedges--;
+      f->hedgeto = NULL;
+    }
+}
+
+static void free_frec(struct frec *f)
+{
+  struct frec_src *w;
+
+  if (!f->prev && f != frec_oldest)
+    return; /* already free */
+  
+  frec_lost(f);
+  timer_del(&f->timer);
+  frec_unhedge(f);
+  while ((w = f->waiters))
+    {
+      f->waiters = w->next;
+      w->next = waiter_free;
+      waiter_free = w;
+    }
+  frec_unhash(f);
+  frec_unlink(f);
+  f->sentto = NULL;
+  f->prev = NULL;
+  f->next = frec_free;
+  frec_free = f;
+}
+
+/* Keep a copy of the query name. The space is sized to the name and kept
+   with the record, to be reused by later queries whose names fit. */
+static void frec_set_name(struct frec *f, char *name)
+{
+  size_t len = strlen(name) + 1;
+  
+  if (len > f->name_sz)
+    {
+      size_t sz = (len + 15) & ~15;
+      char *new;
+
+      if (!(new = malloc(sz)))
+	{
+	  name = "";
+	  len = 1;
+	}
+      else
+	{
+	  if (f->name != frec_no_name)
+	    free(f->name);
+	  frec_name_bytes += sz - f->name_sz;
+	  f->name = new;
+	  f->name_sz = sz;
+	}
+    }
+
+  if (f->name != frec_no_name)
+    memcpy(f->name, name, len);
+}
+
+/* The server f was last sent to has not answered, and now won't be
+   waited for. It has taken at least this long. */
+static void frec_lost(struct frec *f)
+{
+  struct server *serv = f->sentto;
+  int waited;
+
+  if (!serv || f->timing == FREC_IDLE)
+    return;
+
+  f->timing = FREC_IDLE;
+  serv->stats.lost++;
+  serv->stats.misses++;
+  if ((waited = timer_now() - f->sent) > serv->stats.srtt)
+    server_rtt(serv, waited);
+}
+
+/* A reply to f came from addr. Time it if it was only sent once. */
+static void frec_reply(struct daemon *daemon, struct frec *f, union mysockaddr *addr, int rcode)
+{
+  struct server *serv = f->sentto;
+
+  if (!sockaddr_isequal(&serv->addr, addr))
+    for (serv = daemon->servers; serv; serv = serv->next)
+      if (!(serv->flags & (SERV_LITERAL_ADDRESS | SERV_NO_ADDR)) &&
+	  sockaddr_isequal(&serv->addr, addr))
+	break;
+
+  if (!serv)
+    return;
+
+  serv->stats.replies++;
+  /* broken servers answer quickly: don't let that count */
+  if (rcode == SERVFAIL || rcode == REFUSED)
+    serv->stats.misses++;
+  else
+    {
+      serv->stats.misses = 0;
+      if (f->timing == FREC_ONCE)
+	{
+	  unsigned long at = timer_now();
+
+	  if (serv != f->hedgeto)
+	    server_rtt(serv, at - f->sent);
+	  else
+	    {
+	      hedges_won++;
+	      server_rtt(serv, at - f->hedge_sent);
+	      /* and the first has taken at least this long */
+	      if ((int)(at - f->sent) > f->sentto->stats.srtt)
+		server_rtt(f->sentto, at - f->sent);
+	    }
+	}
+    }
+  
+  f->timing = FREC_IDLE;
+}
+
+/* The next best server to send f to, after f->sentto. It must be of the
+   same address family: with servers of both (daemon->diff_svr),
+   forward_query() sends to one family first, and only to the other once
+   that has failed. */
+static struct server *frec_hedge_server(struct daemon *daemon, struct frec *f)
+{
+  struct server *first = f->sentto, *serv, *best = NULL;
+  int type = first->flags & SERV_TYPE;
+
+  for (serv = daemon->servers; serv; serv = serv->next)
+    if (serv != first && server_for(serv, type, first->domain) &&
+	serv->addr.sa.sa_family == first->addr.sa.sa_family &&
+	serv->stats.misses < SERVER_MISSES &&
+	!mulpppoe_skip_dns(serv->addr.in.sin_addr, f->name) &&
+	(!best || server_cost(serv) < server_cost(best)))
+      best = serv;
+
+  return best;
+}
+
+/* No reply yet from the server f went to: send it to another as well.
+   Whichever answers first is used; the other's reply finds no record. */
+static void frec_hedge(struct daemon *daemon, void *arg, time_t now)
+{
+  struct frec *f = arg;
+  struct server *serv;
+
+  (void)now;
+
+  if (!f->sentto || f->timing != FREC_ONCE || hedges >= daemon->hedge_max ||
+      !(serv = frec_hedge_server(daemon, f)) ||
+      server_send(serv, (HEADER *)f->query, f->query_len) == -1)
+    return;
+
+  f->hedgeto = serv;
+  f->hedge_sent = timer_now();
+  serv->stats.queries++;
+  hedges++;
+  hedges_sent++;
+
+  if (serv->addr.sa.sa_family == AF_INET)
+    log_query(F_SERVER | F_IPV4 | F_FORWARD, f->name, 
+	      (struct all_addr *)&serv->addr.in.sin_addr, 0, NULL, 0); 
+#ifdef HAVE_IPV6
+  else
+    log_query(F_SERVER | F_IPV6 | F_FORWARD, f->name, 
+	      (struct all_addr *)&serv->addr.in6.sin6_addr, 0, NULL, 0);
+#endif 
+}
+
+/* f has just gone to one server: if it's not answered in about the time
+   nine in ten of that server's replies take, send it to another. The
+   query is kept with the record, in space reused like that for the name. */
+static void frec_hedge_set(struct daemon *daemon, struct frec *f, HEADER *header, size_t plen)
+{
+  struct server *serv = f->sentto;
+  int delay = serv->stats.srtt ? serv->stats.srtt + 2 * serv->stats.rttvar : HEDGE_UNTIMED;
+
+  if (hedges >= daemon->hedge_max || plen > 0xffff)
+    return;
+
+  if (plen > f->query_sz)
+    {
+      size_t sz = (plen + 63) & ~63;
+      unsigned char *new;
+
+      if (sz > 0xffff || !(new = malloc(sz)))
+	return;
+      free(f->query);
+      f->query = new;
+      f->query_sz = sz;
+    }
+
+  memcpy(f->query, header, plen);
+  f->query_len = plen;
+  timer_add(&f->hedge, delay < HEDGE_MIN ? HEDGE_MIN : delay, frec_hedge, f);
+}
+
+/* A record's timer: give up on it, or under DNI_IPV6_FEATURE, when the
+   first group of servers hasn't answered, try the other group. */
+static void frec_timeout(struct daemon *daemon, void *arg, time_t now)
+{
+  struct frec *fwd = arg;
+#ifdef DNI_IPV6_FEATURE
+  HEADER *header;
+  struct question question;
+  unsigned char *p;
+  size_t n;
+
+  if (fwd->sentto && 1 == fwd->fwd_sign)
+    {
+      header = (HEADER *)daemon->packet;
+      p = (unsigned char *)header;
+      header->id = htons(fwd->new_id);
+      memcpy(p + 2, &fwd->flags, sizeof(fwd->flags));
+      header->qdcount = htons(1);
+      header->ancount = 0;
+      header->nscount = 0;
+      header->arcount = 0;
+      p += sizeof(HEADER);
+      n = sizeof(HEADER);
+      n += transmit_name(fwd->name, &p);
+      PUTSHORT(fwd->type, p);
+      n += sizeof(fwd->type);
+      PUTSHORT(fwd->class, p);
+      n += sizeof(fwd->class);
+      /* packet buffer overwritten */
+      daemon->srv_save = NULL;
+      decode_question(header, n, &question);
+      forward_query(daemon, fwd->fd, &fwd->source, &fwd->dest, fwd->iface,
+		    header, n, &question, now, fwd);
+      return;
+    }
+#else
+  (void)daemon; (void)now;
+#endif
+
+  free_frec(fwd);
+}
+
+static struct frec *allocate_frec(void)
 {
   struct frec *f;
   
   if ((f = (struct frec *)malloc(sizeof(struct frec))))
     {
-      f->next = frec_list;
-      f->time = now;
+      memset(&f->timer, 0, sizeof(f->timer));
+      memset(&f->hedge, 0, sizeof(f->hedge));
+      f->query = NULL;
+      f->query_len = f->query_sz = 0;
+      f->hedgeto = NULL;
+      f->join = 0;
+      f->waiters = NULL;
+      f->name = frec_no_name;
+      f->name_sz = 0;
       f->sentto = NULL;
-      frec_list = f;
+      f->hashed = 0;
+      f->timing = FREC_IDLE;
+      f->prev = NULL;
+      f->next = frec_free;
+      frec_free = f;
+      frec_count++;
     }
 
   return f;
 }
 
+/* Take the record at the head of the free list into use. */
+static struct frec *frec_take(time_t now)
+{
+  struct frec *f = frec_free;
+
+  frec_free = f->next;
+  frec_use(f, now);
+  
+  return f;
+}
+
 /* if wait==NULL return a free or older than TIMEOUT record.
    else return *wait zero if one available, or *wait is delay to
    when the oldest in-use record will expire. */
 struct frec *get_new_frec(struct daemon *daemon, time_t now, int *wait)
 {
-  struct frec *f, *oldest;
-  int count;
+  struct frec *oldest = frec_oldest;
   
   if (wait)
     *wait = 0;
 
-  for (f = frec_list, oldest = NULL, count = 0; f; f = f->next, count++)
-    if (!f->sentto)
-      {
-	f->time = now;
-	return f;
-      }
-    else if (!oldest || difftime(f->time, oldest->time) <= 0)
-      oldest = f;
+  if (frec_free)
+    return wait ? frec_free : frec_take(now);
   
   /* can't find empty one, use oldest if there is one
      and it's older than timeout */
@@ -1436,31 +2132,35 @@ struct frec *get_new_frec(struct daemon *daemon, time_t now, int *wait)
       /* keep stuff for twice timeout if we can by allocating a new
 	 record instead */
       if (difftime(now, oldest->time) < 2*TIMEOUT && 
-	  count <= daemon->ftabsize &&
-	  (f = allocate_frec(now)))
-	return f;
+	  frec_count <= daemon->ftabsize &&
+	  allocate_frec())
+	return wait ? frec_free : frec_take(now);
 
       if (!wait)
 	{
-	  oldest->sentto = 0;
-	  oldest->time = now;
+	  free_frec(oldest);
+	  return frec_take(now);
 	}
       return oldest;
     }
   
   /* none available, calculate time 'till oldest record expires */
-  if (count > daemon->ftabsize)
+  if (frec_count > daemon->ftabsize)
     {
       if (oldest && wait)
 	*wait = oldest->time + (time_t)TIMEOUT - now;
       return NULL;
     }
   
-  if (!(f = allocate_frec(now)) && wait)
-    /* wait one second on malloc failure */
-    *wait = 1;
+  if (!allocate_frec())
+    {
+      /* wait one second on malloc failure */
+      if (wait)
+	*wait = 1;
+      return NULL;
+    }
 
-  return f; /* OK if malloc fails and this is NULL */
+  return wait ? frec_free : frec_take(now);
 }
  
 /* crc is all-ones if not known. */
@@ -1468,7 +2168,10 @@ static struct frec *lookup_frec(unsigned short id, unsigned int crc)
 {
   struct frec *f;
 
-  for(f = frec_list; f; f = f->next)
+  if (!frec_id_hash)
+    return NULL;
+
+  for (f = frec_id_hash[id & (frec_hash_sz - 1)]; f; f = f->id_next)
     if (f->sentto && f->new_id == id && 
 	(f->crc == crc || crc == 0xffffffff))
       return f;
@@ -1481,8 +2184,11 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
 					  unsigned int crc)
 {
   struct frec *f;
+
+  if (!frec_sender_hash)
+    return NULL;
   
-  for(f = frec_list; f; f = f->next)
+  for (f = frec_sender_hash[frec_sender_bucket(addr, id, crc)]; f; f = f->sender_next)
     if (f->sentto &&
 	f->orig_id == id && 
 	f->crc == crc &&
@@ -1492,14 +2198,161 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
   return NULL;
 }
 
+/* What else in a query, besides its question, the reply depends on: two
+   queries can only share a reply if these are the same. */
+static unsigned short query_join_bits(HEADER *header, struct question *question)
+{
+  unsigned short bits = FREC_JOIN | (header->rd ? 1 : 0) | (header->cd ? 2 : 0);
+
+  if (question->pheader)
+    {
+      unsigned char *flagp = question->udpsz + 4;
+      unsigned short flags;
+
+      GETSHORT(flags, flagp);
+      bits |= 4 | ((flags & 0x8000) ? 8 : 0); /* EDNS, DO */
+    }
+
+  return bits;
+}
+
+/* A query out upstream for the same question, asked the same way. The
+   name must match exactly, case too, since the reply echoes it. Under
+   parental control the answer depends on the device which asked, from
+   the OPT record parental_tag_query() adds, so none are shared. */
+static struct frec *lookup_frec_by_question(HEADER *header, struct question *question)
+{
+  struct frec *f;
+  unsigned short join;
+
+  if (!frec_question_hash || question->is_sign)
+    return NULL;
+
+#ifdef DNI_PARENTAL_CTL
+  if (parentalcontrol_enable)
+    return NULL;
+#endif
+
+  join = query_join_bits(header, question);
+
+  for (f = frec_question_hash[frec_question_bucket(question->crc)]; f; f = f->question_next)
+    if (f->sentto &&
+	f->crc == question->crc &&
+	f->join == join &&
+	f->type == question->qtype &&
+	f->class == question->qclass &&
+	strcmp(f->name, question->name) == 0)
+      return f;
+
+  return NULL;
+}
+
+/* The record this query's sender is already waiting on, if this is a retry. */
+static struct frec *lookup_frec_by_waiter(HEADER *header, struct question *question,
+					  union mysockaddr *addr)
+{
+  struct frec *f = lookup_frec_by_question(header, question);
+  struct frec_src *w;
+
+  if (f)
+    for (w = f->waiters; w; w = w->next)
+      if (w->orig_id == ntohs(header->id) && sockaddr_isequal(&w->source, addr))
+	return f;
+
+  return NULL;
+}
+
+/* Wait for the answer to the same question, asked already, rather than
+   forward this query. The waiters are limited to the size of the
+   forwarding table. */
+static int frec_join(struct daemon *daemon, HEADER *header, struct question *question,
+		     union mysockaddr *addr, struct all_addr *dst_addr, unsigned int dst_iface, int fd)
+{
+  struct frec *f;
+  struct frec_src *w;
+
+  if (!(f = lookup_frec_by_question(header, question)))
+    return 0;
+
+  if ((w = waiter_free))
+    waiter_free = w->next;
+  else if (waiter_count >= daemon->ftabsize || !(w = malloc(sizeof(struct frec_src))))
+    return 0;
+  else
+    waiter_count++;
+
+  w->source = *addr;
+  w->dest = *dst_addr;
+  w->iface = dst_iface;
+  w->orig_id = ntohs(header->id);
+  w->fd = fd;
+  w->udpsz = PACKETSZ;
+  if (question->pheader)
+    {
+      unsigned char *p = question->udpsz;
+
+      GETSHORT(w->udpsz, p);
+      if (w->udpsz < PACKETSZ)
+	w->udpsz = PACKETSZ;
+    }
+  
+  w->next = f->waiters;
+  f->waiters = w;
+  waiters_joined++;
+
+  return 1;
+}
+
+/* Send the reply to f in daemon->packet, n long, to those waiting on it
+   too: first those which can take all of it, then, cut to the question
+   which ends at qend, the rest. Each gets its own ID, and queued replies
+   point into the packet, so they go before it is changed. */
+static void frec_send_waiters(struct daemon *daemon, struct frec *f, size_t n, unsigned char *qend)
+{
+  HEADER *header = (HEADER *)daemon->packet;
+  struct frec_src *w;
+  size_t len = n;
+
+  for (w = f->waiters; w; w = w->next)
+    if (w->udpsz >= n)
+      {
+	udp_flush();
+	header->id = htons(w->orig_id);
+	send_from(w->fd, daemon->options & OPT_NOWILD, daemon->packet, n, 
+		  &w->source, &w->dest, w->iface);
+      }
+
+  for (w = f->waiters; w && qend; w = w->next)
+    if (w->udpsz < n)
+      {
+	udp_flush();
+	if (len == n)
+	  {
+	    len = qend - (unsigned char *)header;
+	    header->tc = 1;
+	    header->ancount = htons(0);
+	    header->nscount = htons(0);
+	    header->arcount = htons(0);
+	  }
+	header->id = htons(w->orig_id);
+	send_from(w->fd, daemon->options & OPT_NOWILD, daemon->packet, len, 
+		  &w->source, &w->dest, w->iface);
+      }
+}
+
 /* A server record is going away, remove references to it */
 void server_gone(struct daemon *daemon, struct server *server)
 {
-  struct frec *f;
+  struct frec *f, *tmp;
   
-  for (f = frec_list; f; f = f->next)
-    if (f->sentto && f->sentto == server)
-      f->sentto = NULL;
+  for (f = frec_oldest; f; f = tmp)
+    {
+      tmp = f->next;
+      if (f->sentto == server)
+	free_frec(f);
+      else if (f->hedgeto == server)
+	frec_unhedge(f);
+    }
   
   if (daemon->last_server == server)
     daemon->last_server = NULL;
@@ -1520,7 +2373,7 @@ static unsigned short get_id(int force, unsigned short force_id, unsigned int cr
     {
       struct frec *f = lookup_frec(force_id, crc);
       if (f)
-	f->sentto = NULL; /* free */
+	free_frec(f);
       ret = force_id;
     }
   else do 
@@ -1530,207 +2383,6 @@ static unsigned short get_id(int force, unsigned short force_id, unsigned int cr
   return ret;
 }
 
-#ifdef DNI_PARENTAL_CTL
-/*********************************
- * transform the the mac address from the formation AA:BB:CC:DD:EE:FF
- * assigned by mac_p to the formation AABBCCDDEEFF assigned by mac
- ********************************/
-static int trans_macaddr(char * mac, char *mac_p)
-{
-	int i = 0;
-	#define MAC_LEN 17
-
-	if ((NULL == mac) || (NULL == mac_p) || (MAC_LEN != strlen(mac_p)))
-		return -1;
-
-	while (1) {
-		*mac++ = *mac_p++;
-		*mac++ = *mac_p++;
-		if (6 <= ++i)
-			break;
-		mac_p++;
-	}
-	*mac = '\0';
-        return 0;
-}
-
-/***********************************
- * get the mac address that is corresponding the specified ip address
- * from the arp buffer file "/proc/net/arp"
- **********************************/
-static int get_macaddr_by_ip(char *mac, char *ip)
-{
-        char buf[512];
-        FILE *fp=NULL;
-        char str_addr[20], str_mac[20];
-
-	if ((NULL == mac) || (NULL == ip))
-		return -1;
-
-        if(!(fp=fopen("/proc/net/arp", "r")))
-                return -1;
-
-        while(fgets(buf, 512, fp))
-        {
-		memset(str_addr, 0x00, sizeof(str_addr));
-		memset(str_mac, 0x00, sizeof(str_mac));
-		sscanf(buf, "%s %*s %*s %s %*s %*s", str_addr, str_mac);
-		if(!strcasecmp(ip, str_addr))
-		{
-			strcpy(mac, str_mac);
-			break;
-		}
-	}
-	if(fp)
-		fclose(fp);
-        return 0;
-}
-
-/************************************
- * get the deviceID that is corresponding of specified mac address
- * from the ParentalControl_table which record all pairs about
- * the mac addresses and deviceID setted by ParentalControl SOAP APIs.
- * if there is not the record of this mac address, then assign the
- * deviceID of the especial mac address "default", and if the "default"
- * is not existed too, then assign "0000111111111111".
- ***********************************/
-static void get_deviceid_by_macaddr(char *macaddr, char *deviceid)
-{
-        char default_deviceid[33]={0};
-        char macaddr_tmp[13]={0}, deviceid_tmp[33]={0};
-        char *pos=NULL;
-        char *delimiter = ",";
-        int count=0;
-	char pc_table[2000] = "0,";
-	FILE *fp = NULL;
-
-	if (NULL != (fp = fopen(pc_table_file, "r"))) {
-		fgets(pc_table, sizeof(pc_table), fp);
-		fclose(fp);
-	}
-
-        if(!strcmp("0,", pc_table))
-        {
-                strcpy(deviceid, "0000111111111111");
-                return ;
-        }
-        pos = strtok(pc_table, delimiter); //read count value of record.
-        count = atoi(pc_table);
-        while(0 < count--)
-        {
-                pos = strtok(NULL, delimiter);
-                sscanf(pos, "%s %s", macaddr_tmp, deviceid_tmp);
-                if(!strcasecmp(macaddr_tmp, macaddr))
-                {
-                        strcpy(deviceid, deviceid_tmp);
-                        break;
-                }
-                else if(!strcasecmp(macaddr_tmp, "default"))
-                {
-                        strcpy(default_deviceid, deviceid_tmp);
-                }
-        }
-
-        if(strcmp(deviceid, ""))
-                return ;
-        if(strcmp(default_deviceid, ""))
-        {
-                strcpy(deviceid, default_deviceid);
-                return;
-        }
-        strcpy(deviceid, "0000111111111111");
-
-}
-
-/*****************************************
- * if ParentalControl feature was enable, that means the value of
- * /tmp/configs/ParentalControl is 1, lookup the right deviceID and
- * add it to the end of DNS query packet with the relevant Options.
- * if ParentalControl feature was disable, just return and do nothing.
- ****************************************/
-static void parse_parentalcontrol(HEADER *header, int *n, union mysockaddr ipaddr)
-{
-        unsigned char *p_header=(unsigned char *)header;
-        unsigned char *pheader=(unsigned char *)header+*n, *p;
-        int len_header=*n;
-        short int rdlen=0;
-        FILE *fp;
-        unsigned char parentalcontrol='0';
-        char deviceid[33]={0};
-        char macaddr[20]={0}, macaddr_p[20]={0} ;
-	char ip_addr[20]={0};
-        const unsigned char clientid[11] = { PC_HTONS_CHARS(4), PC_HTONS_CHARS(15),
-                                               'O', 'p', 'e', 'n', 'D', 'N', 'S' };
-        const unsigned char fixed[11] = { 0, PC_HTONS_CHARS(41),
-                                    PC_HTONS_CHARS(512),
-                                    0, 0, 0, 0, PC_HTONS_CHARS(0) };
-        unsigned char deviceid_b[8] = { 0x00, 0x00, 0x11, 0x11,
-                                                0x11, 0x11, 0x11, 0x11};
-	strcpy(ip_addr, inet_ntoa(ipaddr.in.sin_addr));
-        if(!get_macaddr_by_ip(macaddr_p, ip_addr))
-                if(!trans_macaddr(macaddr, macaddr_p))
-                {
-                        get_deviceid_by_macaddr(macaddr, deviceid);
-                        trans_deviceid(deviceid, deviceid_b);
-                }
-        header->arcount = htons(1);
-
-        memcpy(p_header+len_header, fixed, sizeof(fixed));
-        len_header+=sizeof(fixed);
-        memcpy(p_header+len_header, clientid, sizeof(clientid));
-        len_header+=sizeof(clientid);
-        memcpy(p_header+len_header, deviceid_b, sizeof(deviceid_b));
-        len_header+=sizeof(deviceid_b);
-
-
-        p = pheader + 9;
-        memcpy(&rdlen, p, sizeof(rdlen));
-        rdlen=ntohs(rdlen);
-        rdlen+=sizeof(clientid) + sizeof(deviceid_b);
-        rdlen=htons(rdlen);
-        p = pheader + 9;
-        memcpy(p, &rdlen, sizeof(rdlen));
-
-
-        *n=len_header;
-}
-
-/***********************************
- * transform the string of deviceid to the hexadecimal formation.
- * for instance, transform the string "1234567890abcdef" to the
- * hexadecimal digit 0x12 0x34 0x56 0x78 0x90 0xAB 0xCD 0xEF, and
- * copy this hex digit to the memory assigned by deviceid_b, then
- * the string have changed to binay code.
- **********************************/
-static int trans_deviceid(char *deviceid, char *deviceid_b)
-{
-        int i=0;
-
-	if ((NULL == deviceid) || (NULL == deviceid_b))
-		return -1;
-
-        if(16 != strlen(deviceid))
-                return -1;
-        if(!strncmp(deviceid, "0000111111111111", 16))
-                return 0;
-        for(i=0; i<16; i++)
-        {
-		if (('0' <= *(deviceid + i)) && ('9' >= *(deviceid + i))) {
-			*(deviceid+i) -= '0';
-		} else if (('a' <= *(deviceid + i)) && ('f' >= *(deviceid + i))) {
-			*(deviceid+i) -= ('a' - 0xA);
-		} else if (('A' <= *(deviceid + i)) && ('F' >= *(deviceid + i))) {
-			*(deviceid+i) -= ('A' - 0xA);
-		} else {
-			return -1;
-		}
-        }
-        for(i=0; i < 8; i++)
-                *(deviceid_b+i)=((*(deviceid+i*2+0))<<4)|(*(deviceid+i*2+1));
-        return 0;
-}
-#endif
-
 #ifdef DNI_IPV6_FEATURE
 int transmit_name(char *name, unsigned char **ret)
 {
@@ -1749,44 +2401,13 @@ int transmit_name(char *name, unsigned char **ret)
 	  n++;
         }
       *p = (unsigned char)(n);
-      name++;
+      if (*name)
+	name++;
     }
   *q = 0;
   *ret = q + 1;
   return ((*ret) - start);
 }
 
-#define DNI_DNS_QUERY_TIMEOUT 3
-void check_timeout_forward(struct daemon *daemon, time_t now)
-{
-  struct frec *fwd = NULL;
-  HEADER *header = NULL;
-  int n = 0;
-  unsigned char *p = NULL;
-
-  for (fwd = frec_list; fwd; fwd = fwd->next)
-    {
-      if (fwd->sentto && 1 == fwd->fwd_sign && (int)difftime(now, fwd->time) >= DNI_DNS_QUERY_TIMEOUT)
-        {
-	  header = (HEADER *)daemon->packet;
-	  p = (unsigned char *)header;
-	  header->id = htons(fwd->new_id);
-	  memcpy(p + 2, &fwd->flags, sizeof(fwd->flags));
-	  header->qdcount = 1;
-	  header->ancount = 0;
-	  header->nscount = 0;
-	  header->arcount = 0;
-	  p += sizeof(HEADER);
-	  n += sizeof(HEADER);
-	  n += transmit_name(fwd->name, &p);
-	  PUTSHORT(fwd->type, p);
-	  n += sizeof(fwd->type);
-	  PUTSHORT(fwd->class, p);
-	  n += sizeof(fwd->class);
-	  forward_query(daemon, fwd->fd, &fwd->source, &fwd->dest, fwd->iface,
-		  header, (size_t)n, now, fwd);
-        }
-    }
-}
 #endif
 
@@ -0,0 +1,940 @@
+/* dnsmasq is Copyright (c) 2000-2007 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include "dnsmasq.h"
+
+/* /etc/hosts and the --addn-hosts files. Each is compiled into an index,
+   which is written next to it as <file>.idx and mapped read-only from then
+   on, until the file changes; the text is only parsed when there is no
+   index for it, or it can't be used. An index holds the (name, address)
+   records of the file grouped by the hash of the name, a perfect hash
+   from those hashes to the groups, the records which give the reverse
+   mapping of their address sorted by address, and the names.
+
+   Cache entries are only made for the records which are looked up, and
+   live as long as the index. A reload keeps the index of a file which
+   hasn't changed, and swaps in a new one for a file which has.
+
+   The perfect hash is "hash and displace": the hashes are split into
+   buckets, and each bucket has a displacement, found when compiling,
+   which puts all its hashes in empty slots. */
+
+#define HOSTS_MAGIC "dnsmasqH"
+#define HOSTS_VERSION 2
+#define HOSTS_TRIES (1 << 20) /* displacements to try for a bucket */
+
+struct hosts_header {
+  char magic[8];
+  u32 check; /* version and layout: see hosts_check() */
+  u32 addrs; /* address lines, for logging */
+  u32 buckets, slots, recs, revs, names;
+  struct file_stamp stamp; /* of the file it was compiled from */
+};
+
+/* The records of the names with one hash, or none if count is zero. */
+struct hosts_slot {
+  u32 hash, first, count;
+};
+
+struct hosts_rec {
+  u32 name; /* offset in the names */
+  unsigned short flags; /* F_IPV4 or F_IPV6, and F_REVERSE */
+  unsigned char shortname; /* no dots, so OPT_EXPAND applies */
+  unsigned char pad;
+  unsigned char addr[IN6ADDRSZ]; /* zero filled */
+};
+
+struct hosts_index {
+  struct hosts_index *next;
+  char *fname;
+  int index; /* of the file, for logging */
+  int fresh; /* read by the last load, rather than kept */
+  struct hosts_header *header;
+  size_t len;
+  int mapped;
+  u32 *disp;
+  struct hosts_slot *slot;
+  struct hosts_rec *rec;
+  u32 *rev;
+  char *names;
+  u32 *turn; /* round-robin position in each slot */
+  struct crec **crec; /* made on demand: plain and expanded for each record */
+};
+
+/* a record while compiling */
+struct hosts_entry {
+  u32 hash, seq, name;
+  unsigned short flags;
+  unsigned char shortname;
+  unsigned char addr[IN6ADDRSZ];
+};
+
+static struct hosts_index *hosts = NULL;
+static char *hosts_suffix = NULL; /* domain for OPT_EXPAND */
+static int hosts_loaded = 0; /* the cache may have something to drop */
+static struct hosts_entry *sort_entries; /* for hosts_byaddr() */
+
+static u32 hosts_check(void)
+{
+  return (HOSTS_VERSION << 16) | (sizeof(long) << 8) | sizeof(struct hosts_header);
+}
+
+static u32 hosts_place(u32 hash, u32 disp, u32 slots)
+{
+  hash ^= disp * 0x9e3779b9;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+  return hash % slots;
+}
+
+/* like hostname_isequal(), but an order, for sorting */
+static int hosts_namecmp(char *a, char *b)
+{
+  unsigned int c1, c2;
+
+  do {
+    c1 = (unsigned char) *a++;
+    c2 = (unsigned char) *b++;
+    if (c1 >= 'A' && c1 <= 'Z')
+      c1 += 'a' - 'A';
+    if (c2 >= 'A' && c2 <= 'Z')
+      c2 += 'a' - 'A';
+  } while (c1 == c2 && c1);
+
+  return (int)c1 - (int)c2;
+}
+
+static int hosts_addrcmp(unsigned short fa, unsigned char *a, unsigned short fb, unsigned char *b)
+{
+  if ((fa & (F_IPV4 | F_IPV6)) != (fb & (F_IPV4 | F_IPV6)))
+    return (fa & F_IPV4) ? -1 : 1;
+  return memcmp(a, b, IN6ADDRSZ);
+}
+
+/* record numbers, by address */
+static int hosts_byaddr(const void *a, const void *b)
+{
+  struct hosts_entry *x = &sort_entries[*(const u32 *)a], *y = &sort_entries[*(const u32 *)b];
+
+  return hosts_addrcmp(x->flags, x->addr, y->flags, y->addr);
+}
+
+static u32 hosts_addrhash(struct hosts_entry *x)
+{
+  u32 h = x->flags, w;
+  int i;
+
+  for (i = 0; i < IN6ADDRSZ; i += sizeof(w))
+    {
+      memcpy(&w, x->addr + i, sizeof(w));
+      h = (h ^ w) * 0x9e3779b1;
+      h ^= h >> 15;
+    }
+
+  return h;
+}
+
+/* Give the first record in the file for each address its reverse
+   mapping, finding those already seen with a hash table of them. */
+static int hosts_reverse(struct hosts_entry *e, u32 count)
+{
+  u32 size, mask, i, h, *seen;
+
+  for (size = 16; size < 2 * count; size <<= 1);
+  if (!(seen = malloc(size * sizeof(u32))))
+    return 0;
+  memset(seen, 0xff, size * sizeof(u32));
+  mask = size - 1;
+
+  for (i = 0; i < count; i++)
+    {
+      for (h = hosts_addrhash(&e[i]) & mask; seen[h] != 0xffffffff; h = (h + 1) & mask)
+	if (hosts_addrcmp(e[seen[h]].flags, e[seen[h]].addr, e[i].flags, e[i].addr) == 0)
+	  break;
+
+      if (seen[h] == 0xffffffff)
+	{
+	  seen[h] = i;
+	  e[i].flags |= F_REVERSE;
+	}
+    }
+
+  free(seen);
+  return 1;
+}
+
+/* The records sorted by hash, then name, keeping the order of the file
+   otherwise. A radix sort on the hashes, a byte at a time, then an
+   insertion sort of each run with the same hash, which is nearly
+   always one name. */
+static struct hosts_entry *hosts_sort(struct hosts_entry *e, u32 count, char *names)
+{
+  struct hosts_key {
+    u32 hash, idx;
+  } *key = malloc((count + 1) * sizeof(struct hosts_key)), *tmp = malloc((count + 1) * sizeof(struct hosts_key)), *swap;
+  struct hosts_entry *out = malloc((count + 1) * sizeof(struct hosts_entry)), x;
+  u32 start[256], i, j, shift;
+
+  if (!key || !tmp || !out)
+    {
+      free(key);
+      free(tmp);
+      free(out);
+      return NULL;
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      key[i].hash = e[i].hash;
+      key[i].idx = i;
+    }
+
+  for (shift = 0; shift < 32; shift += 8)
+    {
+      memset(start, 0, sizeof(start));
+      for (i = 0; i < count; i++)
+	start[(key[i].hash >> shift) & 255]++;
+      for (i = 0, j = 0; i < 256; i++)
+	{
+	  u32 n = start[i];
+	  start[i] = j;
+	  j += n;
+	}
+      for (i = 0; i < count; i++)
+	tmp[start[(key[i].hash >> shift) & 255]++] = key[i];
+      swap = key, key = tmp, tmp = swap;
+    }
+
+  for (i = 0; i < count; i++)
+    out[i] = e[key[i].idx];
+
+  for (i = 1; i < count; i++)
+    if (out[i].hash == out[i - 1].hash &&
+	hosts_namecmp(names + out[i - 1].name, names + out[i].name) > 0)
+      {
+	x = out[i];
+	for (j = i; j > 0 && out[j - 1].hash == x.hash &&
+	       hosts_namecmp(names + out[j - 1].name, names + x.name) > 0; j--)
+	  out[j] = out[j - 1];
+	out[j] = x;
+      }
+
+  free(key);
+  free(tmp);
+  return out;
+}
+
+/* Find a displacement for each bucket which puts all its hashes in empty
+   slots, doing the biggest buckets first. The slot of each hash goes in
+   place[]. Returns zero if some bucket can't be placed. */
+static int hosts_perfect(u32 *hash, u32 count, u32 *disp, u32 buckets, u32 slots, u32 *place)
+{
+  u32 *start = calloc(buckets + 1, sizeof(u32)), *member = malloc((count + 1) * sizeof(u32));
+  unsigned char *taken = calloc(slots, 1);
+  u32 i, b, size, max = 0, d;
+  int ok = 0;
+
+  if (!start || !member || !taken)
+    goto out;
+
+  for (i = 0; i < count; i++)
+    start[hash[i] % buckets + 1]++;
+  for (b = 0; b < buckets; b++)
+    {
+      if (start[b + 1] > max)
+	max = start[b + 1];
+      start[b + 1] += start[b];
+    }
+  for (i = 0; i < count; i++)
+    member[start[hash[i] % buckets]++] = i;
+  for (b = buckets; b > 0; b--)
+    start[b] = start[b - 1];
+  start[0] = 0;
+
+  for (size = max; size > 0; size--)
+    for (b = 0; b < buckets; b++)
+      if (start[b + 1] - start[b] == size)
+	{
+	  u32 *m = &member[start[b]];
+
+	  for (d = 0; d < HOSTS_TRIES; d++)
+	    {
+	      for (i = 0; i < size; i++)
+		{
+		  u32 p = hosts_place(hash[m[i]], d, slots);
+		  if (taken[p])
+		    break;
+		  taken[p] = 1;
+		  place[m[i]] = p;
+		}
+	      if (i == size)
+		break;
+	      while (i--)
+		taken[place[m[i]]] = 0;
+	    }
+
+	  if (d == HOSTS_TRIES)
+	    goto out;
+	  disp[b] = d;
+	}
+
+  ok = 1;
+
+ out:
+  free(start);
+  free(member);
+  free(taken);
+  return ok;
+}
+
+static void hosts_sections(struct hosts_index *ix)
+{
+  struct hosts_header *h = ix->header;
+
+  ix->disp = (u32 *)(h + 1);
+  ix->slot = (struct hosts_slot *)(ix->disp + h->buckets);
+  ix->rec = (struct hosts_rec *)(ix->slot + h->slots);
+  ix->rev = (u32 *)(ix->rec + h->recs);
+  ix->names = (char *)(ix->rev + h->revs);
+}
+
+/* Parse the text of a hosts file, and lay out its index in memory. */
+static int hosts_compile(struct hosts_index *ix, char *filename, char *buff, struct stat *sb)
+{
+  FILE *f = fopen(filename, "r");
+  struct hosts_entry *e = NULL, *sorted;
+  struct hosts_header *h;
+  char *names = NULL, *line;
+  u32 *hash = NULL, *place = NULL, *first = NULL, *rev = NULL;
+  u32 count = 0, max = 0, used = 0, room = 0, blob, groups, revs, buckets, slots, i, j, k, out;
+  int addrs = 0, lineno = 0, ok = 0;
+  size_t len;
+
+  if (!f)
+    {
+      my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(errno));
+      return 0;
+    }
+
+  while ((line = fgets(buff, MAXDNAME, f)))
+    {
+      char *token = strtok(line, " \t\n\r");
+      struct hosts_entry new;
+
+      lineno++;
+
+      if (!token || (*token == '#'))
+	continue;
+
+      memset(&new, 0, sizeof(new));
+#ifdef HAVE_IPV6
+      if (inet_pton(AF_INET, token, new.addr) > 0)
+	new.flags = F_IPV4;
+      else if (inet_pton(AF_INET6, token, new.addr) > 0)
+	new.flags = F_IPV6;
+#else
+      if (inet_pton(AF_INET, token, new.addr) > 0)
+	new.flags = F_IPV4;
+#endif
+      else
+	{
+	  my_syslog(LOG_ERR, _("bad address at %s line %d"), filename, lineno);
+	  continue;
+	}
+
+      addrs++;
+
+      while ((token = strtok(NULL, " \t\n\r")) && (*token != '#'))
+	{
+	  new.shortname = !strchr(token, '.');
+	  if (!canonicalise(token))
+	    {
+	      my_syslog(LOG_ERR, _("bad name at %s line %d"), filename, lineno);
+	      continue;
+	    }
+
+	  len = strlen(token) + 1;
+	  if (count == max)
+	    {
+	      struct hosts_entry *more = realloc(e, (2 * max + 256) * sizeof(struct hosts_entry));
+
+	      if (!more)
+		goto nomem;
+	      e = more;
+	      max = 2 * max + 256;
+	    }
+	  if (used + len > room)
+	    {
+	      char *more = realloc(names, 2 * room + MAXDNAME);
+
+	      if (!more)
+		goto nomem;
+	      names = more;
+	      room = 2 * room + MAXDNAME;
+	    }
+
+	  memcpy(names + used, token, len);
+	  new.name = used;
+	  used += len;
+	  new.hash = hostname_hash(token);
+	  new.seq = count;
+	  e[count++] = new;
+	}
+    }
+
+  /* Group the records by name, and drop repeats of a name and address. */
+  if (!hosts_reverse(e, count) || !(sorted = hosts_sort(e, count, names)))
+    goto nomem;
+  free(e);
+  e = sorted;
+
+  for (i = 0, out = 0; i < count; i++)
+    {
+      int dup = 0;
+
+      for (j = out; j > 0 && e[j - 1].hash == e[i].hash &&
+	     hosts_namecmp(names + e[j - 1].name, names + e[i].name) == 0; j--)
+	if (hosts_addrcmp(e[j - 1].flags, e[j - 1].addr, e[i].flags, e[i].addr) == 0)
+	  {
+	    dup = 1;
+	    break;
+	  }
+      
+      if (!dup)
+	e[out++] = e[i];
+    }
+  count = out;
+
+  if (!(rev = malloc((count + 1) * sizeof(u32))))
+    goto nomem;
+  for (i = 0, revs = 0; i < count; i++)
+    if (e[i].flags & F_REVERSE)
+      rev[revs++] = i;
+  sort_entries = e;
+  qsort(rev, revs, sizeof(u32), hosts_byaddr);
+
+  /* one slot for each hash */
+  if (!(hash = malloc((count + 1) * sizeof(u32))) || !(first = malloc((count + 1) * sizeof(u32))))
+    goto nomem;
+  for (i = 0, groups = 0; i < count; i++)
+    if (i == 0 || e[i].hash != e[i - 1].hash)
+      {
+	hash[groups] = e[i].hash;
+	first[groups++] = i;
+      }
+  first[groups] = count;
+
+  /* names spelled the same share their text */
+  for (i = 0, blob = 0; i < count; i++)
+    if (i == 0 || strcmp(names + e[i].name, names + e[i - 1].name) != 0)
+      blob += strlen(names + e[i].name) + 1;
+
+  buckets = groups / 4 + 1;
+  slots = groups + groups / 8 + 1;
+
+  for (k = 0; ; k++, slots += slots / 8 + 1)
+    {
+      len = sizeof(struct hosts_header) + buckets * sizeof(u32) + slots * sizeof(struct hosts_slot) +
+	count * sizeof(struct hosts_rec) + revs * sizeof(u32) + blob;
+
+      free(ix->header);
+      free(place);
+      place = NULL;
+      if (!(ix->header = calloc(1, len)) || !(place = malloc((groups + 1) * sizeof(u32))))
+	goto nomem;
+
+      h = ix->header;
+      h->buckets = buckets;
+      h->slots = slots;
+      h->recs = count;
+      h->revs = revs;
+      h->names = blob;
+      hosts_sections(ix);
+
+      if (hosts_perfect(hash, groups, ix->disp, buckets, slots, place))
+	break;
+
+      if (k == 3)
+	{
+	  my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, _("cannot index names"));
+	  goto out;
+	}
+    }
+
+  memcpy(h->magic, HOSTS_MAGIC, sizeof(h->magic));
+  h->check = hosts_check();
+  h->addrs = addrs;
+  file_stamp(&h->stamp, sb);
+
+  for (i = 0; i < groups; i++)
+    {
+      ix->slot[place[i]].hash = hash[i];
+      ix->slot[place[i]].first = first[i];
+      ix->slot[place[i]].count = first[i + 1] - first[i];
+    }
+
+  for (i = 0, blob = 0; i < count; i++)
+    {
+      if (i == 0 || strcmp(names + e[i].name, names + e[i - 1].name) != 0)
+	{
+	  strcpy(ix->names + blob, names + e[i].name);
+	  ix->rec[i].name = blob;
+	  blob += strlen(names + e[i].name) + 1;
+	}
+      else
+	ix->rec[i].name = ix->rec[i - 1].name;
+      ix->rec[i].flags = e[i].flags;
+      ix->rec[i].shortname = e[i].shortname;
+      memcpy(ix->rec[i].addr, e[i].addr, IN6ADDRSZ);
+    }
+
+  memcpy(ix->rev, rev, revs * sizeof(u32));
+  ix->len = len;
+  ok = 1;
+  goto out;
+
+ nomem:
+  my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(ENOMEM));
+
+ out:
+  fclose(f);
+  free(e);
+  free(names);
+  free(hash);
+  free(first);
+  free(place);
+  free(rev);
+  if (!ok)
+    {
+      free(ix->header);
+      ix->header = NULL;
+    }
+  return ok;
+}
+
+/* Map the index of a file, if it's there and was compiled from the file
+   as it is now. The hosts files may be in a directory others can write,
+   such as /tmp, so an index is only trusted if it was written by us or
+   root, and nobody else can write it. */
+static int hosts_map(struct hosts_index *ix, char *idxname, struct stat *sb)
+{
+  int fd = open(idxname, O_RDONLY | O_NOFOLLOW);
+  struct stat isb;
+  struct hosts_header *h;
+  size_t len;
+  void *map;
+
+  if (fd == -1)
+    return 0;
+
+  if (fstat(fd, &isb) == -1 || !S_ISREG(isb.st_mode) ||
+      (isb.st_uid != geteuid() && isb.st_uid != 0) || (isb.st_mode & (S_IWGRP | S_IWOTH)) ||
+      (size_t)isb.st_size < sizeof(struct hosts_header) ||
+      (map = mmap(NULL, isb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+      close(fd);
+      return 0;
+    }
+
+  close(fd);
+  h = map;
+  len = isb.st_size;
+
+  /* check the counts one at a time, so that the sum can't overflow */
+  if (memcmp(h->magic, HOSTS_MAGIC, sizeof(h->magic)) != 0 || h->check != hosts_check() ||
+      !file_unchanged(&h->stamp, sb) ||
+      h->buckets == 0 || h->buckets > len / sizeof(u32) ||
+      h->slots == 0 || h->slots > len / sizeof(struct hosts_slot) ||
+      h->recs > len / sizeof(struct hosts_rec) || h->revs > h->recs || h->names > len ||
+      len != sizeof(struct hosts_header) + h->buckets * sizeof(u32) + h->slots * sizeof(struct hosts_slot) +
+      h->recs * sizeof(struct hosts_rec) + h->revs * sizeof(u32) + h->names ||
+      (h->names != 0 && ((char *)map)[len - 1] != 0))
+    {
+      munmap(map, len);
+      return 0;
+    }
+
+  ix->header = h;
+  ix->len = len;
+  ix->mapped = 1;
+  hosts_sections(ix);
+
+  return 1;
+}
+
+/* Write the index next to the file, and map it from there so that the
+   pages are shared, and the next start doesn't need to compile it.
+   Not being able to do so is fine. */
+static void hosts_save(struct hosts_index *ix, char *idxname, struct stat *sb)
+{
+  char *tmpname = malloc(strlen(idxname) + 5);
+  int fd;
+
+  if (!tmpname)
+    return;
+
+  strcpy(tmpname, idxname);
+  strcat(tmpname, ".new");
+
+  /* whatever is there goes first, a stale one of ours or a link someone
+     left, and the new one is never opened through a link */
+  unlink(tmpname);
+  if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644)) != -1)
+    {
+      if (!read_write(fd, (unsigned char *)ix->header, ix->len, 0) || close(fd) == -1 ||
+	  rename(tmpname, idxname) == -1)
+	unlink(tmpname);
+      else
+	{
+	  struct hosts_header *compiled = ix->header;
+
+	  if (hosts_map(ix, idxname, sb))
+	    free(compiled);
+	  my_syslog(LOG_INFO, _("compiled %s into %s"), ix->fname, idxname);
+	}
+    }
+
+  free(tmpname);
+}
+
+static void hosts_free(struct hosts_index *ix)
+{
+  u32 i;
+
+  if (ix->crec)
+    for (i = 0; i < 2 * ix->header->recs; i++)
+      free(ix->crec[i]);
+  free(ix->crec);
+  free(ix->turn);
+  if (ix->mapped)
+    munmap(ix->header, ix->len);
+  else
+    free(ix->header);
+  free(ix);
+}
+
+static struct hosts_index *hosts_open(char *filename, int index, char *buff, struct hosts_index **old)
+{
+  struct hosts_index *ix, **up;
+  struct stat sb;
+  char *idxname;
+
+  if (stat(filename, &sb) == -1)
+    {
+      my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(errno));
+      return NULL;
+    }
+
+  /* unchanged since the last load: keep it, and the cache entries made from it */
+  for (up = old; (ix = *up); up = &ix->next)
+    if (ix->index == index && strcmp(ix->fname, filename) == 0 &&
+	file_unchanged(&ix->header->stamp, &sb))
+      {
+	*up = ix->next;
+	ix->next = NULL;
+	ix->fresh = 0;
+	my_syslog(LOG_INFO, _("read %s - %d addresses"), filename, (int)ix->header->addrs);
+	return ix;
+      }
+
+  if (!(ix = calloc(1, sizeof(struct hosts_index))) ||
+      !(idxname = malloc(strlen(filename) + 5)))
+    {
+      free(ix);
+      my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(ENOMEM));
+      return NULL;
+    }
+
+  ix->fname = filename;
+  ix->index = index;
+  ix->fresh = 1;
+  strcpy(idxname, filename);
+  strcat(idxname, ".idx");
+
+  if (!hosts_map(ix, idxname, &sb))
+    {
+      if (!hosts_compile(ix, filename, buff, &sb))
+	{
+	  free(idxname);
+	  free(ix);
+	  return NULL;
+	}
+      hosts_save(ix, idxname, &sb);
+    }
+
+  free(idxname);
+
+  if (!(ix->turn = calloc(ix->header->slots, sizeof(u32))) ||
+      !(ix->crec = calloc(2 * ix->header->recs + 1, sizeof(struct crec *))))
+    {
+      my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(ENOMEM));
+      hosts_free(ix);
+      return NULL;
+    }
+
+  my_syslog(LOG_INFO, _("read %s - %d addresses"), filename, (int)ix->header->addrs);
+
+  return ix;
+}
+
+/* Is record r of ix also in old, with the same name and address? */
+static int hosts_unchanged(struct hosts_index *ix, u32 r, u32 hash, struct hosts_index *old)
+{
+  struct hosts_header *h = old->header;
+  struct hosts_slot *s = &old->slot[hosts_place(hash, old->disp[hash % h->buckets], h->slots)];
+  struct hosts_rec *rec = &ix->rec[r], *orec;
+  u32 i;
+
+  if (s->count == 0 || s->hash != hash || s->first >= h->recs || s->count > h->recs - s->first)
+    return 0;
+
+  for (i = 0; i < s->count; i++)
+    {
+      orec = &old->rec[s->first + i];
+      if (orec->name < h->names &&
+	  orec->flags == rec->flags &&
+	  memcmp(orec->addr, rec->addr, IN6ADDRSZ) == 0 &&
+	  hostname_isequal(old->names + orec->name, ix->names + rec->name))
+	return 1;
+    }
+
+  return 0;
+}
+
+/* For --incremental-reload: the cache is kept, so drop what it learnt
+   upstream about the names and addresses which a changed hosts file now
+   answers for. Names which have gone from it were never looked up
+   upstream, so there's nothing to drop for those. */
+static void hosts_diff(struct hosts_index *ix, struct hosts_index *old)
+{
+  struct hosts_header *h = ix->header;
+  char name[MAXDNAME];
+  u32 i, r, changed = 0;
+
+  for (; old; old = old->next)
+    if (strcmp(old->fname, ix->fname) == 0)
+      break;
+
+  for (i = 0; i < h->slots; i++)
+    for (r = ix->slot[i].first; r < ix->slot[i].first + ix->slot[i].count; r++)
+      {
+	struct hosts_rec *rec = &ix->rec[r];
+	
+	if (old && hosts_unchanged(ix, r, ix->slot[i].hash, old))
+	  continue;
+
+	changed++;
+	cache_forget(ix->names + rec->name, NULL, F_FORWARD);
+	if (rec->shortname && hosts_suffix &&
+	    strlen(ix->names + rec->name) + strlen(hosts_suffix) + 1 < MAXDNAME)
+	  {
+	    strcpy(name, ix->names + rec->name);
+	    strcat(name, ".");
+	    strcat(name, hosts_suffix);
+	    cache_forget(name, NULL, F_FORWARD);
+	  }
+	if (rec->flags & F_REVERSE)
+	  cache_forget(NULL, (struct all_addr *)rec->addr, F_REVERSE | (rec->flags & (F_IPV4 | F_IPV6)));
+      }
+
+  my_syslog(LOG_INFO, _("%s: %u records changed"), ix->fname, (unsigned int)changed);
+}
+
+/* Load the hosts files afresh, keeping the indexes of those which haven't
+   changed, then swap them in for the old ones. */
+void hosts_load(int opts, char *buff, char *domain_suffix, struct hostsfile *addn_hosts)
+{
+  struct hosts_index *old = hosts, *new = NULL, **up = &new, *tmp;
+
+  hosts_suffix = (opts & OPT_EXPAND) ? domain_suffix : NULL;
+
+  if (!(opts & OPT_NO_HOSTS) && (*up = hosts_open(HOSTSFILE, 0, buff, &old)))
+    up = &(*up)->next;
+
+  for (; addn_hosts; addn_hosts = addn_hosts->next)
+    if ((*up = hosts_open(addn_hosts->fname, addn_hosts->index, buff, &old)))
+      up = &(*up)->next;
+
+  if ((opts & OPT_INCR_RELOAD) && hosts_loaded)
+    for (tmp = new; tmp; tmp = tmp->next)
+      if (tmp->fresh)
+	hosts_diff(tmp, old);
+
+  hosts = new;
+  hosts_loaded = 1;
+
+  for (; old; old = tmp)
+    {
+      tmp = old->next;
+      hosts_free(old);
+    }
+}
+
+/* The cache entry for record r, with the domain appended to its name if
+   expand is set. The one which reverse lookups find gets F_REVERSE. */
+static struct crec *hosts_crec(struct hosts_index *ix, u32 r, int expand)
+{
+  struct hosts_rec *rec = &ix->rec[r];
+  struct crec *crecp = ix->crec[2 * r + expand];
+  char *name = ix->names + rec->name;
+
+  if (crecp)
+    return crecp;
+
+  if (!(crecp = malloc(sizeof(struct crec) + strlen(name) + 1 +
+		       (expand ? strlen(hosts_suffix) + 1 : 0) - SMALLDNAME)))
+    return NULL;
+
+  strcpy(crecp->name.sname, name);
+  if (expand)
+    {
+      strcat(crecp->name.sname, ".");
+      strcat(crecp->name.sname, hosts_suffix);
+    }
+
+  crecp->flags = F_HOSTS | F_IMMORTAL | F_FORWARD | (rec->flags & (F_IPV4 | F_IPV6));
+  if ((rec->flags & F_REVERSE) && (expand || !rec->shortname || !hosts_suffix))
+    crecp->flags |= F_REVERSE;
+  crecp->uid = ix->index;
+  crecp->next = NULL;
+  memcpy(&crecp->addr.addr, rec->addr, (rec->flags & F_IPV4) ? INADDRSZ : IN6ADDRSZ);
+
+  return ix->crec[2 * r + expand] = crecp;
+}
+
+/* Chain the entries for name from one index after those from the ones
+   before, in round-robin order, leaving out addresses already there. */
+static struct crec **hosts_chain(struct hosts_index *ix, char *name, int expand, unsigned short prot,
+				 struct crec **headp, struct crec **chainp)
+{
+  struct hosts_header *h = ix->header;
+  u32 hash = hostname_hash(name), i, turn;
+  struct hosts_slot *s = &ix->slot[hosts_place(hash, ix->disp[hash % h->buckets], h->slots)];
+
+  if (s->count == 0 || s->hash != hash || s->first >= h->recs || s->count > h->recs - s->first)
+    return chainp;
+
+  turn = (s->count == 1) ? 0 : ix->turn[s - ix->slot]++;
+
+  for (i = 0; i < s->count; i++)
+    {
+      u32 r = s->first + (turn + i) % s->count;
+      struct hosts_rec *rec = &ix->rec[r];
+      struct crec *crecp = ix->crec[2 * r + expand], **up;
+
+      /* once made, an entry has what's needed without going back to the index */
+      if (crecp && !expand)
+	{
+	  if (!(crecp->flags & (F_HOSTS | F_IPV4 | F_IPV6) & prot) ||
+	      !hostname_isequal(cache_get_name(crecp), name))
+	    continue;
+	}
+      else if ((expand && !rec->shortname) || rec->name >= h->names ||
+	       !((F_HOSTS | (rec->flags & (F_IPV4 | F_IPV6))) & prot) ||
+	       !hostname_isequal(ix->names + rec->name, name) ||
+	       !(crecp = hosts_crec(ix, r, expand)))
+	continue;
+
+      for (up = headp; up != chainp; up = &(*up)->next)
+	if (((*up)->flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
+	    memcmp(&(*up)->addr.addr, &crecp->addr.addr, (crecp->flags & F_IPV4) ? INADDRSZ : IN6ADDRSZ) == 0)
+	  break;
+
+      if (up == chainp)
+	{
+	  *chainp = crecp;
+	  chainp = &crecp->next;
+	}
+    }
+
+  return chainp;
+}
+
+/* Chain the entries from the hosts files for name, whose flags match
+   prot, at chainp, and return where the chain goes on from. The chain
+   isn't terminated. */
+struct crec **hosts_find_by_name(struct crec **chainp, char *name, unsigned short prot)
+{
+  struct crec **headp = chainp;
+  struct hosts_index *ix;
+  char stem[MAXDNAME];
+  int expand = 0;
+
+  /* name.domain can be a name without dots, with the domain appended */
+  if (hosts_suffix)
+    {
+      size_t len = strlen(name), slen = strlen(hosts_suffix);
+
+      if (len > slen + 1 && name[len - slen - 1] == '.' && hostname_isequal(name + len - slen, hosts_suffix))
+	{
+	  memcpy(stem, name, len - slen - 1);
+	  stem[len - slen - 1] = 0;
+	  expand = 1;
+	}
+    }
+
+  for (ix = hosts; ix; ix = ix->next)
+    {
+      chainp = hosts_chain(ix, name, 0, prot, headp, chainp);
+      if (expand)
+	chainp = hosts_chain(ix, stem, 1, prot, headp, chainp);
+    }
+
+  return chainp;
+}
+
+/* As hosts_find_by_name(), for the entry which gives the reverse mapping
+   of addr. That's from the first file which has the address. */
+struct crec **hosts_find_by_addr(struct crec **chainp, struct all_addr *addr, unsigned short prot)
+{
+  unsigned char key[IN6ADDRSZ];
+  unsigned short family = prot & (F_IPV4 | F_IPV6);
+  struct hosts_index *ix;
+  struct crec *crecp;
+
+  memset(key, 0, sizeof(key));
+  memcpy(key, addr, (family == F_IPV4) ? INADDRSZ : IN6ADDRSZ);
+
+  for (ix = hosts; ix; ix = ix->next)
+    {
+      u32 lo = 0, hi = ix->header->revs;
+
+      while (lo < hi)
+	{
+	  u32 mid = lo + (hi - lo) / 2, r = ix->rev[mid];
+	  int c;
+
+	  if (r >= ix->header->recs)
+	    break;
+
+	  if ((c = hosts_addrcmp(ix->rec[r].flags, ix->rec[r].addr, family, key)) < 0)
+	    lo = mid + 1;
+	  else if (c > 0)
+	    hi = mid;
+	  else
+	    {
+	      if (ix->rec[r].name < ix->header->names &&
+		  (crecp = hosts_crec(ix, r, ix->rec[r].shortname && hosts_suffix)))
+		{
+		  *chainp = crecp;
+		  chainp = &crecp->next;
+		}
+	      return chainp;
+	    }
+	}
+    }
+
+  return chainp;
+}
@@ -14,6 +14,15 @@
 
 static struct dhcp_lease *leases, *old_leases;
 static int dns_dirty, file_dirty, leases_left;
+static struct timer lease_timer;
+
+static void lease_timeout(struct daemon *daemon, void *arg, time_t now)
+{
+  (void)arg;
+
+  lease_prune(NULL, now);
+  lease_update_file(daemon, now);
+}
 
 void lease_init(struct daemon *daemon, time_t now)
 {
@@ -203,7 +212,7 @@ void lease_update_file(struct daemon *daemon, time_t now)
 	file_dirty = 0;
     }
   
-  /* Set alarm for when the first lease expires + slop. */
+  /* Set timer for when the first lease expires + slop. */
   for (next_event = 0, lease = leases; lease; lease = lease->next)
     if (lease->expires != 0 &&
 	(next_event == 0 || difftime(next_event, lease->expires + 10) > 0.0))
@@ -220,7 +229,9 @@ void lease_update_file(struct daemon *daemon, time_t now)
     }
 
   if (next_event != 0)
-    alarm((unsigned)difftime(next_event, now)); 
+    timer_add(&lease_timer, timer_ms(difftime(next_event, now)), lease_timeout, NULL);
+  else
+    timer_del(&lease_timer);
 }
 
 void lease_update_dns(struct daemon *daemon)
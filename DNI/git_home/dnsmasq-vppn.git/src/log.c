@@ -24,6 +24,10 @@
 /* From RFC 3164 */
 #define MAX_MESSAGE 1024
 
+#ifdef HAVE_TRACE
+unsigned int trace_flags = 0; /* TRACE_* categories enabled by --trace */
+#endif
+
 /* defaults in case we die() before we log_start() */
 static int log_fac = LOG_DAEMON;
 static int log_stderr = 0; 
@@ -310,19 +314,29 @@ void my_syslog(int priority, const char *format, ...)
   va_end(ap);
 }
 
-void set_log_writer(fd_set *set, int *maxfdp)
+static void log_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
 {
-  if (entries && log_fd != -1 && connection_good)
-    {
-      FD_SET(log_fd, set);
-      bump_maxfd(log_fd, maxfdp);
-    }
+  (void)daemon; (void)arg; (void)fd; (void)events; (void)now;
+  log_write();
 }
 
-void check_log_writer(fd_set *set)
+/* Must be called just before waiting for events, when we know no
+   more calls to my_syslog() can occur. log_write() goes until EAGAIN
+   or the queue is empty, so the registration can be edge triggered. */
+void set_log_writer(void)
 {
-  if (log_fd != -1 && FD_ISSET(log_fd, set))
-    log_write();
+  static int event_fd = -1;
+  int want = (entries && connection_good) ? EVENT_OUT : 0;
+
+  /* log_write() may have re-opened the socket */
+  if (event_fd != log_fd)
+    {
+      event_del(event_fd);
+      event_fd = log_fd;
+      event_add(event_fd, want | EVENT_EDGE, log_event, NULL);
+    }
+  else
+    event_mod(event_fd, want);
 }
 
 void die(char *message, char *arg1)
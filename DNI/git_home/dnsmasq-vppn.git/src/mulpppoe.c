@@ -19,7 +19,9 @@ static void mulppp_addrecord(char *dname, struct in_addr i_addr)
 	FILE *fp = NULL, *ft = NULL, *fw = NULL;
 	char rcstr[256] = {0}, line[256] = {0};
 
-	snprintf(rcstr, 256, "#%s#%s#", dname, inet_ntoa(i_addr));
+	/* leave room for the newline: names that long aren't recorded */
+	if (snprintf(rcstr, 256, "#%s#%s#", dname, inet_ntoa(i_addr)) >= 255)
+		return;
 	if ((fp = fopen(RECORD_FILE, "r"))) {
 		while (fgets(line, 256, fp)) {	
 	                if (strstr(line, rcstr) != NULL) {
@@ -224,21 +226,204 @@ static void update_config_check(void)
 	}
 }
 
-static int mul_pppoe_function_check(void)
+/* The policy files used to pick an upstream server for each query. They
+   are read into memory when they change, since mulpppoe_skip_dns() is
+   called for every server we send to. */
+struct mulppp_file {
+  char *name;
+  int present;
+  time_t mtime;
+  off_t size;
+};
+
+struct mulppp_domain {
+  int wildcard; /* "*suffix": match the end of the name only */
+  size_t len;
+  struct mulppp_domain *next;
+  char name[1];
+};
+
+static struct mulppp_file ppp1_enable_file = { "/etc/ppp/enable_ppp1", 0, 0, 0 };
+static struct mulppp_file ppp0_dns_file = { "/etc/ppp/pppoe1-dns.conf", 0, 0, 0 };
+static struct mulppp_file ppp1_dns_file = { PPP1_DNS_FILE, 0, 0, 0 };
+static struct mulppp_file ppp1_domain_file = { "/etc/ppp/pppoe2-domain.conf", 0, 0, 0 };
+
+static struct in_addr *ppp0_dns = NULL, *ppp1_dns = NULL;
+static int ppp0_dns_count = 0, ppp1_dns_count = 0;
+static struct mulppp_domain *ppp1_domains = NULL;
+
+/* returns 1 if the file has appeared, gone or been modified since last time */
+static int mulppp_file_changed(struct mulppp_file *f)
 {
-	FILE *fp = NULL;
-	if((fp = fopen("/etc/ppp/enable_ppp1", "r")) == NULL ){
-		my_syslog(LOG_INFO, "ppp1 not enable, return");
-		return -1;
-	}
-	fclose(fp);
+  struct stat statbuf;
+
+  if (stat(f->name, &statbuf) == -1)
+    {
+      if (!f->present)
 	return 0;
+      f->present = 0;
+      return 1;
+    }
+
+  if (f->present && statbuf.st_mtime == f->mtime && statbuf.st_size == f->size)
+    return 0;
+  
+  f->present = 1;
+  f->mtime = statbuf.st_mtime;
+  f->size = statbuf.st_size;
+  return 1;
 }
 
-void check_mul_pppoe_record(HEADER *header, int plen)
+static void mulppp_load_dns(struct mulppp_file *f, struct in_addr **addrs, int *count)
 {
-  unsigned char dname[MAXDNAME] = {0};
-  unsigned short int qtype;
+  FILE *fp;
+  char buf[128], *tok;
+  struct in_addr addr, *new;
+  int size = 0;
+
+  free(*addrs);
+  *addrs = NULL;
+  *count = 0;
+
+  if (!f->present || !(fp = fopen(f->name, "r")))
+    return;
+
+  while (fgets(buf, sizeof(buf), fp))
+    if ((tok = strtok(buf, " \t\r\n")) && inet_aton(tok, &addr))
+      {
+	if (*count == size)
+	  {
+	    if (!(new = realloc(*addrs, (size + 4) * sizeof(struct in_addr))))
+	      break;
+	    *addrs = new;
+	    size += 4;
+	  }
+	(*addrs)[(*count)++] = addr;
+      }
+
+  fclose(fp);
+  my_syslog(LOG_INFO, _("read %s - %d addresses"), f->name, *count);
+}
+
+static void mulppp_load_domains(struct mulppp_file *f)
+{
+  FILE *fp;
+  char buf[512], *tok;
+  struct mulppp_domain *d, *tmp;
+  int count = 0;
+
+  for (d = ppp1_domains; d; d = tmp)
+    {
+      tmp = d->next;
+      free(d);
+    }
+  ppp1_domains = NULL;
+
+  if (!f->present || !(fp = fopen(f->name, "r")))
+    return;
+
+  while (fgets(buf, sizeof(buf), fp))
+    {
+      int wildcard = 0;
+
+      if (!(tok = strtok(buf, " \t\r\n")))
+	continue;
+      if (*tok == '*')
+	{
+	  wildcard = 1;
+	  tok++;
+	}
+      if (!(d = malloc(sizeof(struct mulppp_domain) + strlen(tok))))
+	break;
+      d->wildcard = wildcard;
+      d->len = strlen(tok);
+      strcpy(d->name, tok);
+      d->next = ppp1_domains;
+      ppp1_domains = d;
+      count++;
+    }
+
+  fclose(fp);
+  my_syslog(LOG_INFO, _("read %s - %d domains"), f->name, count);
+}
+
+/* Called once a second from the main loop. */
+void check_mul_pppoe_files(void)
+{
+  mulppp_file_changed(&ppp1_enable_file);
+
+  if (mulppp_file_changed(&ppp0_dns_file))
+    mulppp_load_dns(&ppp0_dns_file, &ppp0_dns, &ppp0_dns_count);
+  
+  if (mulppp_file_changed(&ppp1_dns_file))
+    mulppp_load_dns(&ppp1_dns_file, &ppp1_dns, &ppp1_dns_count);
+  
+  if (mulppp_file_changed(&ppp1_domain_file))
+    mulppp_load_domains(&ppp1_domain_file);
+}
+
+static int mulppp_has_addr(struct in_addr *addrs, int count, struct in_addr addr)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (addrs[i].s_addr == addr.s_addr)
+      return 1;
+
+  return 0;
+}
+
+static int mulppp_policy_domain(char *name)
+{
+  struct mulppp_domain *d;
+  size_t len = strlen(name);
+
+  for (d = ppp1_domains; d; d = d->next)
+    if (d->wildcard)
+      {
+	if (len >= d->len && memcmp(name + len - d->len, d->name, d->len) == 0)
+	  return 1;
+      }
+    else if (strstr(name, d->name))
+      return 1;
+
+  return 0;
+}
+
+/* Check if the server is on the wrong session for this name, if so, skip
+   it. For example, www.baidu.com but the server is on ppp1, or
+   www.flets.com but the server is on ppp0. */
+int mulpppoe_skip_dns(struct in_addr srv, char *name)
+{
+  int on_ppp1;
+
+  if (!ppp1_enable_file.present)
+    return 0;
+
+  on_ppp1 = mulppp_has_addr(ppp1_dns, ppp1_dns_count, srv);
+
+  /* Fix Bug 38166 - [SQA-3006][Multi-PPPoE]Users cannot access Internet website
+   * after multi-PPPoE sessions connected and when session1 and session2 get the
+   * same DNS server.
+   */
+  if (on_ppp1 && mulppp_has_addr(ppp0_dns, ppp0_dns_count, srv))
+    return 0;
+
+  /* policy domains go to ppp1 servers, everything else to the others */
+  if (mulppp_policy_domain(name))
+    return !on_ppp1;
+
+  return on_ppp1;
+}
+
+static int mul_pppoe_function_check(void)
+{
+	return ppp1_enable_file.present ? 0 : -1;
+}
+
+void check_mul_pppoe_record(HEADER *header, int plen, struct question *q)
+{
+  char *dname = q->name;
   int addrcount = 0;
   int i;
   struct in_addr i_addr[128];
@@ -257,10 +442,8 @@ void check_mul_pppoe_record(HEADER *header, int plen)
   /* it's not answer in this dns reply packet */
   if (ntohs(header->ancount) <= 0)
    return;
-  /* get the query dname and query type */
-  if (extract_request(header, plen, dname, &qtype) == 0)
-   return;
-  if (qtype != T_A)
+  /* the query dname and query type, decoded on arrival */
+  if (q->flags == 0 || q->qtype != T_A)
    return;
 
   update_config_check();
@@ -225,7 +225,6 @@ void netlink_multicast(struct daemon *daemon)
   ssize_t len;
   struct nlmsghdr *h;
   
-  my_syslog(LOG_INFO, _("netlink_multicast in in in .......... !!!"));
   if ((len = netlink_recv(daemon)) != -1)
     {
       for (h = (struct nlmsghdr *)iov.iov_base; NLMSG_OK(h, (size_t)len); h = NLMSG_NEXT(h, len))
@@ -234,7 +233,6 @@ void netlink_multicast(struct daemon *daemon)
 	else
 	  nl_routechange(daemon, h);
     }
-  my_syslog(LOG_INFO, _("netlink_multicast out out out ***************** !!!"));
 }
 
 static void nl_err(struct nlmsghdr *h)
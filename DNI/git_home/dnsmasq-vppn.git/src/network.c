@@ -541,6 +541,7 @@ struct serverfd *allocate_sfd(union mysockaddr *addr, struct serverfd **sfds)
   sfd->source_addr = *addr;
   sfd->next = *sfds;
   *sfds = sfd;
+  event_add(sfd->fd, EVENT_IN, server_event, sfd);
   
   return sfd;
 }
@@ -625,6 +626,7 @@ void check_servers(struct daemon *daemon)
     }
   
   daemon->servers = ret;
+  domain_trie_build(daemon->servers);
 }
 
 /* Return zero if no servers found, in that case we keep polling.
@@ -720,6 +722,7 @@ int reload_servers(char *fname, struct daemon *daemon)
       serv->source_addr = source_addr;
       serv->domain = NULL;
       serv->sfd = NULL;
+      memset(&serv->stats, 0, sizeof(serv->stats));
       serv->flags = SERV_FROM_RESOLV;
 
       gotone = 1;
@@ -734,6 +737,7 @@ int reload_servers(char *fname, struct daemon *daemon)
     }
 
   daemon->servers = new_servers;
+  domain_trie_build(daemon->servers);
   fclose(f);
 
 /*
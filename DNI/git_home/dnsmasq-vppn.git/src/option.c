@@ -44,6 +44,12 @@ struct myoption {
 #define LOPT_SUBSCR    270
 #define LOPT_INTNAME   271
 #define LOPT_TRY_ALL_NS 272
+#define LOPT_TRACE     273
+#define LOPT_INCR_RELOAD 274
+#define LOPT_CACHE_FILE 275
+#define LOPT_REPLY_CACHE 276
+#define LOPT_HEDGE     277
+#define LOPT_PREFETCH  278
 
 #ifdef DNI_PARENTAL_CTL
 #define LOPT_PARENTAL_CONTROL	901
@@ -130,6 +136,11 @@ static const struct myoption opts[] =
     {"dns-forward-max", 1, 0, '0'},
     {"clear-on-reload", 0, 0, LOPT_RELOAD },
     {"try-all-ns", 0, 0, LOPT_TRY_ALL_NS },
+    {"incremental-reload", 0, 0, LOPT_INCR_RELOAD },
+    {"cache-file", 1, 0, LOPT_CACHE_FILE },
+    {"reply-cache", 1, 0, LOPT_REPLY_CACHE },
+    {"hedge-queries", 2, 0, LOPT_HEDGE },
+    {"prefetch", 2, 0, LOPT_PREFETCH },
     {"dhcp-ignore-names", 2, 0, LOPT_NO_NAMES },
     {"enable-tftp", 0, 0, LOPT_TFTP },
     {"tftp-secure", 0, 0, LOPT_SECURE },
@@ -147,6 +158,9 @@ static const struct myoption opts[] =
     {"dhcp-remoteid", 1, 0, LOPT_REMOTE },
     {"dhcp-subscrid", 1, 0, LOPT_SUBSCR },
     {"interface-name", 1, 0, LOPT_INTNAME },
+#ifdef HAVE_TRACE
+    {"trace", 1, 0, LOPT_TRACE },
+#endif
 #ifdef DNI_PARENTAL_CTL
     {"parental-control", 2, 0, LOPT_PARENTAL_CONTROL},
 #endif
@@ -189,6 +203,7 @@ static const struct optflags optmap[] = {
   { '9',            OPT_LEASE_RO },
   { LOPT_RELOAD,    OPT_RELOAD },
   { LOPT_TRY_ALL_NS,OPT_TRY_ALL_NS },
+  { LOPT_INCR_RELOAD,OPT_INCR_RELOAD },
   { LOPT_TFTP,      OPT_TFTP },
   { LOPT_SECURE,    OPT_TFTP_SECURE },
   { LOPT_NOBLOCK,   OPT_TFTP_NOBLOCK },
@@ -276,6 +291,11 @@ static const struct {
   { "-9, --leasefile-ro", gettext_noop("Read leases at startup, but never write the lease file."), NULL },
   { "-0, --dns-forward-max=<queries>", gettext_noop("Maximum number of concurrent DNS queries. (defaults to %s)"), "!" }, 
   { "    --clear-on-reload", gettext_noop("Clear DNS cache when reloading %s."), RESOLVFILE },
+  { "    --incremental-reload", gettext_noop("Keep the DNS cache on SIGHUP, dropping only what changed hosts files now answer."), NULL },
+  { "    --cache-file=path[,<secs>]", gettext_noop("Keep the DNS cache in path across restarts, saving it every secs (defaults to %s)."), "%" },
+  { "    --reply-cache=<replies>", gettext_noop("Keep this many whole replies built from the cache, to send again as they are."), NULL },
+  { "    --hedge-queries[=<queries>]", gettext_noop("Send queries slow to be answered to a second server, this many at once (defaults to %s)."), "^" },
+  { "    --prefetch[=<queries>]", gettext_noop("Refresh cache entries in use before they expire, this many a second at most (defaults to %s)."), "~" },
   { "    --try-all-ns", gettext_noop("Try all name servers in tandem on NXDOMAIN replies (use with strict-order)."), NULL },
   { "    --dhcp-ignore-names[=<id>]", gettext_noop("Ignore hostnames provided by DHCP clients."), NULL },
   { "    --enable-tftp", gettext_noop("Enable integrated read-only TFTP server."), NULL },
@@ -285,6 +305,9 @@ static const struct {
   { "    --tftp-no-blocksize", gettext_noop("Disable the TFTP blocksize extension."), NULL },
   { "    --log-dhcp", gettext_noop("Extra logging for DHCP."), NULL },
   { "    --log-async[=<log lines>]", gettext_noop("Enable async. logging; optionally set queue length."), NULL },
+#ifdef HAVE_TRACE
+  { "    --trace=<category>[,<category>]", gettext_noop("Log debug traces for answer, hijack or all."), NULL },
+#endif
 #ifdef DNI_PARENTAL_CTL
   { "    --parental-control[=<file>]", gettext_noop("Enable Parental Control and specify deviceid file(default to /tmp/parentalcontrol.conf)."), NULL },
 #endif
@@ -523,6 +546,9 @@ static void do_usage(void)
     { '&', MAXLEASES },
     { '!', FTABSIZ },
     { '#', TFTP_MAX_CONNECTIONS },
+    { '%', CACHE_SAVE },
+    { '^', HEDGE_MAX },
+    { '~', PREFETCH_QPS },
     { '\0', 0 }
   };
 
@@ -1164,6 +1190,7 @@ static char *one_opt(struct daemon *daemon, int option, char *arg, char *problem
 		serv->next = newlist;
 		newlist = serv;
 		serv->sfd = NULL;
+		memset(&serv->stats, 0, sizeof(serv->stats));
 		serv->domain = domain;
 		serv->flags = domain ? SERV_HAS_DOMAIN : SERV_FOR_NODOTS;
 		memset(&serv->addr, 0, sizeof(serv->addr));
@@ -1183,6 +1210,7 @@ static char *one_opt(struct daemon *daemon, int option, char *arg, char *problem
 	    newlist->next = NULL;
 	    newlist->flags = 0;
 	    newlist->sfd = NULL;
+	    memset(&newlist->stats, 0, sizeof(newlist->stats));
 	    newlist->domain = NULL;
 	  }
 	
@@ -1314,6 +1342,43 @@ static char *one_opt(struct daemon *daemon, int option, char *arg, char *problem
 	option = '?';
       break;  
     
+    case LOPT_CACHE_FILE: /* --cache-file */
+      {
+	char *comma = split(arg);
+	
+	daemon->cache_file = safe_string_alloc(arg);
+	if (comma && !atoi_check(comma, &daemon->cache_save))
+	  option = '?';
+	else if (daemon->cache_save < 0)
+	  daemon->cache_save = 0;
+	else if (daemon->cache_save > CACHE_SAVE_MAX)
+	  daemon->cache_save = CACHE_SAVE_MAX;
+	break;
+      }
+
+    case LOPT_REPLY_CACHE: /* --reply-cache */
+      if (!atoi_check(arg, &daemon->reply_cache))
+	option = '?';
+      break;
+
+    case LOPT_HEDGE: /* --hedge-queries */
+      daemon->hedge_max = HEDGE_MAX; /* default */
+      if (arg && (!atoi_check(arg, &daemon->hedge_max) || daemon->hedge_max < 0))
+	{
+	  option = '?';
+	  problem = _("bad number of hedged queries");
+	}
+      break;
+
+    case LOPT_PREFETCH: /* --prefetch */
+      daemon->prefetch = PREFETCH_QPS; /* default */
+      if (arg && (!atoi_check(arg, &daemon->prefetch) || daemon->prefetch < 0))
+	{
+	  option = '?';
+	  problem = _("bad prefetch rate");
+	}
+      break;
+
     case LOPT_MAX_LOGS:  /* --log-async */
       daemon->max_logs = LOG_MAX; /* default */
       if (arg && !atoi_check(arg, &daemon->max_logs))
@@ -2037,6 +2102,41 @@ static char *one_opt(struct daemon *daemon, int option, char *arg, char *problem
 	new->weight = weight;
 	break;
       }
+#ifdef HAVE_TRACE
+    case LOPT_TRACE:
+      {
+	static const struct {
+	  char *name;
+	  unsigned int flag;
+	} cats[] = {
+	  { "answer", TRACE_ANSWER },
+	  { "hijack", TRACE_HIJACK },
+	  { "all", ~0u },
+	  { NULL, 0 }
+	};
+	
+	while (arg)
+	  {
+	    int i;
+	    
+	    comma = split(arg);
+	    for (i = 0; cats[i].name; i++)
+	      if (strcmp(arg, cats[i].name) == 0)
+		break;
+	    
+	    if (!cats[i].name)
+	      {
+		option = '?';
+		problem = _("bad trace category");
+		break;
+	      }
+	    
+	    trace_flags |= cats[i].flag;
+	    arg = comma;
+	  }
+	break;
+      }
+#endif
 #ifdef DNI_PARENTAL_CTL
       case LOPT_PARENTAL_CONTROL:
         {
@@ -2204,6 +2304,7 @@ struct daemon *read_opts(int argc, char **argv, char *compile_opts)
 
   /* Set defaults - everything else is zero or NULL */
   daemon->cachesize = CACHESIZ;
+  daemon->cache_save = CACHE_SAVE;
   daemon->ftabsize = FTABSIZ;
   daemon->port = NAMESERVER_PORT;
   daemon->default_resolv.is_default = 1;
@@ -0,0 +1,394 @@
+/***
+ * Add this file to support Parental Control device tagging.
+ *
+ * When Parental Control is on, each query forwarded to OpenDNS carries an
+ * EDNS0 option "OpenDNS<DeviceID>", where DeviceID is the 8 byte ID set by
+ * the ParentalControl SOAP APIs for the MAC address of the client.
+ *
+ * The client's MAC address comes from an IP -> MAC map which is kept in
+ * step with the kernel's neighbour table by a netlink subscription, and the
+ * DeviceID from a MAC -> DeviceID table read from pc_table_file when it
+ * changes. The whole OPT record is built when the table is read, so that
+ * tagging a query is two hash lookups and a memcpy.
+ */
+
+#include "dnsmasq.h"
+
+#ifdef DNI_PARENTAL_CTL
+
+#include <linux/types.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+
+#ifndef NDA_RTA
+#  define NDA_RTA(r)  \
+       ((struct rtattr*)(((char*)(r)) + NLMSG_ALIGN(sizeof(struct ndmsg))))
+#endif
+
+#define PC_HTONS_CHARS(n) (unsigned char)((n) >> 8), (unsigned char)(n)
+
+#define PC_NEIGH_HASH 256 /* power of 2 */
+#define PC_DEVICE_HASH 64 /* power of 2 */
+#define PC_DEVICEID_LEN 8
+/* OPT RR header, option header, "OpenDNS", DeviceID */
+#define PC_OPT_LEN (11 + 4 + 7 + PC_DEVICEID_LEN)
+
+struct pc_neigh {
+  struct in_addr addr;
+  unsigned char mac[ETHER_ADDR_LEN];
+  struct pc_neigh *next;
+};
+
+struct pc_device {
+  unsigned char mac[ETHER_ADDR_LEN];
+  unsigned char opt[PC_OPT_LEN];
+  struct pc_device *next;
+};
+
+static struct pc_neigh *neigh_hash[PC_NEIGH_HASH];
+static struct pc_device *device_hash[PC_DEVICE_HASH];
+static struct pc_device *device_default = NULL;
+static unsigned char opt_none[PC_OPT_LEN];
+static int neigh_fd = -1;
+static struct file_stamp table_stamp = { 0, 0, 0, 0, 0, 0, -1 }; /* size -1: no table */
+
+static void neigh_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
+
+/* A DeviceID which isn't 16 hex digits, or is "0000111111111111", gets
+   the default ID. */
+static void pc_build_opt(unsigned char *opt, char *deviceid)
+{
+  static const unsigned char head[] = { 0, PC_HTONS_CHARS(T_OPT), PC_HTONS_CHARS(512),
+					0, 0, 0, 0, PC_HTONS_CHARS(PC_OPT_LEN - 11),
+					PC_HTONS_CHARS(4), PC_HTONS_CHARS(7 + PC_DEVICEID_LEN),
+					'O', 'p', 'e', 'n', 'D', 'N', 'S' };
+  static const unsigned char none[PC_DEVICEID_LEN] = { 0x00, 0x00, 0x11, 0x11,
+						       0x11, 0x11, 0x11, 0x11 };
+  unsigned char *id = opt + sizeof(head);
+  int i;
+
+  memcpy(opt, head, sizeof(head));
+  memcpy(id, none, PC_DEVICEID_LEN);
+
+  if (!deviceid || strlen(deviceid) != 2 * PC_DEVICEID_LEN)
+    return;
+
+  for (i = 0; i < 2 * PC_DEVICEID_LEN; i++)
+    if (!isxdigit((unsigned char)deviceid[i]))
+      return;
+
+  for (i = 0; i < PC_DEVICEID_LEN; i++)
+    {
+      unsigned int byte;
+      sscanf(deviceid + 2*i, "%2x", &byte);
+      id[i] = byte;
+    }
+}
+
+static unsigned int pc_neigh_bucket(struct in_addr addr)
+{
+  unsigned int h = ntohl(addr.s_addr);
+
+  return (h ^ (h >> 8)) & (PC_NEIGH_HASH - 1);
+}
+
+static unsigned int pc_device_bucket(unsigned char *mac)
+{
+  return (mac[3] ^ mac[4] ^ mac[5]) & (PC_DEVICE_HASH - 1);
+}
+
+static struct pc_neigh **pc_neigh_find(struct in_addr addr)
+{
+  struct pc_neigh **up;
+
+  for (up = &neigh_hash[pc_neigh_bucket(addr)]; *up; up = &(*up)->next)
+    if ((*up)->addr.s_addr == addr.s_addr)
+      break;
+
+  return up;
+}
+
+static void pc_neigh_flush(void)
+{
+  struct pc_neigh *n, *tmp;
+  int i;
+
+  for (i = 0; i < PC_NEIGH_HASH; i++)
+    {
+      for (n = neigh_hash[i]; n; n = tmp)
+	{
+	  tmp = n->next;
+	  free(n);
+	}
+      neigh_hash[i] = NULL;
+    }
+}
+
+/* Ask for the whole neighbour table: it arrives as RTM_NEWNEIGH messages. */
+static void pc_neigh_dump(void)
+{
+  struct sockaddr_nl addr;
+  struct {
+    struct nlmsghdr nlh;
+    struct ndmsg ndm;
+  } req;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+
+  memset(&req, 0, sizeof(req));
+  req.nlh.nlmsg_len = sizeof(req);
+  req.nlh.nlmsg_type = RTM_GETNEIGH;
+  req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.ndm.ndm_family = AF_INET;
+
+  while (sendto(neigh_fd, (void *)&req, sizeof(req), 0,
+		(struct sockaddr *)&addr, sizeof(addr)) == -1 && retry_send());
+}
+
+void parental_init(struct daemon *daemon)
+{
+  struct sockaddr_nl addr;
+
+  (void)daemon;
+
+  pc_build_opt(opt_none, NULL);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = RTMGRP_NEIGH;
+
+  if ((neigh_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) == -1 ||
+      bind(neigh_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      !fix_fd(neigh_fd))
+    die(_("cannot create netlink socket: %s"), NULL);
+
+  event_add(neigh_fd, EVENT_IN, neigh_event, NULL);
+  pc_neigh_dump();
+}
+
+static void pc_neigh_update(struct nlmsghdr *h)
+{
+  struct ndmsg *ndm = NLMSG_DATA(h);
+  struct rtattr *rta = NDA_RTA(ndm);
+  unsigned int len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+  struct in_addr *dst = NULL;
+  unsigned char *mac = NULL;
+  struct pc_neigh **up, *n;
+
+  if (ndm->ndm_family != AF_INET)
+    return;
+
+  while (RTA_OK(rta, len))
+    {
+      if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == sizeof(struct in_addr))
+	dst = RTA_DATA(rta);
+      else if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == ETHER_ADDR_LEN)
+	mac = RTA_DATA(rta);
+      rta = RTA_NEXT(rta, len);
+    }
+
+  if (!dst)
+    return;
+
+  up = pc_neigh_find(*dst);
+
+  if (h->nlmsg_type == RTM_DELNEIGH || !mac ||
+      (ndm->ndm_state & (NUD_INCOMPLETE | NUD_FAILED)))
+    {
+      if ((n = *up))
+	{
+	  *up = n->next;
+	  free(n);
+	}
+      return;
+    }
+
+  if (!(n = *up))
+    {
+      if (!(n = malloc(sizeof(struct pc_neigh))))
+	return;
+      n->addr = *dst;
+      n->next = NULL;
+      *up = n;
+    }
+
+  memcpy(n->mac, mac, ETHER_ADDR_LEN);
+}
+
+static void neigh_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
+{
+  static char buf[8192];
+  struct nlmsghdr *h;
+  ssize_t len;
+
+  (void)daemon; (void)arg; (void)events; (void)now;
+
+  while (1)
+    {
+      if ((len = recv(fd, buf, sizeof(buf), 0)) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  /* we missed some changes: start again */
+	  if (errno == ENOBUFS)
+	    {
+	      pc_neigh_flush();
+	      pc_neigh_dump();
+	    }
+	  return;
+	}
+
+      for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (size_t)len); h = NLMSG_NEXT(h, len))
+	if (h->nlmsg_type == RTM_NEWNEIGH || h->nlmsg_type == RTM_DELNEIGH)
+	  pc_neigh_update(h);
+    }
+}
+
+static int pc_parse_mac(unsigned char *mac, char *str)
+{
+  unsigned int b[ETHER_ADDR_LEN];
+  int i;
+
+  if (strlen(str) != 2 * ETHER_ADDR_LEN ||
+      sscanf(str, "%2x%2x%2x%2x%2x%2x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ETHER_ADDR_LEN)
+    return 0;
+
+  for (i = 0; i < ETHER_ADDR_LEN; i++)
+    mac[i] = b[i];
+
+  return 1;
+}
+
+static void pc_device_flush(void)
+{
+  struct pc_device *d, *tmp;
+  int i;
+
+  for (i = 0; i < PC_DEVICE_HASH; i++)
+    {
+      for (d = device_hash[i]; d; d = tmp)
+	{
+	  tmp = d->next;
+	  free(d);
+	}
+      device_hash[i] = NULL;
+    }
+
+  free(device_default);
+  device_default = NULL;
+}
+
+/* The table is a single line, "<count>,<MAC> <DeviceID>,<MAC> <DeviceID>...",
+   with MACs as AABBCCDDEEFF, and "default" for the MAC of the DeviceID to
+   use for clients not listed. */
+static void pc_device_load(FILE *fp, off_t size)
+{
+  char *table, *pos, mac_str[13], deviceid[33];
+  struct pc_device *d;
+  int count, loaded = 0;
+
+  if (!(table = malloc(size + 1)))
+    return;
+  table[fread(table, 1, size, fp)] = 0;
+
+  if ((pos = strtok(table, ",")))
+    for (count = atoi(pos); count > 0 && (pos = strtok(NULL, ",")); count--)
+      {
+	unsigned char mac[ETHER_ADDR_LEN];
+
+	if (sscanf(pos, "%12s %32s", mac_str, deviceid) != 2)
+	  continue;
+
+	if (strcasecmp(mac_str, "default") == 0)
+	  {
+	    if (device_default || !(device_default = malloc(sizeof(struct pc_device))))
+	      continue;
+	    d = device_default;
+	  }
+	else if (pc_parse_mac(mac, mac_str))
+	  {
+	    unsigned int bucket = pc_device_bucket(mac);
+
+	    for (d = device_hash[bucket]; d; d = d->next)
+	      if (memcmp(d->mac, mac, ETHER_ADDR_LEN) == 0)
+		break;
+	    /* first entry for a MAC wins */
+	    if (d || !(d = malloc(sizeof(struct pc_device))))
+	      continue;
+	    memcpy(d->mac, mac, ETHER_ADDR_LEN);
+	    d->next = device_hash[bucket];
+	    device_hash[bucket] = d;
+	  }
+	else
+	  continue;
+
+	pc_build_opt(d->opt, deviceid);
+	loaded++;
+      }
+
+  free(table);
+  my_syslog(LOG_INFO, _("read %s - %d devices"), pc_table_file, loaded);
+}
+
+/* Called once a second from the main loop: reload the table if it has changed. */
+void parental_check_table(void)
+{
+  struct stat statbuf;
+  FILE *fp;
+
+  if (stat(pc_table_file, &statbuf) == -1)
+    {
+      if (table_stamp.size != -1)
+	{
+	  pc_device_flush();
+	  table_stamp.size = -1;
+	}
+      return;
+    }
+
+  if (file_unchanged(&table_stamp, &statbuf))
+    return;
+
+  pc_device_flush();
+  file_stamp(&table_stamp, &statbuf);
+
+  if ((fp = fopen(pc_table_file, "r")))
+    {
+      pc_device_load(fp, statbuf.st_size);
+      fclose(fp);
+    }
+}
+
+/* Add the OPT record carrying the client's DeviceID to the end of the
+   query. Clients we have no MAC for get the default ID, and clients not
+   in the table the one for "default", if there is one. */
+void parental_tag_query(HEADER *header, char *limit, size_t *n, union mysockaddr *source)
+{
+  unsigned char *opt = opt_none;
+  struct pc_neigh *neigh;
+
+  if ((char *)header + *n + PC_OPT_LEN > limit)
+    return;
+
+  if (source->sa.sa_family == AF_INET && (neigh = *pc_neigh_find(source->in.sin_addr)))
+    {
+      struct pc_device *d;
+
+      for (d = device_hash[pc_device_bucket(neigh->mac)]; d; d = d->next)
+	if (memcmp(d->mac, neigh->mac, ETHER_ADDR_LEN) == 0)
+	  break;
+
+      if (d)
+	opt = d->opt;
+      else if (device_default)
+	opt = device_default->opt;
+    }
+
+  header->arcount = htons(1);
+  memcpy((char *)header + *n, opt, PC_OPT_LEN);
+  *n += PC_OPT_LEN;
+}
+
+#endif
@@ -0,0 +1,152 @@
+/* dnsmasq is Copyright (c) 2000-2007 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include "dnsmasq.h"
+
+/* --prefetch: cache entries from upstream count the answers given from
+   them. Once one has given PREFETCH_HITS and is in the last
+   PREFETCH_PERCENT of its TTL, the question it answered is asked upstream
+   again, so the new answer is in the cache before the old one goes and
+   nobody has to wait for it.
+
+   The refresh can't go out while answer_request() has the packet buffer,
+   so it is queued and sent from a timer, by forward_refresh(), as a
+   forwarded query with nobody to send the reply to. At most the number
+   given go each second. Entries which a refresh put in are marked, to
+   count those used against those which went unused. */
+
+static struct {
+  char *name;
+  unsigned short qtype;
+} queue[PREFETCH_QUEUE];
+
+static int qps, queued, refreshing;
+static struct crec *due;
+static time_t filled;
+static int tokens;
+static struct timer prefetch_timer;
+static unsigned long prefetch_sent, prefetch_budget, prefetch_fetched, prefetch_used, prefetch_wasted;
+
+void prefetch_init(int rate)
+{
+  qps = tokens = rate;
+}
+
+void prefetch_start(void)
+{
+  due = NULL;
+}
+
+/* An answer is being given from crecp. */
+void prefetch_note(struct crec *crecp, time_t now)
+{
+  time_t left = crecp->ttd - now;
+
+  if (qps == 0 || (crecp->flags & (F_IMMORTAL | F_HOSTS | F_DHCP)))
+    return;
+
+  if (crecp->hits != 0xffff)
+    crecp->hits++;
+
+  if (crecp->prefetch == PREFETCH_FETCHED)
+    {
+      crecp->prefetch = 0;
+      prefetch_used++;
+    }
+
+  if (!due && crecp->prefetch != PREFETCH_ASKED && crecp->hits >= PREFETCH_HITS && left > 0 &&
+      (left <= 1 || left * 100 <= (time_t)crecp->ttl * PREFETCH_PERCENT))
+    due = crecp;
+}
+
+static void prefetch_run(struct daemon *daemon, void *arg, time_t now)
+{
+  int i, n = queued;
+
+  (void)arg;
+  queued = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      forward_refresh(daemon, queue[i].name, queue[i].qtype, now);
+      prefetch_sent++;
+    }
+}
+
+/* The answer to question is done: ask it again if an entry it used is due. */
+void prefetch_end(struct question *question, time_t now)
+{
+  struct crec *crecp = due;
+
+  if (!crecp)
+    return;
+  due = NULL;
+
+  if (!question->flags || question->qclass != C_IN ||
+      (question->qtype != T_A && question->qtype != T_AAAA && question->qtype != T_PTR))
+    return;
+
+  /* the budget holds a second's worth */
+  if (now != filled)
+    {
+      tokens = qps;
+      filled = now;
+    }
+
+  if (question->namelen >= MAXDNAME)
+    return;
+
+  if (tokens == 0 || queued == PREFETCH_QUEUE ||
+      (!queue[queued].name && !(queue[queued].name = malloc(MAXDNAME))))
+    {
+      prefetch_budget++;
+      return;
+    }
+
+  tokens--;
+  crecp->prefetch = PREFETCH_ASKED;
+  memcpy(queue[queued].name, question->name, question->namelen + 1);
+  queue[queued].qtype = question->qtype;
+  if (queued++ == 0)
+    timer_add(&prefetch_timer, 0, prefetch_run, NULL);
+}
+
+/* The reply being put in the cache is to a refresh, or isn't. */
+void prefetch_reply(int on)
+{
+  refreshing = on;
+}
+
+void prefetch_inserted(struct crec *crecp)
+{
+  crecp->hits = 0;
+  crecp->prefetch = 0;
+  if (refreshing)
+    {
+      crecp->prefetch = PREFETCH_FETCHED;
+      prefetch_fetched++;
+    }
+}
+
+void prefetch_freed(struct crec *crecp)
+{
+  if (crecp->prefetch == PREFETCH_FETCHED)
+    prefetch_wasted++;
+  crecp->prefetch = 0;
+}
+
+void prefetch_stats(void)
+{
+  if (qps != 0)
+    my_syslog(LOG_INFO, _("prefetch: %lu refreshes sent, %lu over budget, %lu entries refreshed, %lu used, %lu unused"),
+	      prefetch_sent, prefetch_budget, prefetch_fetched, prefetch_used, prefetch_wasted);
+}
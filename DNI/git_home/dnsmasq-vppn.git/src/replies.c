@@ -0,0 +1,314 @@
+/* dnsmasq is Copyright (c) 2000-2007 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include "dnsmasq.h"
+
+/* --reply-cache: the answers which answer_request() builds from the cache
+   are kept as they go on the wire, so that the next query with the same
+   question only needs them copied in after its own header and question,
+   which are the same length. Compression pointers all point back into
+   the question, so they hold.
+
+   A reply remembers the cache entries it was built from and their uids,
+   which cache_free() changes, so it goes when any of them does.
+   Reloading the hosts files or DHCP names changes the generation, which
+   drops them all. The TTLs are set from the entries on the way out, and
+   a run of more than one address is rotated, for round-robin as the
+   cache does it.
+
+   The table is direct-mapped on the CRC of the question: a new reply
+   replaces whatever was in its slot. */
+
+#define REPLY_DEPS 32 /* RRs in a reply which can be kept */
+#define REPLY_NO_TTL 0xffff
+
+struct reply_dep {
+  struct crec *crecp;
+  int uid;
+  unsigned short ttl_at; /* offset of the TTL it sets, or REPLY_NO_TTL */
+};
+
+struct reply {
+  unsigned int crc, generation, turn;
+  time_t expires; /* when the first entry does */
+  unsigned short qtype, do_bit, aa, rcode;
+  unsigned short len, ancount, deps;
+  unsigned short rr_first, rr_count, rr_size; /* addresses to rotate */
+  char *name;
+  unsigned char *data; /* what goes after the question */
+  struct reply_dep dep[];
+};
+
+static struct reply **replies = NULL;
+static unsigned int reply_mask, generation;
+static unsigned long reply_hits, reply_stored;
+
+/* what answer_request() is building */
+static struct {
+  int skip, deps;
+  unsigned char *last; /* end of the last address RR */
+  unsigned short last_family;
+  unsigned short cur_first, cur_count, cur_size; /* the run of addresses going */
+  unsigned short rr_first, rr_count, rr_size; /* the one to rotate */
+  time_t expires;
+  struct reply_dep dep[REPLY_DEPS];
+  unsigned char *rr[REPLY_DEPS];
+} building;
+
+void reply_init(int size)
+{
+  unsigned int slots;
+
+  if (size <= 0)
+    return;
+
+  for (slots = 1; slots < (unsigned int)size; slots <<= 1);
+
+  replies = safe_malloc(slots * sizeof(struct reply *));
+  memset(replies, 0, slots * sizeof(struct reply *));
+  reply_mask = slots - 1;
+}
+
+/* The hosts files or DHCP names changed: nothing kept can be trusted. */
+void reply_flush(void)
+{
+  generation++;
+}
+
+void reply_start(void)
+{
+  building.skip = building.deps = 0;
+  building.last = NULL;
+  building.cur_count = building.rr_count = 0;
+  building.expires = 0;
+}
+
+/* something in the answer which isn't from the cache */
+void reply_skip(void)
+{
+  building.skip = 1;
+}
+
+/* The end of a run of addresses: only one of them can be rotated. */
+static void reply_run_end(void)
+{
+  if (building.cur_count > 1)
+    {
+      if (building.rr_count != 0)
+	building.skip = 1;
+      building.rr_first = building.cur_first;
+      building.rr_count = building.cur_count;
+      building.rr_size = building.cur_size;
+    }
+  building.cur_count = 0;
+}
+
+/* The entry crecp is about to go in as the RR at p, or adds nothing to
+   the answer if p is NULL. */
+void reply_note(struct crec *crecp, unsigned char *p)
+{
+  struct reply_dep *d;
+  unsigned short family = crecp->flags & (F_IPV4 | F_IPV6);
+
+  if (!replies || building.skip)
+    return;
+
+  if (building.deps == REPLY_DEPS)
+    {
+      building.skip = 1;
+      return;
+    }
+
+  d = &building.dep[building.deps];
+  d->crecp = crecp;
+  d->uid = crecp->uid;
+  d->ttl_at = REPLY_NO_TTL;
+  building.rr[building.deps++] = p;
+
+  if (!(crecp->flags & (F_IMMORTAL | F_DHCP)))
+    {
+      if (building.expires == 0 || crecp->ttd < building.expires)
+	building.expires = crecp->ttd;
+      if (p)
+	d->ttl_at = 0; /* the offset is known in reply_store() */
+    }
+
+  if (!p)
+    return;
+
+  if ((crecp->flags & F_FORWARD) && !(crecp->flags & (F_CNAME | F_NEG)))
+    {
+      unsigned short size = 12 + ((family == F_IPV6) ? IN6ADDRSZ : INADDRSZ);
+
+      if (building.cur_count != 0 && building.last == p && building.last_family == family)
+	building.cur_count++;
+      else
+	{
+	  reply_run_end();
+	  building.cur_first = building.deps - 1;
+	  building.cur_count = 1;
+	  building.cur_size = size;
+	}
+      building.last = p + size;
+      building.last_family = family;
+    }
+  else
+    reply_run_end();
+}
+
+/* Keep the answer to question which answer_request() has just built. */
+void reply_store(HEADER *header, size_t len, struct question *question, int sec_reqd)
+{
+  unsigned char *data = question->qend;
+  size_t dlen = (unsigned char *)header + len - data;
+  struct reply *r, **slot;
+  int i;
+
+  reply_run_end();
+
+  if (!replies || building.skip || !question->flags || header->tc ||
+      question->qclass != C_IN ||
+      (question->qtype != T_A && question->qtype != T_AAAA && question->qtype != T_PTR) ||
+      building.deps == 0 || dlen > 0xffff)
+    return;
+
+  if (!(r = malloc(sizeof(struct reply) + building.deps * sizeof(struct reply_dep) +
+		   question->namelen + 1 + dlen)))
+    return;
+
+  r->crc = question->crc;
+  r->generation = generation;
+  r->turn = 0;
+  r->expires = building.expires;
+  r->qtype = question->qtype;
+  r->do_bit = sec_reqd != 0;
+  r->aa = header->aa;
+  r->rcode = header->rcode;
+  r->len = dlen;
+  r->ancount = ntohs(header->ancount);
+  r->deps = building.deps;
+  r->rr_count = 0;
+  r->name = (char *)&r->dep[r->deps];
+  r->data = (unsigned char *)r->name + question->namelen + 1;
+  memcpy(r->name, question->name, question->namelen + 1);
+  memcpy(r->data, data, dlen);
+
+  for (i = 0; i < building.deps; i++)
+    {
+      r->dep[i] = building.dep[i];
+      if (r->dep[i].ttl_at != REPLY_NO_TTL)
+	r->dep[i].ttl_at = building.rr[i] - data + 6; /* after the name, type and class */
+    }
+
+  if (building.rr_count > 1)
+    {
+      r->rr_first = building.rr[building.rr_first] - data;
+      r->rr_count = building.rr_count;
+      r->rr_size = building.rr_size;
+    }
+
+  slot = &replies[question->crc & reply_mask];
+  free(*slot);
+  *slot = r;
+  reply_stored++;
+}
+
+/* Answer the query in header from a kept reply, returning its length, or
+   zero if there isn't a good one. */
+size_t reply_find(HEADER *header, char *limit, struct question *question, time_t now)
+{
+  struct reply *r;
+  unsigned char *p = question->qend, *rrs;
+  int i, sec_reqd = 0;
+
+  if (!replies || !question->flags || !p || question->qclass != C_IN)
+    return 0;
+
+  if (!(r = replies[question->crc & reply_mask]) ||
+      r->crc != question->crc || r->qtype != question->qtype ||
+      r->generation != generation || (r->expires != 0 && r->expires <= now) ||
+      (size_t)((unsigned char *)limit - p) < r->len ||
+      !hostname_isequal(r->name, question->name))
+    return 0;
+
+  if (question->pheader)
+    {
+      unsigned char *flagp = question->udpsz + 4;
+      unsigned short flags;
+
+      GETSHORT(flags, flagp);
+      sec_reqd = (flags & 0x8000) != 0;
+    }
+
+  if (sec_reqd != r->do_bit)
+    return 0;
+
+  for (i = 0; i < r->deps; i++)
+    if (r->dep[i].crecp->uid != r->dep[i].uid ||
+	!(r->dep[i].crecp->flags & (F_FORWARD | F_REVERSE)))
+      return 0;
+
+  prefetch_start();
+  for (i = 0; i < r->deps; i++)
+    prefetch_note(r->dep[i].crecp, now);
+  prefetch_end(question, now);
+
+  memcpy(p, r->data, r->len);
+
+  for (i = 0; i < r->deps; i++)
+    if (r->dep[i].ttl_at != REPLY_NO_TTL)
+      {
+	unsigned char *ttlp = p + r->dep[i].ttl_at;
+	unsigned long ttl = r->dep[i].crecp->ttd - now;
+
+	PUTLONG(ttl, ttlp);
+      }
+
+  if (r->rr_count > 1 && (i = r->turn++ % r->rr_count) != 0)
+    {
+      /* start from the i'th: move the ones before it to the end */
+      size_t head = i * r->rr_size, all = r->rr_count * r->rr_size;
+
+      rrs = p + r->rr_first;
+      memcpy(rrs, r->data + r->rr_first + head, all - head);
+      memcpy(rrs + all - head, r->data + r->rr_first, head);
+      for (i = 0; i < r->deps; i++)
+	if (r->dep[i].ttl_at != REPLY_NO_TTL &&
+	    r->dep[i].ttl_at >= r->rr_first && r->dep[i].ttl_at < r->rr_first + all)
+	  {
+	    size_t at = r->dep[i].ttl_at - r->rr_first;
+	    unsigned char *ttlp = rrs + (at >= head ? at - head : at + all - head);
+	    unsigned long ttl = r->dep[i].crecp->ttd - now;
+
+	    PUTLONG(ttl, ttlp);
+	  }
+    }
+
+  header->qr = 1;
+  header->aa = r->aa;
+  header->ra = 1;
+  header->tc = 0;
+  header->rcode = r->rcode;
+  header->ancount = htons(r->ancount);
+  header->nscount = htons(0);
+  header->arcount = htons(0);
+  reply_hits++;
+
+  return p + r->len - (unsigned char *)header;
+}
+
+void reply_stats(void)
+{
+  if (replies)
+    my_syslog(LOG_INFO, _("reply cache: %lu answers kept, %lu queries answered from them"),
+	      reply_stored, reply_hits);
+}
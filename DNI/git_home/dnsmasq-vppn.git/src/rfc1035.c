@@ -18,6 +18,9 @@ static int add_resource_record(HEADER *header, char *limit, int *truncp,
 			       unsigned long ttl, unsigned int *offset, unsigned short type, 
 			       unsigned short class, char *format, ...);
 
+/* for dump_question_stats() */
+static unsigned long questions_decoded = 0, names_decoded = 0;
+
 int extract_name(HEADER *header, size_t plen, unsigned char **pp,
                        char *name, int isExtract)
 {
@@ -26,7 +29,10 @@ int extract_name(HEADER *header, size_t plen, unsigned char **pp,
   int retvalue = 1;
   
   if (isExtract)
-    *cp = 0;
+    {
+      *cp = 0;
+      names_decoded++;
+    }
 
   while ((l = *p++))
     {
@@ -384,6 +390,68 @@ static unsigned char *skip_section(unsigned char *ansp, int count, HEADER *heade
   return ansp;
 }
 
+/* CRC-32, most significant bit first, a table at a time: crc_table[k][n]
+   is the CRC of byte n followed by k zero bytes, so eight bytes can be
+   folded in with eight lookups ("slicing-by-8"). Made on first use. */
+static unsigned int crc_table[8][256];
+static int crc_table_made = 0;
+
+static void crc_make_table(void)
+{
+  unsigned int n, k, crc;
+
+  for (n = 0; n < 256; n++)
+    {
+      crc = n << 24;
+      for (k = 0; k < 8; k++)
+	crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+      crc_table[0][n] = crc;
+    }
+
+  for (n = 0; n < 256; n++)
+    for (k = 1; k < 8; k++)
+      crc_table[k][n] = (crc_table[k-1][n] << 8) ^ crc_table[0][crc_table[k-1][n] >> 24];
+
+  crc_table_made = 1;
+}
+
+#define crc_byte(crc, c) (((crc) << 8) ^ crc_table[0][((crc) >> 24) ^ (unsigned char)(c)])
+#define crc_fold(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + 'a' - 'A' : (c))
+
+/* CRC len bytes of name, ignoring case */
+static unsigned int crc_name(unsigned int crc, char *name, size_t len)
+{
+  unsigned char *p = (unsigned char *)name;
+  unsigned int b0, b1, b2, b3;
+
+  if (!crc_table_made)
+    crc_make_table();
+
+  for (; len >= 8; len -= 8, p += 8)
+    {
+      b0 = crc_fold(p[0]); b1 = crc_fold(p[1]); b2 = crc_fold(p[2]); b3 = crc_fold(p[3]);
+      crc ^= (b0 << 24) | (b1 << 16) | (b2 << 8) | b3;
+      crc = crc_table[7][crc >> 24] ^ crc_table[6][(crc >> 16) & 0xff] ^
+	crc_table[5][(crc >> 8) & 0xff] ^ crc_table[4][crc & 0xff] ^
+	crc_table[3][crc_fold(p[4])] ^ crc_table[2][crc_fold(p[5])] ^
+	crc_table[1][crc_fold(p[6])] ^ crc_table[0][crc_fold(p[7])];
+    }
+
+  for (; len != 0; len--, p++)
+    crc = crc_byte(crc, crc_fold(*p));
+
+  return crc;
+}
+
+/* and the type and class which follow it */
+static unsigned int crc_type_class(unsigned int crc, unsigned char *p)
+{
+  crc = crc_byte(crc, p[0]);
+  crc = crc_byte(crc, p[1]);
+  crc = crc_byte(crc, p[2]);
+  return crc_byte(crc, p[3]);
+}
+
 /* CRC the question section. This is used to safely detect query 
    retransmision and to detect answers to questions we didn't ask, which 
    might be poisoning attacks. Note that we decode the name rather 
@@ -394,34 +462,17 @@ unsigned int questions_crc(HEADER *header, size_t plen, char *name)
 {
   int q;
   unsigned int crc = 0xffffffff;
-  unsigned char *p1, *p = (unsigned char *)(header+1);
+  unsigned char *p = (unsigned char *)(header+1);
 
   for (q = 0; q < ntohs(header->qdcount); q++) 
     {
       if (!extract_name(header, plen, &p, name, 1))
 	return crc; /* bad packet */
       
-      for (p1 = (unsigned char *)name; *p1; p1++)
-	{
-	  int i = 8;
-	  char c = *p1;
-
-	  if (c >= 'A' && c <= 'Z')
-	    c += 'a' - 'A';
-
-	  crc ^= c << 24;
-	  while (i--)
-	    crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
-	}
+      crc = crc_name(crc, name, strlen(name));
       
       /* CRC the class and type as well */
-      for (p1 = p; p1 < p+4; p1++)
-	{
-	  int i = 8;
-	  crc ^= *p1 << 24;
-	  while (i--)
-	    crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
-	}
+      crc = crc_type_class(crc, p);
 
       p += 4;
       if ((unsigned int)(p - (unsigned char *)header) > plen)
@@ -839,6 +890,27 @@ void extract_addresses(HEADER *header, size_t qlen, char *name, time_t now, stru
    return F_IPV4 or F_IPV6  and leave the name from the query in name. 
    Abuse F_BIGNAME to indicate an NS query - yuck. */
 
+static unsigned short question_flags(int qtype, int qclass)
+{
+  if (qclass == C_IN)
+    {
+      if (qtype == T_A)
+	return F_IPV4;
+      if (qtype == T_AAAA)
+	return F_IPV6;
+#ifdef DNI_IPV6_FEATURE
+      if (qtype == T_A6)
+	return F_IPV6;
+#endif
+      if (qtype == T_ANY)
+	return  F_IPV4 | F_IPV6;
+      if (qtype == T_NS || qtype == T_SOA)
+	return F_QUERY | F_BIGNAME;
+    }
+  
+  return F_QUERY;
+}
+
 unsigned short extract_request(HEADER *header, size_t qlen, char *name, unsigned short *typep)
 {
   unsigned char *p = (unsigned char *)(header+1);
@@ -859,23 +931,71 @@ unsigned short extract_request(HEADER *header, size_t qlen, char *name, unsigned
   if (typep)
     *typep = qtype;
 
-  if (qclass == C_IN)
+  return question_flags(qtype, qclass);
+}
+
+/* Decode the question section of a packet, once, for everything which
+   needs it: what extract_request(), questions_crc() and find_pseudoheader()
+   would find, plus where the labels of the name start. Returns q->flags. */
+unsigned short decode_question(HEADER *header, size_t plen, struct question *q)
+{
+  unsigned char *p = (unsigned char *)(header+1);
+  char *cp;
+
+  questions_decoded++;
+
+  q->flags = q->qtype = q->qclass = 0;
+  q->namelen = q->labels = 0;
+  q->qend = q->udpsz = NULL;
+  q->pheader_len = 0;
+  q->pheader = find_pseudoheader(header, plen, &q->pheader_len, &q->udpsz, &q->is_sign);
+
+  if (ntohs(header->qdcount) != 1)
     {
-      if (qtype == T_A)
-	return F_IPV4;
-      if (qtype == T_AAAA)
-	return F_IPV6;
-#ifdef DNI_IPV6_FEATURE
-      if (qtype == T_A6)
-	return F_IPV6;
-#endif
-      if (qtype == T_ANY)
-	return  F_IPV4 | F_IPV6;
-      if (qtype == T_NS || qtype == T_SOA)
-	return F_QUERY | F_BIGNAME;
+      q->crc = questions_crc(header, plen, q->name);
+      q->name[0] = 0;
+      q->qend = skip_questions(header, plen);
+      return 0;
     }
   
-  return F_QUERY;
+  q->crc = 0xffffffff;
+  if (!extract_name(header, plen, &p, q->name, 1))
+    {
+      q->name[0] = 0;
+      return 0; /* bad packet */
+    }
+
+  for (cp = q->name; *cp; cp++)
+    if (cp == q->name || *(cp-1) == '.')
+      {
+	if (q->labels < MAXLABELS)
+	  q->label[q->labels] = cp - q->name;
+	q->labels++;
+      }
+  q->namelen = cp - q->name;
+
+  q->crc = crc_type_class(crc_name(q->crc, q->name, q->namelen), p);
+
+  GETSHORT(q->qtype, p); 
+  GETSHORT(q->qclass, p);
+  
+  if ((size_t)(p - (unsigned char *)header) > plen)
+    return 0; /* bad packet */
+
+  q->qend = p;
+
+  if (header->opcode == QUERY)
+    q->flags = question_flags(q->qtype, q->qclass);
+
+  return q->flags;
+}
+
+void dump_question_stats(void)
+{
+  unsigned long avg = questions_decoded ? (names_decoded * 100) / questions_decoded : 0;
+
+  my_syslog(LOG_INFO, _("packets: %lu questions decoded, %lu names decoded in all (average %lu.%02lu per question)"),
+	    questions_decoded, names_decoded, avg / 100, avg % 100);
 }
 
 
@@ -1114,7 +1234,7 @@ int get_lan_linklocal_ipaddr6(struct in6_addr *inp6, int global_flag)
 	int count;
 
 	if (!inp6) {
-		printf("get_lan_linklocal_ipaddr6: inp6 can't be NULL!\n");
+		my_syslog(LOG_ERR, "get_lan_linklocal_ipaddr6: inp6 can't be NULL!");
 		return -1;
 	}
 
@@ -1190,67 +1310,108 @@ int get_lan_linklocal_ipaddr6(struct in6_addr *inp6, int global_flag)
 	return 0;
 }
 
-typedef struct extender_record_t{
-    char hostname[128];
-    char ip[32];
-} extender_record;
+/* The extenders found by mDNS, from /tmp/mdns_a_record: one
+   "<hostname> <ip>" per line. Held in memory and re-read by
+   check_extender_records() when the file changes, since answer_request()
+   looks at it for every query. */
+#define EXTENDER_FILE "/tmp/mdns_a_record"
+
+struct extender_record {
+  char hostname[128];
+  size_t len;
+  int addr_ok; /* ip was a valid IPv4 address */
+  struct in_addr addr;
+};
 
-char * strtolwr(const char * inp)
+static struct extender_record *extenders = NULL;
+static int extender_count = 0, extender_max = 0;
+static struct file_stamp extender_stamp = { 0, 0, 0, 0, 0, 0, -1 }; /* size -1: no file */
+
+void check_extender_records(void)
 {
-    char * tmp1, *tmp2;
-    tmp1 = strdup(inp);
-    tmp2 = tmp1;
-    while(*tmp2 != '\0')
+  struct stat statbuf;
+  struct extender_record *new;
+  FILE *fp;
+  char line[256], *name, *ip;
+
+  if (stat(EXTENDER_FILE, &statbuf) == -1)
     {
-        if( *tmp2 >= 'A' && *tmp2 <= 'Z')
-            *tmp2 += 'a' - 'A';
-        tmp2++;
+      if (extender_stamp.size != -1)
+	{
+	  extender_count = 0;
+	  extender_stamp.size = -1;
+	}
+      return;
     }
-    return tmp1;
-}
 
-static int deal_extender_hijack(extender_record * now_record, const char * name_in, int qtype, int qclass)
-{
-    FILE * fp;
-    char line[256] = {0};
-    char * delim=" \n";
-    char * tmp_name = NULL;
-    int  flag_extender_hijack=0 ;
+  if (file_unchanged(&extender_stamp, &statbuf))
+    return;
+
+  file_stamp(&extender_stamp, &statbuf);
+  extender_count = 0;
+  
+  if (!(fp = fopen(EXTENDER_FILE, "r")))
+    return;
 
-    if((fp = fopen("/tmp/mdns_a_record", "r")) == NULL)
+  while (fgets(line, sizeof(line), fp))
     {
-        printf("open mdns_a_record file error\n");
-        return 0;
+      struct extender_record *r;
+      
+      if (!(name = strtok(line, " \n")) || !(ip = strtok(NULL, " \n")))
+	continue;
+      
+      if (extender_count == extender_max)
+	{
+	  if (!(new = realloc(extenders, (extender_max + 8) * sizeof(struct extender_record))))
+	    break;
+	  extenders = new;
+	  extender_max += 8;
+	}
+      
+      r = &extenders[extender_count++];
+      strncpy(r->hostname, name, sizeof(r->hostname) - 1);
+      r->hostname[sizeof(r->hostname) - 1] = 0;
+      r->len = strlen(r->hostname);
+      r->addr_ok = inet_pton(AF_INET, ip, &r->addr) > 0;
     }
 
-    tmp_name = strtolwr(name_in); /*notice :  must free tmp_name due to strdup*/
-    printf("===after strtolwr= %s=======\n", tmp_name);
+  fclose(fp);
+}
 
-    while((fgets(line, 256, fp)) != NULL)
-    {
-        strncpy(now_record->hostname, strtok(line, delim), sizeof(now_record->hostname));
-        strncpy(now_record->ip, strtok(NULL, delim), sizeof(now_record->ip));
-        printf("INPUT=======hostname = %s, ip = %s=======\n", now_record->hostname, now_record->ip);
-        //printf("hostname=%s ip=%s\n", er->hostname, er->ip);
-        if ((strstr(tmp_name, now_record->hostname)) != NULL) {
+/* The first extender whose hostname appears in the (case-folded) query
+   name, if any. */
+static struct extender_record *deal_extender_hijack(const char *name_in, int qtype, int qclass)
+{
+  char name[MAXDNAME];
+  size_t len;
+  int i;
+
+  if (extender_count == 0)
+    return NULL;
+
+  for (len = 0; name_in[len] && len < sizeof(name) - 1; len++)
+    name[len] = tolower((unsigned char)name_in[len]);
+  name[len] = 0;
+
+  for (i = 0; i < extender_count; i++)
+    if (extenders[i].len <= len && strstr(name, extenders[i].hostname))
+      {
 #ifdef HAVE_IPV6
-            if ((qtype != T_A && qtype != T_AAAA && qtype != T_A6) || qclass != C_IN)
-                return 0;//We would do nothing for this kind of request.
+	if ((qtype != T_A && qtype != T_AAAA && qtype != T_A6) || qclass != C_IN)
+	  return NULL;//We would do nothing for this kind of request.
+#else
+	(void)qtype; (void)qclass;
 #endif
-            printf("FIND=======hostname = %s, ip = %s=======\n", now_record->hostname, now_record->ip);
-            flag_extender_hijack = 1;
-            break;
-        }
-    }
+	return &extenders[i];
+      }
 
-    free(tmp_name);
-    fclose(fp);
-    return flag_extender_hijack;
+  return NULL;
 }
 
 /* return zero if we can't answer from cache, or packet size if we can , or -1 if we don't want to reply or forward it.*/
-size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *daemon, 
-		      struct in_addr local_addr, struct in_addr local_netmask, time_t now) 
+size_t answer_request(HEADER *header, char *limit, size_t qlen, struct question *question,
+		      struct daemon *daemon, struct in_addr local_addr, 
+		      struct in_addr local_netmask, time_t now) 
 {
   char *name = daemon->namebuff;
   unsigned char *p, *ansp, *pheader;
@@ -1261,13 +1422,11 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
   int qdcount = ntohs(header->qdcount); 
   int q, ans, anscount = 0, addncount = 0;
   int dryrun = 0, sec_reqd = 0;
-  int is_sign;
   struct crec *crecp;
   int nxdomain = 0, auth = 1, trunc = 0;
   struct mx_srv_record *rec;
   int hijack_extender_flag = 0;
-  unsigned long extender_ip = 0;
-  extender_record hijack_extender_hostname;
+  struct extender_record *extender = NULL;
  
   /* If there is an RFC2671 pseudoheader then it will be overwritten by
      partial replies, so we have to do a dry run to see if we can answer
@@ -1275,11 +1434,11 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
      forward rather than answering from the cache, which doesn't include
      security information. */
 
-  printf("=======enter answer_request=======\n");
-  if (find_pseudoheader(header, qlen, NULL, &pheader, &is_sign))
+  TRACE(TRACE_ANSWER, "enter answer_request");
+  if (question->pheader)
     { 
       unsigned short udpsz, ext_rcode, flags;
-      unsigned char *psave = pheader;
+      unsigned char *psave = pheader = question->udpsz;
 
       GETSHORT(udpsz, pheader);
       GETSHORT(ext_rcode, pheader);
@@ -1291,7 +1450,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 	 than we allow, trim it so that we don't get an overlarge
 	 response from upstream */
 
-      if (!is_sign && (udpsz > daemon->edns_pktsz))
+      if (!question->is_sign && (udpsz > daemon->edns_pktsz))
 	PUTSHORT(daemon->edns_pktsz, psave); 
 
       dryrun = 1;
@@ -1302,10 +1461,13 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
   
   for (rec = daemon->mxnames; rec; rec = rec->next)
     rec->offset = 0;
+
+  reply_start();
+  prefetch_start();
   
  rerun:
   /* determine end of question section (we put answers there) */
-  if (!(ansp = skip_questions(header, qlen)))
+  if (!(ansp = question->qend))
     return 0; /* bad packet */
    
   /* now process each question, answers go in RRs after the question */
@@ -1316,12 +1478,23 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
       /* save pointer to name for copying into answers */
       nameoffset = p - (unsigned char *)header;
 
-      /* now extract name as .-concatenated string into name */
-      if (!extract_name(header, qlen, &p, name, 1))
-	return 0; /* bad packet */
-            
-      GETSHORT(qtype, p); 
-      GETSHORT(qclass, p);
+      /* now extract name as .-concatenated string into name; the usual
+	 single question has been decoded already, but CNAMEs overwrite it */
+      if (question->flags)
+	{
+	  memcpy(name, question->name, question->namelen + 1);
+	  qtype = question->qtype;
+	  qclass = question->qclass;
+	  p = question->qend;
+	}
+      else
+	{
+	  if (!extract_name(header, qlen, &p, name, 1))
+	    return 0; /* bad packet */
+	  
+	  GETSHORT(qtype, p); 
+	  GETSHORT(qclass, p);
+	}
 
       ans = 0; /* have we answered this question */
       
@@ -1367,6 +1540,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 	      if (intr)
 		{
 		  ans = 1;
+		  reply_skip();
 		  if (!dryrun)
 		    {
 		      log_query(F_IPV4 | F_REVERSE | F_CONFIG, intr->name, &addr, 0, NULL, 0);
@@ -1379,6 +1553,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 	      else if (ptr)
 		{
 		  ans = 1;
+		  reply_skip();
 		  if (!dryrun)
 		    {
 		      log_query(F_CNAME | F_FORWARD | F_CONFIG | F_BIGNAME, name, NULL, 0, NULL, 0);
@@ -1405,7 +1580,11 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 			if (crecp->flags & F_NXDOMAIN)
 			  nxdomain = 1;
 			if (!dryrun)
-			  log_query(crecp->flags & ~F_FORWARD, name, &addr, 0, NULL, 0);
+			  {
+			    log_query(crecp->flags & ~F_FORWARD, name, &addr, 0, NULL, 0);
+			    reply_note(crecp, NULL);
+			    prefetch_note(crecp, now);
+			  }
 		      }
 		    else if ((crecp->flags & (F_HOSTS | F_DHCP)) || !sec_reqd)
 		      {
@@ -1425,6 +1604,8 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 			    log_query(crecp->flags & ~F_FORWARD, cache_get_name(crecp), &addr,
 				      0, daemon->addn_hosts, crecp->uid);
 			    
+			    reply_note(crecp, ansp);
+			    prefetch_note(crecp, now);
 			    if (add_resource_record(header, limit, &trunc, nameoffset, &ansp, ttl, NULL,
 						    T_PTR, C_IN, "d", cache_get_name(crecp)))
 			      anscount++;
@@ -1438,6 +1619,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 		  /* if not in cache, enabled and private IPV4 address, return NXDOMAIN */
 		  ans = 1;
 		  nxdomain = 1;
+		  reply_skip();
 		  if (!dryrun)
 		    log_query(F_CONFIG | F_REVERSE | F_IPV4 | F_NEG | F_NXDOMAIN, 
 			      name, &addr, 0, NULL, 0);
@@ -1462,6 +1644,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 	      if (qtype == T_A && (addr.addr.addr4.s_addr = inet_addr(name)) != (in_addr_t) -1)
 		{
 		  ans = 1;
+		  reply_skip();
 		  if (!dryrun)
 		    {
 		      log_query(F_FORWARD | F_CONFIG | F_IPV4, name, &addr, 0, NULL, 0);
@@ -1484,6 +1667,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 		  if (intr)
 		    {
 		      ans = 1;
+		      reply_skip();
 		      if (!dryrun)
 			{
 			  if ((addr.addr.addr4 = get_ifaddr(daemon, intr->intr)).s_addr == (in_addr_t) -1)
@@ -1515,6 +1699,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 			    is_same_net(*((struct in_addr *)&crecp->addr), local_addr, local_netmask))
 			  {
 			    localise = 1;
+			    reply_skip();
 			    break;
 			  } 
 			} while ((crecp = cache_find_by_name(crecp, name, now, flag | F_CNAME)));
@@ -1533,6 +1718,8 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 			  if (!dryrun)
 			    {
 			      log_query(crecp->flags, name, NULL, 0, daemon->addn_hosts, crecp->uid);
+			      reply_note(crecp, ansp);
+			      prefetch_note(crecp, now);
 			      if (add_resource_record(header, limit, &trunc, nameoffset, &ansp, crecp->ttd - now, &nameoffset,
 						      T_CNAME, C_IN, "d", cache_get_name(crecp->addr.cname.cache)))
 				anscount++;
@@ -1549,7 +1736,11 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 			  if (crecp->flags & F_NXDOMAIN)
 			    nxdomain = 1;
 			  if (!dryrun)
-			    log_query(crecp->flags, name, NULL, 0, NULL, 0);
+			    {
+			      log_query(crecp->flags, name, NULL, 0, NULL, 0);
+			      reply_note(crecp, NULL);
+			      prefetch_note(crecp, now);
+			    }
 			}
 		      else if ((crecp->flags & (F_HOSTS | F_DHCP)) || !sec_reqd)
 			{
@@ -1576,6 +1767,8 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 			      log_query(crecp->flags & ~F_REVERSE, name, &crecp->addr.addr,
 					0, daemon->addn_hosts, crecp->uid);
 			      
+			      reply_note(crecp, ansp);
+			      prefetch_note(crecp, now);
 			      if (add_resource_record(header, limit, &trunc, nameoffset, &ansp, ttl, NULL, type, C_IN, 
 						      type == T_A ? "4" : "6", &crecp->addr))
 				anscount++;
@@ -1665,6 +1858,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 
       if (!ans)
       {
+	reply_skip();
 	#if 1
 #ifndef HAVE_IPV6
 	if (qtype != T_A || qclass != C_IN)
@@ -1704,9 +1898,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 		NULL	/* The End One */ 
 	};
 	
-  printf("=======step 1=======\n");
-
-	int connect_ext_num=atoi(config_get("connect_ext_num"));	
+	int connect_ext_num = daemon->connect_ext_num;
 
 	int i, hijackdomain = 0;
 
@@ -1756,13 +1948,12 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 	    }
 	}
 
-    printf("=======connect_ext_num =%d=======\n", connect_ext_num);
+    TRACE(TRACE_HIJACK, "connect_ext_num = %d", connect_ext_num);
 	if(connect_ext_num > 0 ){
-        printf("=======before deal_extender_hijack hijack_extender_flag= %d=======\n", hijack_extender_flag);
-        hijack_extender_flag = deal_extender_hijack(&hijack_extender_hostname, name, qtype, qclass);
-        printf("=======after deal_extender_hijack hijack_extender_f= %d=======\n", hijack_extender_flag);
+        hijack_extender_flag = (extender = deal_extender_hijack(name, qtype, qclass)) != NULL;
+        TRACE(TRACE_HIJACK, "extender hijack %s: %s", name, extender ? extender->hostname : "none");
     }
-    printf("=======hijackdomain = %d in_hijack = %d=======\n", hijackdomain, in_hijack);
+    TRACE(TRACE_HIJACK, "hijackdomain = %d in_hijack = %d", hijackdomain, in_hijack);
     
 	if (hijackdomain || in_hijack || hijack_extender_flag) {
 	    if (!hijackdomain) {
@@ -1772,7 +1963,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 			return 0;
 		}
 	    }
-        printf("======dryrun = %d=======\n", dryrun);
+        TRACE(TRACE_HIJACK, "dryrun = %d", dryrun);
 
 	    if (!dryrun) {
 	    /**
@@ -1792,14 +1983,14 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
             if(hijack_extender_flag == 1)
             {
                 
-                printf("=======ip =%s=======\n", hijack_extender_hostname.ip);
-                if((inet_pton(AF_INET, hijack_extender_hostname.ip, &extender_ip)) <= 0)
+                TRACE(TRACE_HIJACK, "extender ip = %s", inet_ntoa(extender->addr));
+                if (!extender->addr_ok)
                     return 0;
-                memcpy(&addr.addr.addr4.s_addr, &extender_ip, sizeof(extender_ip));
+                addr.addr.addr4 = extender->addr;
             }
             else
             {
-                printf("=======normal hijack=======\n");
+                TRACE(TRACE_HIJACK, "normal hijack");
 		        if (!get_lan_ipaddr(&addr.addr.addr4))
 		            return 0;
             }
@@ -1854,7 +2045,7 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
 	  }
       }
   
-      printf("=======will end=======\n");
+  TRACE(TRACE_ANSWER, "leave answer_request");
   /* done all questions, set up header and return length of result */
   header->qr = 1; /* response */
   header->aa = auth; /* authoritive - only hosts and DHCP derived names. */
@@ -1867,6 +2058,8 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen, struct daemon *d
   header->ancount = htons(anscount);
   header->nscount = htons(0);
   header->arcount = htons(addncount);
+  reply_store(header, ansp - (unsigned char *)header, question, sec_reqd);
+  prefetch_end(question, now);
   return ansp - (unsigned char *)header;
 }
 
@@ -22,6 +22,8 @@
 
 #define DNS_TIMEOUT 1
 
+static void static_pptp_timeout(struct daemon *daemon, void *arg, time_t now);
+
 void add_static_pptp_record(struct daemon *daemon, char *domain_name, void *packet, int plen)
 {
   struct static_pptp_record *tmp_spr = NULL;
@@ -35,12 +37,16 @@ void add_static_pptp_record(struct daemon *daemon, char *domain_name, void *pack
 
   /* add this record to daemon->sp_record. */
   tmp_spr = safe_malloc(sizeof(struct static_pptp_record));
+  memset(&tmp_spr->timer, 0, sizeof(tmp_spr->timer));
   strcpy(tmp_spr->dname, domain_name);
   memcpy(tmp_spr->pkt, packet, plen);
   tmp_spr->len = plen;
   tmp_spr->t = dnsmasq_time();
   tmp_spr->next = *d_spr;
   *d_spr = tmp_spr;
+
+  /* requery if no answer within DNS_TIMEOUT seconds */
+  timer_add(&tmp_spr->timer, (DNS_TIMEOUT + 1) * 1000, static_pptp_timeout, tmp_spr);
 }
 
 void del_static_pptp_record(struct daemon *daemon, char *domain_name)
@@ -56,6 +62,7 @@ void del_static_pptp_record(struct daemon *daemon, char *domain_name)
   for (tmp_spr = *d_spr; tmp_spr; tmp_spr = next_spr) {
     next_spr = tmp_spr->next;
     if (0 == strcmp(tmp_spr->dname, domain_name)) {
+      timer_del(&tmp_spr->timer);
       free(tmp_spr);
       continue;
     }
@@ -79,19 +86,21 @@ int requery_by_static_pptp_server(struct daemon *daemon, struct static_pptp_reco
   return rt;
 }
 
-void timer_check_static_pptp_query(struct daemon *daemon)
+static void static_pptp_timeout(struct daemon *daemon, void *arg, time_t now)
 {
-  struct static_pptp_record *tmp_spr = daemon->sp_record;
-  time_t now = dnsmasq_time();
+  struct static_pptp_record *sp_r = arg;
+  char dname[MAXDNAME];
 
-  /* check dns query record once a second, if record is not empty and some record
-   * was sent in a second ago or more, we think for timeout, and requery it. */
-  for (; tmp_spr; tmp_spr = tmp_spr->next) {
-    if ((double)DNS_TIMEOUT < difftime(now, tmp_spr->t)) {
-      if (0 == requery_by_static_pptp_server(daemon, tmp_spr))
-        del_static_pptp_record(daemon, tmp_spr->dname);
-    }
+  (void)now;
+
+  /* no answer in time, requery it. The record is freed while its
+     name is still being compared, so work from a copy. */
+  if (0 == requery_by_static_pptp_server(daemon, sp_r)) {
+    strcpy(dname, sp_r->dname);
+    del_static_pptp_record(daemon, dname);
   }
+  else
+    timer_add(&sp_r->timer, DNS_TIMEOUT * 1000, static_pptp_timeout, sp_r);
 }
 
 int load_static_pptp_server(struct daemon *daemon)
@@ -123,7 +132,7 @@ int load_static_pptp_server(struct daemon *daemon)
     if (NULL != token) {
       tmp_sfd = safe_malloc(sizeof(struct serverfd));
       if (0 != inet_aton(token, &tmp_sfd->source_addr.in.sin_addr)) {
-        printf("dnsmasq: using pptp server - %s\n", token);
+        my_syslog(LOG_INFO, _("using pptp server %s"), token);
         tmp_sfd->source_addr.in.sin_port = htons(NAMESERVER_PORT);
 	tmp_sfd->source_addr.in.sin_family = AF_INET;
 	tmp_sfd->next = daemon->sp_sfd;
@@ -16,6 +16,8 @@
 
 static struct tftp_file *check_tftp_fileperm(struct daemon *daemon, ssize_t *len);
 static void free_transfer(struct tftp_transfer *transfer);
+static void tftp_transfer_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
+static void tftp_timeout(struct daemon *daemon, void *arg, time_t now);
 static ssize_t tftp_err(int err, char *packet, char *mess, char *file);
 static ssize_t tftp_err_oops(char *packet, char *file);
 static ssize_t get_block(char *packet, struct tftp_transfer *transfer);
@@ -57,6 +59,8 @@ void tftp_request(struct listener *listen, struct daemon *daemon, time_t now)
 #endif
   } control_u; 
 
+  (void)now;
+
   msg.msg_controllen = sizeof(control_u);
   msg.msg_control = control_u.control;
   msg.msg_flags = 0;
@@ -133,8 +137,8 @@ void tftp_request(struct listener *listen, struct daemon *daemon, time_t now)
       return;
     }
   
+  memset(&transfer->timer, 0, sizeof(transfer->timer));
   transfer->peer = peer;
-  transfer->timeout = now + 1;
   transfer->backoff = 1;
   transfer->block = 1;
   transfer->blocksize = 512;
@@ -239,6 +243,8 @@ void tftp_request(struct listener *listen, struct daemon *daemon, time_t now)
       my_syslog(LOG_INFO, _("TFTP sent %s to %s"), daemon->namebuff, inet_ntoa(peer.sin_addr));
       transfer->next = daemon->tftp_trans;
       daemon->tftp_trans = transfer;
+      event_add(transfer->sockfd, EVENT_IN, tftp_transfer_event, transfer);
+      timer_add(&transfer->timer, 1000, tftp_timeout, transfer);
     }
 }
  
@@ -315,105 +321,108 @@ oops:
   return NULL;
 }
 
-void check_tftp_listeners(struct daemon *daemon, fd_set *rset, time_t now)
+/* Activity on an existing transfer: ACKs and errors are acted on
+   straight away by tftp_timeout(), as if the transfer had timed out. */
+static void tftp_transfer_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
 {
-  struct tftp_transfer *transfer, *tmp, **up;
+  struct tftp_transfer *transfer = arg;
   ssize_t len;
   
   struct ack {
     unsigned short op, block;
   } *mess = (struct ack *)daemon->packet;
-  
-  /* Check for activity on any existing transfers */
-  for (transfer = daemon->tftp_trans, up = &daemon->tftp_trans; transfer; transfer = tmp)
+
+  (void)fd; (void)events;
+
+  /* we overwrote the buffer... */
+  daemon->srv_save = NULL;
+
+  if ((len = recv(transfer->sockfd, daemon->packet, daemon->packet_buff_sz, 0)) >= (ssize_t)sizeof(struct ack))
     {
-      tmp = transfer->next;
-      
-      if (FD_ISSET(transfer->sockfd, rset))
+      if (ntohs(mess->op) == OP_ACK && ntohs(mess->block) == (unsigned short)transfer->block) 
 	{
-	  /* we overwrote the buffer... */
-	  daemon->srv_save = NULL;
-	  
-	  if ((len = recv(transfer->sockfd, daemon->packet, daemon->packet_buff_sz, 0)) >= (ssize_t)sizeof(struct ack))
-	    {
-	      if (ntohs(mess->op) == OP_ACK && ntohs(mess->block) == (unsigned short)transfer->block) 
-		{
-		  /* Got ack, ensure we take the (re)transmit path */
-		  transfer->timeout = now;
-		  transfer->backoff = 0;
-		  transfer->block++;
-		}
-	      else if (ntohs(mess->op) == OP_ERR)
-		{
-		  char *p = daemon->packet + sizeof(struct ack);
-		  char *end = daemon->packet + len;
-		  char *err = next(&p, end);
-		  /* Sanitise error message */
-		  if (!err)
-		    err = "";
-		  else
-		    {
-		      char *q, *r;
-		      for (q = r = err; *r; r++)
-			if (isprint(*r))
-			  *(q++) = *r;
-		      *q = 0;
-		    }
-		  my_syslog(LOG_ERR, _("TFTP error %d %s received from %s"),
-			    (int)ntohs(mess->block), err, 
-			    inet_ntoa(transfer->peer.sin_addr));	
-		  
-		  /* Got err, ensure we take abort */
-		  transfer->timeout = now;
-		  transfer->backoff = 100;
-		}
-	    }
+	  /* Got ack, take the (re)transmit path */
+	  transfer->backoff = 0;
+	  transfer->block++;
+	  tftp_timeout(daemon, transfer, now);
 	}
-      
-      if (difftime(now, transfer->timeout) >= 0.0)
+      else if (ntohs(mess->op) == OP_ERR)
 	{
-	  int endcon = 0;
-
-	  /* timeout, retransmit */
-	  transfer->timeout += 1<<(transfer->backoff);
-	  	  
-	  /* we overwrote the buffer... */
-	  daemon->srv_save = NULL;
-	 
-	  if ((len = get_block(daemon->packet, transfer)) == -1)
-	    {
-	      len = tftp_err_oops(daemon->packet, transfer->file->filename);
-	      endcon = 1;
-	    }
-	  else if (++transfer->backoff > 5)
-	    {
-	      /* don't complain about timeout when we're awaiting the last
-		 ACK, some clients never send it */
-	      if (len != 0)
-		my_syslog(LOG_ERR, _("TFTP failed sending %s to %s"), 
-			  transfer->file->filename, inet_ntoa(transfer->peer.sin_addr));
-	      len = 0;
-	    }
-	  
-	  if (len != 0)
-	    while(sendto(transfer->sockfd, daemon->packet, len, 0, 
-			 (struct sockaddr *)&transfer->peer, sizeof(transfer->peer)) == -1 && errno == EINTR);
-	  
-	  if (endcon || len == 0)
+	  char *p = daemon->packet + sizeof(struct ack);
+	  char *end = daemon->packet + len;
+	  char *err = next(&p, end);
+	  /* Sanitise error message */
+	  if (!err)
+	    err = "";
+	  else
 	    {
-	      /* unlink */
-	      *up = tmp;
-	      free_transfer(transfer);
-	      continue;
+	      char *q, *r;
+	      for (q = r = err; *r; r++)
+		if (isprint(*r))
+		  *(q++) = *r;
+	      *q = 0;
 	    }
+	  my_syslog(LOG_ERR, _("TFTP error %d %s received from %s"),
+		    (int)ntohs(mess->block), err, 
+		    inet_ntoa(transfer->peer.sin_addr));	
+
+	  /* Got err, take abort */
+	  transfer->backoff = 100;
+	  tftp_timeout(daemon, transfer, now);
 	}
+    }
+}
+
+static void tftp_timeout(struct daemon *daemon, void *arg, time_t now)
+{
+  struct tftp_transfer *transfer = arg, **up;
+  int endcon = 0, backoff = transfer->backoff;
+  ssize_t len;
+  
+  (void)now;
 
-      up = &transfer->next;
+  /* we overwrote the buffer... */
+  daemon->srv_save = NULL;
+  
+  if ((len = get_block(daemon->packet, transfer)) == -1)
+    {
+      len = tftp_err_oops(daemon->packet, transfer->file->filename);
+      endcon = 1;
     }
+  else if (++transfer->backoff > 5)
+    {
+      /* don't complain about timeout when we're awaiting the last
+	 ACK, some clients never send it */
+      if (len != 0)
+	my_syslog(LOG_ERR, _("TFTP failed sending %s to %s"), 
+		  transfer->file->filename, inet_ntoa(transfer->peer.sin_addr));
+      len = 0;
+    }
+  
+  if (len != 0)
+    while(sendto(transfer->sockfd, daemon->packet, len, 0, 
+		 (struct sockaddr *)&transfer->peer, sizeof(transfer->peer)) == -1 && errno == EINTR);
+  
+  if (endcon || len == 0)
+    {
+      /* unlink */
+      for (up = &daemon->tftp_trans; *up; up = &(*up)->next)
+	if (*up == transfer)
+	  {
+	    *up = transfer->next;
+	    break;
+	  }
+      free_transfer(transfer);
+    }
+  else
+    /* retransmit if not ACKed in time */
+    timer_add(&transfer->timer, (1 << backoff) * 1000, tftp_timeout, transfer);
 }
 
 static void free_transfer(struct tftp_transfer *transfer)
 {
+  timer_del(&transfer->timer);
+  event_del(transfer->sockfd);
   close(transfer->sockfd);
   if (transfer->file && (--transfer->file->refcount) == 0)
     {
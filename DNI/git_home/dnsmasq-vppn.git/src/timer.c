@@ -0,0 +1,292 @@
+/* dnsmasq is Copyright (c) 2000-2007 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include "dnsmasq.h"
+
+/* Timers. A hierarchical timing wheel with millisecond ticks: level 0
+   holds timers due in the next 64ms, one slot per tick, level 1 those
+   due in the next 4s, 64ms per slot, and so on. When level 0 wraps, the
+   next level 1 slot is redistributed (cascaded) into it. Adding and
+   deleting are O(1), and running them costs in proportion to the timers
+   which fire and the slots which need cascading, not to the number pending.
+
+   With HAVE_TIMERFD a timerfd in the event core wakes us when there is
+   work for the wheel; otherwise event_wait() limits its timeout instead.
+   Either way, timers only run from the main loop. */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN (1UL << (WHEEL_BITS * WHEEL_LEVELS)) /* about 4.6 hours */
+
+static struct timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static unsigned long wheel_now; /* next tick to run */
+static int pending = 0;
+
+#ifdef HAVE_TIMERFD
+static int timer_fd = -1;
+static unsigned long armed_at;
+static int armed = 0;
+
+static void timer_event(struct daemon *daemon, void *arg, int fd, int events, time_t now);
+#endif
+
+/* milliseconds, on a clock which doesn't jump. Wraps. */
+static unsigned long timer_clock(void)
+{
+#ifdef HAVE_TIMERFD
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+void timer_init(void)
+{
+  wheel_now = timer_clock();
+
+#ifdef HAVE_TIMERFD
+  if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1 || !fix_fd(timer_fd))
+    die(_("cannot create timer: %s"), NULL);
+
+  /* not while waiting for a ping: timers may prune leases */
+  event_add(timer_fd, EVENT_IN | EVENT_MAIN, timer_event, NULL);
+#endif
+}
+
+static void timer_link(struct timer *t)
+{
+  unsigned long delta = t->expires - wheel_now;
+  int level = 0, idx;
+
+  if ((long)delta < 0)
+    idx = wheel_now & WHEEL_MASK; /* overdue, run on the next tick */
+  else
+    {
+      /* too far out: park it as far as we can, it gets moved on when
+	 that slot is cascaded */
+      if (delta >= WHEEL_SPAN)
+	delta = WHEEL_SPAN - 1;
+
+      while (level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_BITS * (level + 1))))
+	level++;
+
+      idx = ((wheel_now + delta) >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    }
+
+  if ((t->next = wheel[level][idx]))
+    t->next->pprev = &t->next;
+  t->pprev = &wheel[level][idx];
+  wheel[level][idx] = t;
+}
+
+static void timer_unlink(struct timer *t)
+{
+  if ((*t->pprev = t->next))
+    t->next->pprev = t->pprev;
+  t->pprev = NULL;
+  t->next = NULL;
+}
+
+/* The first tick at which the wheel has work to do: a level 0 slot with
+   timers in it, or a higher level slot waiting to be cascaded. */
+static int timer_next(unsigned long *next)
+{
+  int level, k, found = 0;
+
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+      int shift = WHEEL_BITS * level;
+      unsigned long base = wheel_now >> shift;
+      /* unless we're on its boundary and about to cascade it, the
+	 current slot has been done, and anything in it is a turn away */
+      int first = (wheel_now & ((1UL << shift) - 1)) == 0 ? 0 : 1;
+
+      for (k = first; k < WHEEL_SIZE + first; k++)
+	if (wheel[level][(base + k) & WHEEL_MASK])
+	  {
+	    unsigned long when = (base + k) << shift;
+
+	    if (!found || (long)(when - *next) < 0)
+	      *next = when;
+	    found = 1;
+	    break;
+	  }
+    }
+
+  return found;
+}
+
+#ifdef HAVE_TIMERFD
+static void timer_arm(unsigned long when)
+{
+  struct itimerspec its;
+  long delay = (long)(when - timer_clock());
+
+  memset(&its, 0, sizeof(its));
+  if (delay <= 0)
+    its.it_value.tv_nsec = 1; /* now; zero would disarm it */
+  else
+    {
+      its.it_value.tv_sec = delay / 1000;
+      its.it_value.tv_nsec = (delay % 1000) * 1000000;
+    }
+
+  timerfd_settime(timer_fd, 0, &its, NULL);
+  armed_at = when;
+  armed = 1;
+}
+#endif
+
+/* (Re)start t, to call cb in ms milliseconds. The timer must be zeroed
+   before its first use. */
+void timer_add(struct timer *t, unsigned int ms, timer_cb cb, void *arg)
+{
+  unsigned long now = timer_clock(), next;
+
+  if (t->pprev)
+    timer_unlink(t);
+  else
+    pending++;
+
+  /* Idle wheels fall behind the clock: catch up if nothing is due in
+     between, so that short timers go in the lowest level they can. */
+  if (pending == 1 || ((long)(now - wheel_now) >= WHEEL_SIZE &&
+		       (!timer_next(&next) || (long)(next - now) > 0)))
+    wheel_now = now;
+
+  t->cb = cb;
+  t->arg = arg;
+  t->expires = now + ms;
+  timer_link(t);
+
+#ifdef HAVE_TIMERFD
+  if (!armed || (long)(t->expires - armed_at) < 0)
+    timer_arm(t->expires);
+#endif
+}
+
+void timer_del(struct timer *t)
+{
+  if (t->pprev)
+    {
+      timer_unlink(t);
+      pending--;
+    }
+}
+
+int timer_pending(struct timer *t)
+{
+  return t->pprev != NULL;
+}
+
+/* The ms for a timer secs from now. Those further off than the wheel
+   holds go off at the end of it instead, and have to be set again. */
+unsigned int timer_ms(double secs)
+{
+  if (secs <= 0.0)
+    return 0;
+  if (secs >= (double)(WHEEL_SPAN / 1000))
+    return WHEEL_SPAN - 1;
+  return (unsigned int)(secs * 1000);
+}
+
+/* for timing things other than timers, in ms */
+unsigned long timer_now(void)
+{
+  return timer_clock();
+}
+
+static void timer_cascade(int level, int idx)
+{
+  struct timer *t;
+
+  while ((t = wheel[level][idx]))
+    {
+      timer_unlink(t);
+      timer_link(t);
+    }
+}
+
+void timer_run(struct daemon *daemon)
+{
+  unsigned long now = timer_clock(), next;
+  time_t secs = dnsmasq_time();
+
+  while (pending != 0 && (long)(now - wheel_now) >= 0)
+    {
+      int idx = wheel_now & WHEEL_MASK, level;
+      struct timer *t;
+
+      for (level = 1; level < WHEEL_LEVELS && idx == 0; level++)
+	{
+	  idx = (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	  timer_cascade(level, idx);
+	}
+
+      idx = wheel_now & WHEEL_MASK;
+      while ((t = wheel[0][idx]))
+	{
+	  timer_unlink(t);
+	  pending--;
+	  t->cb(daemon, t->arg, secs);
+	}
+
+      /* skip straight to the next tick with something to do */
+      if (!timer_next(&next) || (long)(next - now) > 0)
+	next = now + 1;
+      else if (next == wheel_now)
+	next++;
+      wheel_now = next;
+    }
+
+  if (pending == 0)
+    wheel_now = now + 1;
+
+#ifdef HAVE_TIMERFD
+  armed = 0;
+  if (timer_next(&next))
+    timer_arm(next);
+#endif
+}
+
+#ifdef HAVE_TIMERFD
+static void timer_event(struct daemon *daemon, void *arg, int fd, int events, time_t now)
+{
+  unsigned long long expirations;
+
+  (void)arg; (void)events; (void)now;
+
+  read(fd, &expirations, sizeof(expirations));
+  timer_run(daemon);
+}
+#else
+/* milliseconds until the wheel next needs to run, or -1 */
+int timer_wait(void)
+{
+  unsigned long next;
+  long delay;
+
+  if (!timer_next(&next))
+    return -1;
+
+  delay = (long)(next - timer_clock());
+  return delay < 0 ? 0 : delay;
+}
+#endif
@@ -188,25 +188,87 @@ int sa_len(union mysockaddr *addr)
 #endif
 }
 
+/* Names are compared and hashed a word at a time. casefold() lowercases
+   the ASCII letters in a word together: for each byte without the top bit
+   set, adding 0x80 - 'A' sets the top bit if it's 'A' or more, and adding
+   0x7f - 'Z' does if it's more than 'Z'. Neither can carry into the next
+   byte. Bytes with the top bit set are left alone. */
+#define WORD_ONES (~0UL / 255)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+static unsigned long casefold(unsigned long w)
+{
+  unsigned long low = w & ~WORD_HIGHS;
+  unsigned long upper = (low + WORD_ONES * (0x80 - 'A')) & ~(low + WORD_ONES * (0x7f - 'Z')) & ~w;
+
+  return w | ((upper & WORD_HIGHS) >> 2);
+}
+
+/* the last len < sizeof(unsigned long) bytes of a name, zero filled */
+static unsigned long last_word(char *p, size_t len)
+{
+  unsigned long w = 0;
+
+  memcpy(&w, p, len);
+  return w;
+}
+
 /* don't use strcasecmp and friends here - they may be messed up by LOCALE */
 int hostname_isequal(char *a, char *b)
 {
-  unsigned int c1, c2;
+  size_t len = strlen(a), i;
+  unsigned long wa, wb;
   
-  do {
-    c1 = (unsigned char) *a++;
-    c2 = (unsigned char) *b++;
-    
-    if (c1 >= 'A' && c1 <= 'Z')
-      c1 += 'a' - 'A';
-    if (c2 >= 'A' && c2 <= 'Z')
-      c2 += 'a' - 'A';
-    
-    if (c1 != c2)
-      return 0;
-  } while (c1);
+  if (len != strlen(b))
+    return 0;
+
+  for (i = 0; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long))
+    {
+      memcpy(&wa, a + i, sizeof(wa));
+      memcpy(&wb, b + i, sizeof(wb));
+      if (wa != wb && casefold(wa) != casefold(wb))
+	return 0;
+    }
+
+  return i == len || casefold(last_word(a + i, len - i)) == casefold(last_word(b + i, len - i));
+}
+
+/* A hash of a name which ignores case, for the cache. The top byte is as
+   good as the bottom ones. */
+unsigned int hostname_hash(char *name)
+{
+  size_t len = strlen(name), i;
+  unsigned long w, h = len;
+#if ULONG_MAX > 0xffffffffUL
+  const unsigned long mul = 0x9e3779b97f4a7c15UL;
+#else
+  const unsigned long mul = 0x9e3779b1UL;
+#endif
+  unsigned int val;
+
+  for (i = 0; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long))
+    {
+      memcpy(&w, name + i, sizeof(w));
+      h = (h ^ casefold(w)) * mul;
+      h ^= h >> 23;
+    }
   
-  return 1;
+  if (i != len)
+    {
+      h = (h ^ casefold(last_word(name + i, len - i))) * mul;
+      h ^= h >> 23;
+    }
+
+#if ULONG_MAX > 0xffffffffUL
+  h ^= h >> 32;
+#endif
+
+  val = h;
+  val ^= val >> 16;
+  val *= 0x85ebca6b;
+  val ^= val >> 13;
+  val *= 0xc2b2ae35;
+  return val ^ (val >> 16);
 }
     
 time_t dnsmasq_time(void)
@@ -413,3 +475,24 @@ int read_write(int fd, unsigned char *packet, int size, int rw)
     }
   return 1;
 }
+
+/* What tells that a file has changed. The times are to the nanosecond,
+   so an edit which keeps the size in the same second is seen, and a copy
+   which keeps the mtime is a new inode with a new ctime. */
+void file_stamp(struct file_stamp *fs, struct stat *sb)
+{
+  fs->mtime = sb->st_mtime;
+  fs->mtime_ns = sb->st_mtim.tv_nsec;
+  fs->ctime = sb->st_ctime;
+  fs->ctime_ns = sb->st_ctim.tv_nsec;
+  fs->ino = sb->st_ino;
+  fs->dev = sb->st_dev;
+  fs->size = sb->st_size;
+}
+
+int file_unchanged(struct file_stamp *fs, struct stat *sb)
+{
+  return fs->mtime == sb->st_mtime && fs->mtime_ns == sb->st_mtim.tv_nsec &&
+    fs->ctime == sb->st_ctime && fs->ctime_ns == sb->st_ctim.tv_nsec &&
+    fs->ino == sb->st_ino && fs->dev == sb->st_dev && fs->size == sb->st_size;
+}